@@ -0,0 +1,53 @@
+#ifndef ADAPTIVEH
+#define ADAPTIVEH
+
+#include <math.h>
+#include <vector>
+#include "vec3.h"
+
+/** Estimación de la varianza de cada píxel para el muestreo adaptativo. Cada muestra se resume en su luminancia y se
+  * acumula con el algoritmo de Welford (media y suma de cuadrados de las diferencias a la media), que es estable aunque
+  * haya muchas muestras o valores muy grandes.
+  */
+
+/// Por debajo de esta luminancia media el error relativo se mide respecto a ella, para no perseguir el ruido del negro.
+const float adaptive_dark_floor = 0.01;
+
+/// Tope de muestras por píxel del muestreo adaptativo, en múltiplos de las muestras base.
+const int adaptive_max_factor = 32;
+
+class pixel_variance {
+    public:
+        pixel_variance(int n) : mean(n, 0), m2(n, 0), count(n, 0) {}
+
+        /// Añade una muestra del píxel k.
+        void add(int k, const vec3& c) {
+            float x = 0.2126*c[0] + 0.7152*c[1] + 0.0722*c[2];
+            count[k]++;
+            float d = x - mean[k];
+            mean[k] += d / count[k];
+            m2[k] += d * (x - mean[k]);
+        }
+
+        /** Error relativo estimado de la media del píxel k: desviación típica de la media entre la luminancia media.
+          * Con menos de dos muestras no hay estimación y se devuelve infinito.
+          */
+        float relative_error(int k) const {
+            if (count[k] < 2)
+                return INFINITY;
+            float standard_error = sqrt(m2[k] / (count[k] - 1) / count[k]);
+            return standard_error / fmax(mean[k], adaptive_dark_floor);
+        }
+
+        /// Varianza estimada de la media de la luminancia del píxel k; cero con menos de dos muestras.
+        float mean_variance(int k) const {
+            return count[k] < 2 ? 0 : m2[k] / (count[k] - 1) / count[k];
+        }
+
+    private:
+        friend class checkpoint;
+        std::vector<float> mean, m2;
+        std::vector<int> count;
+};
+
+#endif
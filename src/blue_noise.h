@@ -0,0 +1,50 @@
+#ifndef BLUENOISEH
+#define BLUENOISEH
+
+#include <stdint.h>
+#include "sampler.h"
+
+/** Muestreo que reparte el error en ruido azul por la pantalla (Ahmed y Wonka, Screen-space blue-noise diffusion of
+  * Monte Carlo sampling error via hierarchical ordering of pixels). En lugar de una secuencia distinta en cada píxel,
+  * toda la imagen comparte una sola secuencia de Sobol y cada píxel toma el siguiente trozo de spp muestras en un orden
+  * jerárquico de los píxeles: el código de Morton con scrambling de Owen, que mantiene juntos los bloques de 2x2, 4x4,
+  * etc. Como cualquier bloque alineado de la secuencia está bien estratificado, el error de píxeles vecinos se
+  * compensa entre sí: se concentra en frecuencias altas, se ve mucho menos a pocas muestras y se quita mejor con un
+  * filtro. Cada píxel sigue teniendo sus spp muestras estratificadas.
+  */
+class blue_noise_sampler : public sampler {
+    public:
+        /** @param b Sampler que da la secuencia común; tiene que estratificar los bloques consecutivos (sobol o halton).
+          * @param width Ancho de la imagen.
+          * @param height Alto de la imagen.
+          * @param samples Muestras por píxel de cada pasada.
+          */
+        blue_noise_sampler(sampler *b, int width, int height, int samples, uint32_t s = 0)
+            : sampler(s), base(b), nx(width), spp(samples > 0 ? samples : 1) {
+            for (bits = 0; (1 << bits) < width || (1 << bits) < height; bits++)
+                ;
+            bits *= 2;
+        }
+        virtual float get_1d(uint32_t pixel, uint32_t index, uint32_t dim) {
+            return base->get_1d(0, global_index(pixel, index), dim);
+        }
+        virtual void get_2d(uint32_t pixel, uint32_t index, uint32_t dim, float& u, float& v) {
+            base->get_2d(0, global_index(pixel, index), dim, u, v);
+        }
+
+    private:
+        /** Posición de la muestra index del píxel en la secuencia común. Si se piden más de spp muestras (muestreo
+          * adaptativo), cada tanda de spp usa otro tramo de la secuencia, detrás del de toda la imagen.
+          */
+        uint32_t global_index(uint32_t pixel, uint32_t index) const {
+            uint32_t x = pixel % nx, y = pixel / nx, morton = 0;
+            for (int b = 0; b < bits/2; b++)
+                morton |= ((x >> b) & 1) << (2*b) | ((y >> b) & 1) << (2*b + 1);
+            uint32_t rank = bits ? nested_uniform_scramble(morton << (32 - bits), seed) >> (32 - bits) : 0;
+            return ((index / spp) << bits) * spp + rank * spp + index % spp;
+        }
+        sampler *base;
+        int nx, spp, bits;
+};
+
+#endif
@@ -11,37 +11,100 @@
 // with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
 //==================================================================================================
 
-#include "aarect.h"
-#include "hittable_list.h"
+#include "hittable.h"
 
 
 class box: public hittable  {
     public:
         box() {}
         box(const vec3& p0, const vec3& p1, material *ptr);
+        box(const vec3& p0, const vec3& p1, material *face_mats[6]);
         virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float t0, float t1, hit_query& q) const;
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
                box =  aabb(pmin, pmax);
                return true; }
         vec3 pmin, pmax;
-        hittable *list_ptr;
+        // one material per face, in the order +z, -z, +y, -y, +x, -x
+        material *mats[6];
 };
 
 box::box(const vec3& p0, const vec3& p1, material *ptr) {
     pmin = p0;
     pmax = p1;
-    hittable **list = new hittable*[6];
-    list[0] = new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr);
-    list[1] = new flip_normals(new xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
-    list[2] = new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr);
-    list[3] = new flip_normals(new xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-    list[4] = new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr);
-    list[5] = new flip_normals(new yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-    list_ptr = new hittable_list(list,6);
+    for (int i = 0; i < 6; i++)
+        mats[i] = ptr;
+}
+
+box::box(const vec3& p0, const vec3& p1, material *face_mats[6]) {
+    pmin = p0;
+    pmax = p1;
+    for (int i = 0; i < 6; i++)
+        mats[i] = face_mats[i];
 }
 
 bool box::hit(const ray& r, float t0, float t1, hit_record& rec) const {
-    return list_ptr->hit(r, t0, t1, rec);
+    return hit_deferred(this, r, t0, t1, rec);
+}
+
+// Single slab test. The entry face (or the exit face when the ray starts inside)
+// gives the outward normal and the same uvs the six axis-aligned rectangles used to.
+// The face is kept in q.prim as 2*axis + is_max.
+bool box::intersect(const ray& r, float t0, float t1, hit_query& q) const {
+    float t_near = -FLT_MAX, t_far = FLT_MAX;
+    int near_axis = 0, far_axis = 0;
+    bool near_max = false, far_max = false;
+    for (int a = 0; a < 3; a++) {
+        float inv_d = 1.0f / r.direction()[a];
+        float ta = (pmin[a] - r.origin()[a]) * inv_d;
+        float tb = (pmax[a] - r.origin()[a]) * inv_d;
+        bool flipped = inv_d < 0;
+        if (flipped) {
+            float tmp = ta; ta = tb; tb = tmp;
+        }
+        if (ta > t_near) {
+            t_near = ta;
+            near_axis = a;
+            near_max = flipped;
+        }
+        if (tb < t_far) {
+            t_far = tb;
+            far_axis = a;
+            far_max = !flipped;
+        }
+    }
+    if (t_near > t_far)
+        return false;
+    float t;
+    int axis;
+    bool is_max;
+    if (t_near >= t0 && t_near <= t1) {
+        t = t_near; axis = near_axis; is_max = near_max;
+    }
+    else if (t_far >= t0 && t_far <= t1) {
+        t = t_far; axis = far_axis; is_max = far_max;
+    }
+    else
+        return false;
+    set_query(q, t, this);
+    q.prim = 2*axis + (is_max ? 1 : 0);
+    return true;
+}
+
+void box::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    int axis = q.prim / 2;
+    bool is_max = q.prim & 1;
+    rec.t = q.t;
+    rec.p = r.point_at_parameter(q.t);
+    vec3 normal(0, 0, 0);
+    normal[axis] = is_max ? 1 : -1;
+    rec.normal = normal;
+    rec.mat_ptr = mats[2*(2-axis) + (is_max ? 0 : 1)];
+    int ua = (axis == 0) ? 1 : 0;
+    int va = (axis == 2) ? 1 : 2;
+    rec.u = (rec.p[ua] - pmin[ua]) / (pmax[ua] - pmin[ua]);
+    rec.v = (rec.p[va] - pmin[va]) / (pmax[va] - pmin[va]);
 }
 
 #endif
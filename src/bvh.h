@@ -12,6 +12,7 @@
 //==================================================================================================
 
 #include "hittable.h"
+#include "stats.h"
 
 
 class bvh_node : public hittable  {
@@ -19,6 +20,8 @@ class bvh_node : public hittable  {
         bvh_node() {}
         bvh_node(hittable **l, int n, float time0, float time1);
         virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_query& q) const;
+        virtual bool occluded(const ray& r, float tmin, float tmax) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
         hittable *left;
         hittable *right;
@@ -32,31 +35,29 @@ bool bvh_node::bounding_box(float t0, float t1, aabb& b) const {
 }
 
 bool bvh_node::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+// The right child is searched only up to the left hit, so q always holds the closest one.
+bool bvh_node::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
+    STAT_INC(node_visits);
     if (box.hit(r, t_min, t_max)) {
-        hit_record left_rec, right_rec;
-        bool hit_left = left->hit(r, t_min, t_max, left_rec);
-        bool hit_right = right->hit(r, t_min, t_max, right_rec);
-        if (hit_left && hit_right) {
-            if (left_rec.t < right_rec.t)
-                rec = left_rec;
-            else
-                rec = right_rec;
-            return true;
-        }
-        else if (hit_left) {
-            rec = left_rec;
-            return true;
-        }
-        else if (hit_right) {
-            rec = right_rec;
-            return true;
-        }
-        else
-            return false;
+        bool hit_left = left->intersect(r, t_min, t_max, q);
+        if (right == left)
+            return hit_left;
+        bool hit_right = right->intersect(r, t_min, hit_left ? q.t : t_max, q);
+        return hit_left || hit_right;
     }
     else return false;
 }
 
+bool bvh_node::occluded(const ray& r, float t_min, float t_max) const {
+    STAT_INC(node_visits);
+    if (!box.hit(r, t_min, t_max))
+        return false;
+    return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
 
 int box_x_compare (const void * a, const void * b) {
     aabb box_left, box_right;
@@ -13,6 +13,7 @@
 
 #include "random.h"
 #include "ray.h"
+#include "sampler.h"
 
 
 vec3 random_in_unit_disk() {
@@ -23,6 +24,30 @@ vec3 random_in_unit_disk() {
     return p;
 }
 
+/// Punto del disco unidad a partir de un par de [0, 1)^2 con la proyección concéntrica de Shirley, que conserva la estratificación.
+vec3 concentric_disk(float u, float v) {
+    float a = 2*u - 1, b = 2*v - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+    float r, phi;
+    if (a*a > b*b) {
+        r = a;
+        phi = (M_PI/4)*(b/a);
+    }
+    else {
+        r = b;
+        phi = M_PI/2 - (M_PI/4)*(a/b);
+    }
+    return vec3(r*cos(phi), r*sin(phi), 0);
+}
+
+/// Punto del disco unidad con el flujo de la lente de la muestra actual.
+vec3 sample_lens() {
+    float u, v;
+    sample_2d(stream_lens, u, v);
+    return concentric_disk(u, v);
+}
+
 class camera {
     public:
         // new:  add t0 and t1
@@ -44,12 +69,35 @@ class camera {
 
         // new: add time to construct ray
         ray get_ray(float s, float t) {
-            vec3 rd = lens_radius*random_in_unit_disk();
+            // Con lens_radius 0 (cámara estenopeica) no hace falta muestrear la lente.
+            vec3 rd = lens_radius > 0 ? lens_radius*sample_lens() : vec3(0, 0, 0);
             vec3 offset = u * rd.x() + v * rd.y();
-            float time = time0 + random_double()*(time1-time0);
+            float time = time0 + sample_1d(stream_time)*(time1-time0);
             return ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset, time);
         }
 
+        /** Genera a la vez los rayos de n puntos (s[i], t[i]) de la imagen, con n <= ray_packet_max. Con una cámara
+          * estenopeica todos salen del mismo origen y sólo se calcula la dirección.
+          * Si se da states, la lente y el tiempo del rayo i salen de la muestra states[i].
+          */
+        void get_rays(const float *s, const float *t, int n, ray_packet& p, sample_state *states = 0) {
+            p.size = n;
+            for (int i = 0; i < n; i++) {
+                if (states)
+                    use_sample_state(&states[i]);
+                vec3 offset(0, 0, 0);
+                if (lens_radius > 0) {
+                    vec3 rd = lens_radius*sample_lens();
+                    offset = u * rd.x() + v * rd.y();
+                }
+                vec3 o = origin + offset;
+                vec3 d = lower_left_corner + s[i]*horizontal + t[i]*vertical - o;
+                p.ox[i] = o.x(); p.oy[i] = o.y(); p.oz[i] = o.z();
+                p.dx[i] = d.x(); p.dy[i] = d.y(); p.dz[i] = d.z();
+                p.time[i] = time0 + sample_1d(stream_time)*(time1-time0);
+            }
+        }
+
         vec3 origin;
         vec3 lower_left_corner;
         vec3 horizontal;
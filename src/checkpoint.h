@@ -0,0 +1,160 @@
+#ifndef CHECKPOINTH
+#define CHECKPOINTH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+#include "adaptive.h"
+#include "denoise.h"
+#include "film.h"
+
+/// Firma al principio de los ficheros de checkpoint, con la versión del formato.
+const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '1', '\n'};
+
+/** Checkpoints de un render largo: todo lo acumulado hasta un momento (la película, las muestras de cada píxel, la
+  * varianza y las guías del filtro de ruido si las hay, el estado del generador aleatorio y por dónde iba el render) se
+  * guarda en un fichero binario, y con él el render se puede reanudar y acabar con el mismo resultado, bit a bit, que
+  * si no se hubiera parado.
+  *
+  * El fichero lleva una descripción de la configuración del render, para no reanudar con otras opciones, y una suma de
+  * comprobación. Se escribe primero en fichero.tmp y se renombra al acabar, así que un corte a medias deja el checkpoint
+  * anterior intacto.
+  */
+class checkpoint {
+    public:
+        /// @param config Opciones que afectan a la imagen; al reanudar tienen que coincidir.
+        checkpoint(const std::string& config) : configuration(config) {}
+
+        /// Añade al estado bytes de memoria a partir de p. El bloque tiene que seguir en su sitio al guardar y cargar.
+        void add(void *p, size_t bytes) {
+            block b = {(char *) p, bytes};
+            blocks.push_back(b);
+        }
+        template <class T> void add(std::vector<T>& v) {
+            if (!v.empty())
+                add(&v[0], v.size() * sizeof(T));
+        }
+        void add(film_buffer& f) { add(f.pixels); }
+        void add(pixel_variance& v) {
+            add(v.mean);
+            add(v.m2);
+            add(v.count);
+        }
+        void add(feature_buffers& f) {
+            add(f.albedo);
+            add(f.normal);
+            add(f.depth);
+        }
+
+        /// Escribe el estado en path de forma atómica. @return Falso si no se ha podido; el fichero anterior sigue valiendo.
+        bool save(const std::string& path) const {
+            std::string tmp = path + ".tmp";
+            FILE *f = fopen(tmp.c_str(), "wb");
+            if (!f)
+                return false;
+            bool ok = write_header(f);
+            for (size_t k = 0; k < blocks.size() && ok; k++)
+                ok = fwrite(blocks[k].data, 1, blocks[k].bytes, f) == blocks[k].bytes;
+            uint64_t sum = fnv1a(configuration.data(), configuration.size());
+            for (size_t k = 0; k < blocks.size(); k++)
+                sum = fnv1a(blocks[k].data, blocks[k].bytes, sum);
+            ok = ok && fwrite(&sum, sizeof(sum), 1, f) == 1 && fflush(f) == 0;
+#ifndef _MSC_VER
+            // Que los datos estén en disco antes de renombrar; si no, un corte de luz podría dejar el nombre nuevo vacío.
+            ok = ok && fsync(fileno(f)) == 0;
+#endif
+            ok = fclose(f) == 0 && ok;
+            if (ok)
+                ok = rename(tmp.c_str(), path.c_str()) == 0;
+            if (!ok)
+                remove(tmp.c_str());
+            return ok;
+        }
+
+        /** Carga el estado de path en los bloques añadidos.
+          * @param error Motivo si no se ha podido: no existe, es de otra configuración o está dañado.
+          */
+        bool load(const std::string& path, std::string& error) {
+            FILE *f = fopen(path.c_str(), "rb");
+            if (!f) {
+                error = "cannot open " + path;
+                return false;
+            }
+            std::string config;
+            uint64_t total = 0;
+            if (!read_header(f, config, total)) {
+                fclose(f);
+                error = path + " is not a checkpoint";
+                return false;
+            }
+            if (config != configuration || total != state_bytes()) {
+                fclose(f);
+                error = path + " was written with other options (" + config + ")";
+                return false;
+            }
+            // Se lee todo aparte y sólo se copia a los bloques si la suma cuadra, para no dejar el estado a medias.
+            std::vector<char> data(total);
+            uint64_t sum = 0;
+            bool ok = (total == 0 || fread(&data[0], 1, total, f) == total) && fread(&sum, sizeof(sum), 1, f) == 1;
+            fclose(f);
+            if (!ok || fnv1a(data.data(), total, fnv1a(config.data(), config.size())) != sum) {
+                error = path + " is truncated or corrupt";
+                return false;
+            }
+            size_t offset = 0;
+            for (size_t k = 0; k < blocks.size(); k++) {
+                std::copy(data.begin() + offset, data.begin() + offset + blocks[k].bytes, blocks[k].data);
+                offset += blocks[k].bytes;
+            }
+            return true;
+        }
+
+    private:
+        struct block {
+            char *data;
+            size_t bytes;
+        };
+
+        size_t state_bytes() const {
+            size_t total = 0;
+            for (size_t k = 0; k < blocks.size(); k++)
+                total += blocks[k].bytes;
+            return total;
+        }
+
+        /// Suma de comprobación FNV-1a de 64 bits de n bytes, siguiendo la de los bytes anteriores h.
+        static uint64_t fnv1a(const char *data, size_t n, uint64_t h = 0xcbf29ce484222325ULL) {
+            for (size_t k = 0; k < n; k++)
+                h = (h ^ (unsigned char) data[k]) * 0x100000001b3ULL;
+            return h;
+        }
+
+        /// Cabecera: firma, longitud y texto de la configuración, y bytes de estado que siguen.
+        bool write_header(FILE *f) const {
+            uint32_t length = configuration.size();
+            uint64_t total = state_bytes();
+            return fwrite(checkpoint_magic, 1, sizeof(checkpoint_magic), f) == sizeof(checkpoint_magic) &&
+                   fwrite(&length, sizeof(length), 1, f) == 1 && fwrite(configuration.data(), 1, length, f) == length &&
+                   fwrite(&total, sizeof(total), 1, f) == 1;
+        }
+
+        bool read_header(FILE *f, std::string& config, uint64_t& total) const {
+            char m[sizeof(checkpoint_magic)];
+            uint32_t length;
+            if (fread(m, 1, sizeof(m), f) != sizeof(m) || !std::equal(m, m + sizeof(m), checkpoint_magic) ||
+                fread(&length, sizeof(length), 1, f) != 1 || length > 4096)
+                return false;
+            config.resize(length);
+            return (length == 0 || fread(&config[0], 1, length, f) == length) && fread(&total, sizeof(total), 1, f) == 1;
+        }
+
+        std::string configuration;
+        std::vector<block> blocks;
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef DENOISEH
+#define DENOISEH
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "material.h"
+#include "vec3.h"
+
+/** Filtro de eliminación de ruido para renders con pocas muestras: el filtro à-trous guiado por aristas (Dammertz et
+  * al., con los pesos de luminancia y varianza de SVGF). Se aplican varias pasadas de un núcleo B-spline de 5x5 con los
+  * huecos cada vez el doble de separados, y cada vecino pesa menos cuanto más se aleja del píxel en normal, profundidad,
+  * color base y luminancia (ésta escalada por la desviación típica estimada del píxel), para no mezclar superficies
+  * distintas ni borrar las aristas. El color se divide antes por el color base del primer impacto y se multiplica
+  * después, así que lo que se filtra es la iluminación y las texturas no se emborronan.
+  */
+
+/// Datos del primer impacto de cada píxel, sumados sobre sus muestras. Los rayos que no cortan nada suman cero.
+struct feature_buffers {
+    std::vector<vec3> albedo, normal;
+    std::vector<float> depth;
+
+    feature_buffers(int n) : albedo(n, vec3(0, 0, 0)), normal(n, vec3(0, 0, 0)), depth(n, 0) {}
+    /// Suma el primer impacto rec del rayo r de una muestra del píxel k, con la normal vuelta hacia la cámara.
+    void add(int k, const ray& r, const hit_record& rec) {
+        albedo[k] += rec.mat_ptr->base_color(rec);
+        normal[k] += dot(rec.normal, r.direction()) > 0 ? -rec.normal : rec.normal;
+        depth[k] += rec.t * r.direction().length();
+    }
+};
+
+/** exp(-x) para x >= 0, sin llamadas ni comparaciones para que el bucle del filtro se vectorice sin -ffast-math:
+  * 2^(-x log2 e) con la parte entera en el exponente del float y la fraccionaria con un polinomio (error relativo por
+  * debajo de 1e-5). Por encima de 80 se toma 80.
+  */
+inline float exp_neg(float x) {
+    // El tope, sobre los bits: con x >= 0 los floats se ordenan como sus enteros.
+    const float top = 80;
+    int32_t xb, tb;
+    memcpy(&xb, &x, sizeof(x));
+    memcpy(&tb, &top, sizeof(top));
+    int32_t d = xb - tb;
+    xb = tb + (d & (d >> 31));
+    memcpy(&x, &xb, sizeof(x));
+    // y está en [12.5, 128]: sumarle 1.5*2^23 deja y - 0.5 redondeado en los bits bajos, que es su parte entera.
+    float y = 128 - x * 1.44269504f;
+    float t = (y - 0.5f) + 12582912.0f;
+    int32_t i;
+    memcpy(&i, &t, sizeof(t));
+    i -= 0x4b400000;
+    float f = y - (t - 12582912.0f);
+    float p = 1 + f*(0.69314718f + f*(0.24022652f + f*(0.05550411f + f*(0.00961813f + f*0.00133336f))));
+    // 2^(i - 128), con el sesgo 127 del exponente.
+    int32_t e = (i - 1) << 23;
+    float scale;
+    memcpy(&scale, &e, sizeof(scale));
+    return p * scale;
+}
+
+/// El peso por normal es el coseno entre las dos normales elevado a 2^denoise_normal_squarings = 128.
+const int denoise_normal_squarings = 7;
+
+/// Parámetros del filtro: número de pasadas y sensibilidad a cada diferencia.
+struct denoise_params {
+    int iterations;
+    float sigma_luminance, sigma_depth, sigma_albedo;
+
+    denoise_params() : iterations(5), sigma_luminance(4), sigma_depth(1), sigma_albedo(0.1) {}
+};
+
+/// Planos de las guías del filtro: normal, profundidad, su gradiente y color base.
+enum { guide_nx, guide_ny, guide_nz, guide_depth, guide_gradient, guide_r, guide_g, guide_b, guide_planes };
+/// Planos de la imagen que se filtra, y de los acumuladores de una fila (que llevan además la suma de pesos).
+enum { plane_r, plane_g, plane_b, plane_variance, plane_weight, image_planes = plane_weight, acc_planes };
+
+/** Suma a los acumuladores de una fila lo que aporta el vecino desplazado en una posición del núcleo. Cada array va en
+  * planos separados por su stride, y los punteros empiezan en el primer píxel de la fila que tiene ese vecino: así el
+  * compilador sabe que no se solapan y vectoriza el bucle.
+  * @param gp Guías de los píxeles de la fila.
+  * @param gq Guías de sus vecinos.
+  * @param cq Imagen en los vecinos.
+  * @param lum Luminancia de los píxeles de la fila.
+  * @param inv_sigma_l Inversa de la tolerancia de luminancia de cada píxel de la fila.
+  * @param hk Peso del núcleo B-spline en esta posición.
+  * @param inv_len Inversa de sigma_depth por la distancia al vecino en píxeles.
+  */
+inline void atrous_tap(const float *__restrict gp, const float *__restrict gq, int guide_stride,
+                       const float *__restrict cq, int image_stride,
+                       const float *__restrict lum, const float *__restrict inv_sigma_l,
+                       float *__restrict acc, int acc_stride,
+                       int count, float hk, float inv_len, float inv_sigma_a) {
+    const int gs = guide_stride, is = image_stride, as = acc_stride;
+    for (int x = 0; x < count; x++) {
+        // max(0, coseno) con fabsf, porque una comparación impide vectorizar sin -ffast-math.
+        float nd = gp[guide_nx*gs + x]*gq[guide_nx*gs + x] + gp[guide_ny*gs + x]*gq[guide_ny*gs + x]
+                 + gp[guide_nz*gs + x]*gq[guide_nz*gs + x];
+        nd = 0.5f * (nd + fabsf(nd));
+        for (int s = 0; s < denoise_normal_squarings; s++)
+            nd *= nd;
+        float r = cq[plane_r*is + x], g = cq[plane_g*is + x], b = cq[plane_b*is + x];
+        float dr = gp[guide_r*gs + x] - gq[guide_r*gs + x];
+        float dg = gp[guide_g*gs + x] - gq[guide_g*gs + x];
+        float db = gp[guide_b*gs + x] - gq[guide_b*gs + x];
+        float e = fabsf(gp[guide_depth*gs + x] - gq[guide_depth*gs + x]) * inv_len / (gp[guide_gradient*gs + x] + 1e-2f)
+                + fabsf(lum[x] - (0.2126f*r + 0.7152f*g + 0.0722f*b)) * inv_sigma_l[x]
+                + (dr*dr + dg*dg + db*db) * inv_sigma_a;
+        float w = hk * nd * exp_neg(e);
+        acc[plane_r*as + x] += w*r;
+        acc[plane_g*as + x] += w*g;
+        acc[plane_b*as + x] += w*b;
+        acc[plane_variance*as + x] += w*w*cq[plane_variance*is + x];
+        acc[plane_weight*as + x] += w;
+    }
+}
+
+class atrous_denoiser {
+    public:
+        /** Prepara las guías.
+          * @param features Primer impacto de cada píxel, sumado sobre sus muestras.
+          * @param samples Número de muestras de cada píxel.
+          */
+        atrous_denoiser(int w, int h, const feature_buffers& features, const std::vector<int>& samples,
+                        const denoise_params& p = denoise_params())
+            : nx(w), ny(h), n(w*h), params(p), guide(guide_planes*w*h) {
+            for (int k = 0; k < n; k++) {
+                float inv = samples[k] > 0 ? 1.0f / samples[k] : 0;
+                vec3 nrm = features.normal[k] * inv;
+                float len = nrm.length();
+                if (len > 0)
+                    nrm /= len;
+                vec3 a = features.albedo[k] * inv;
+                for (int c = 0; c < 3; c++) {
+                    guide[(guide_nx + c)*n + k] = nrm[c];
+                    guide[(guide_r + c)*n + k] = a[c];
+                }
+                guide[guide_depth*n + k] = features.depth[k] * inv;
+            }
+            // Cuánto cambia la profundidad de un píxel al siguiente, para comparar profundidades según la inclinación.
+            const float *z = &guide[guide_depth*n];
+            for (int y = 0; y < ny; y++)
+                for (int x = 0; x < nx; x++) {
+                    float gx = fabs(z[std::min(x+1, nx-1) + y*nx] - z[std::max(x-1, 0) + y*nx]) / 2;
+                    float gy = fabs(z[x + std::min(y+1, ny-1)*nx] - z[x + std::max(y-1, 0)*nx]) / 2;
+                    guide[guide_gradient*n + y*nx + x] = std::max(gx, gy);
+                }
+        }
+
+        /** Filtra la imagen.
+          * @param color Media de las muestras de cada píxel; se sustituye por la imagen filtrada.
+          * @param variance Varianza estimada de la media de la luminancia de cada píxel.
+          */
+        void run(std::vector<vec3>& color, const std::vector<float>& variance) {
+            std::vector<float> a(image_planes*n), b(image_planes*n);
+            // Se filtra la iluminación: el color entre el color base, donde lo hay.
+            for (int k = 0; k < n; k++) {
+                vec3 d = demodulation(k);
+                for (int c = 0; c < 3; c++)
+                    a[(plane_r + c)*n + k] = color[k][c] / d[c];
+                float lum = 0.2126*d[0] + 0.7152*d[1] + 0.0722*d[2];
+                a[plane_variance*n + k] = variance[k] / (lum*lum);
+            }
+            int threads = std::max(1u, std::thread::hardware_concurrency());
+            for (int i = 0; i < params.iterations; i++) {
+                int step = 1 << i;
+                std::vector<std::thread> pool;
+                for (int t = 0; t < threads; t++)
+                    pool.push_back(std::thread(&atrous_denoiser::filter_rows, this, std::cref(a), std::ref(b), step,
+                                               ny*t/threads, ny*(t+1)/threads));
+                for (size_t t = 0; t < pool.size(); t++)
+                    pool[t].join();
+                std::swap(a, b);
+            }
+            for (int k = 0; k < n; k++) {
+                vec3 d = demodulation(k);
+                color[k] = vec3(a[plane_r*n + k]*d[0], a[plane_g*n + k]*d[1], a[plane_b*n + k]*d[2]);
+            }
+        }
+
+    private:
+        /// Color base por el que se divide el píxel k: el de la guía, salvo en los canales casi negros, que se dejan.
+        vec3 demodulation(int k) const {
+            vec3 d;
+            for (int c = 0; c < 3; c++) {
+                float v = guide[(guide_r + c)*n + k];
+                d[c] = v > 1e-3f ? v : 1;
+            }
+            return d;
+        }
+
+        /// Una pasada del filtro con huecos de step píxeles sobre las filas [y0, y1).
+        void filter_rows(const std::vector<float>& in, std::vector<float>& out, int step, int y0, int y1) const {
+            static const float h[3] = {3.0f/8, 1.0f/4, 1.0f/16};
+            std::vector<float> lum(nx), inv_sigma_l(nx), acc(acc_planes*nx);
+            for (int y = y0; y < y1; y++) {
+                const int row = y*nx;
+                // La desviación típica del centro se toma de la varianza suavizada en 3x3, que es más estable.
+                for (int x = 0; x < nx; x++) {
+                    float v = 0, wsum = 0;
+                    for (int dy = -1; dy <= 1; dy++)
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int xx = x + dx, yy = y + dy;
+                            if (xx < 0 || xx >= nx || yy < 0 || yy >= ny)
+                                continue;
+                            float w = (dx ? 0.5f : 1) * (dy ? 0.5f : 1);
+                            v += w * in[plane_variance*n + yy*nx + xx];
+                            wsum += w;
+                        }
+                    inv_sigma_l[x] = 1 / (params.sigma_luminance * sqrt(v / wsum) + 1e-4f);
+                    int k = row + x;
+                    lum[x] = 0.2126f*in[plane_r*n + k] + 0.7152f*in[plane_g*n + k] + 0.0722f*in[plane_b*n + k];
+                    // El propio píxel, con el peso del centro del núcleo.
+                    float w = h[0]*h[0];
+                    for (int c = 0; c < image_planes; c++)
+                        acc[c*nx + x] = (c == plane_variance ? w*w : w) * in[c*n + k];
+                    acc[plane_weight*nx + x] = w;
+                }
+                for (int dy = -2; dy <= 2; dy++) {
+                    int yy = y + dy*step;
+                    if (yy < 0 || yy >= ny)
+                        continue;
+                    for (int dx = -2; dx <= 2; dx++) {
+                        if (dx == 0 && dy == 0)
+                            continue;
+                        const int off = dx*step;
+                        const int x0 = std::max(0, -off), x1 = std::min(nx, nx - off);
+                        if (x0 >= x1)
+                            continue;
+                        const int p = row + x0, q = yy*nx + x0 + off;
+                        atrous_tap(&guide[p], &guide[q], n, &in[q], n, &lum[x0], &inv_sigma_l[x0], &acc[x0], nx, x1 - x0,
+                                   h[abs(dx)]*h[abs(dy)], 1 / (params.sigma_depth * step * sqrt(float(dx*dx + dy*dy))),
+                                   1 / params.sigma_albedo);
+                    }
+                }
+                for (int x = 0; x < nx; x++) {
+                    float w = acc[plane_weight*nx + x];
+                    for (int c = 0; c < 3; c++)
+                        out[(plane_r + c)*n + row + x] = acc[(plane_r + c)*nx + x] / w;
+                    out[plane_variance*n + row + x] = acc[plane_variance*nx + x] / (w*w);
+                }
+            }
+        }
+
+        int nx, ny, n;
+        denoise_params params;
+        /// Guías en planos de n píxeles, en el orden de guide_nx...guide_b.
+        std::vector<float> guide;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef DIRECTLIGHTH
+#define DIRECTLIGHTH
+
+#include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+
+/// Muestra de luz directa pendiente de la prueba de visibilidad: el rayo de sombra y lo que aporta si no está bloqueado.
+struct light_sample {
+    ray shadow;
+    /// El rayo de sombra sólo se prueba hasta aquí, justo antes del punto muestreado en la luz.
+    float t_max;
+    vec3 contribution;
+};
+
+/** Muestrea un punto en las luces desde el punto difuso hrec y calcula su contribución ponderada con MIS frente a la
+  * densidad de la BSDF. No traza el rayo de sombra: eso se deja a quien llama, para poder agruparlos.
+  * @param r Rayo que ha llegado a hrec.
+  * @param hrec Punto donde se estima la luz directa.
+  * @param srec Resultado de scatter en hrec, con la densidad de la BSDF.
+  * @param lights Lista de emisores, con sus materiales.
+  * @param ls Donde se devuelven el rayo de sombra y la contribución.
+  * @return Falso si la muestra no aporta nada, y entonces no hace falta trazar el rayo de sombra.
+  */
+bool sample_direct_light(const ray& r, const hit_record& hrec, const scatter_record& srec, hittable *lights, light_sample& ls) {
+    vec3 dir = lights->random(hrec.p);
+    float light_pdf = lights->pdf_value(hrec.p, dir);
+    if (light_pdf <= 0)
+        return false;
+    ls.shadow = ray(hrec.p, dir, r.time());
+    // El punto muestreado de la luz da su distancia y su emisión.
+    hit_query lq;
+    if (!lights->intersect(ls.shadow, 0.001, FLT_MAX, lq))
+        return false;
+    hit_record lrec;
+    resolve_hit(ls.shadow, lq, lrec);
+    vec3 le = lrec.mat_ptr->emitted(ls.shadow, lrec, lrec.u, lrec.v, lrec.p);
+    float f = hrec.mat_ptr->scattering_pdf(r, hrec, ls.shadow);
+    if (le.squared_length() == 0 || f <= 0)
+        return false;
+    float bsdf_pdf = srec.pdf_ptr->value(dir);
+    ls.t_max = lq.t*(1 - 1e-4);
+    ls.contribution = srec.attenuation * f * le * power_heuristic(light_pdf, bsdf_pdf) / light_pdf;
+    return true;
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef DISTRIBUTEDH
+#define DISTRIBUTEDH
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+#include "film.h"
+
+/** Render repartido entre varios procesos de la misma máquina. El proceso principal (el coordinador) parte la imagen en
+  * trabajos, crea con fork() un proceso trabajador por cada uno que se pida, conectado con él por un par de sockets
+  * Unix, y le va dando trabajos según acaba los anteriores, así que los procesos rápidos hacen más. Cada trabajador
+  * devuelve el trozo de película de su trabajo, con el margen del filtro, y el coordinador los suma en el orden de los
+  * trabajos, no en el que llegan: la imagen no depende de cuántos procesos haya ni de cuál haga cada trabajo.
+  *
+  * Los trabajadores heredan la escena ya construida (las páginas se comparten hasta que alguien las escribe) y cada
+  * uno reserva su propia película, así que en una máquina con varios sockets la memoria que escribe cada proceso es la
+  * del nodo en el que corre. Si un trabajador muere, su trabajo se da a otro.
+  */
+
+/// Cabecera del resultado de un trabajo: su número y el rectángulo de película cuyos píxeles van detrás.
+struct job_result {
+    int32_t job, x0, y0, x1, y1;
+};
+
+/// Envía n bytes por el socket fd, aunque haga falta más de una llamada. @return Falso si el otro extremo se ha cerrado.
+inline bool send_all(int fd, const void *data, size_t n) {
+    const char *p = (const char *) data;
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+/// Recibe n bytes del socket fd. @return Falso si el otro extremo se ha cerrado antes.
+inline bool recv_all(int fd, void *data, size_t n) {
+    char *p = (char *) data;
+    while (n > 0) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+/// Bucle de un trabajador: recibe números de trabajo hasta que le llega uno negativo y devuelve el resultado de cada uno.
+inline void worker_loop(int fd, const std::function<film_buffer(int)>& render) {
+    int32_t job;
+    while (recv_all(fd, &job, sizeof(job)) && job >= 0) {
+        film_buffer b = render(job);
+        job_result h = {job, b.x0, b.y0, b.x1, b.y1};
+        if (!send_all(fd, &h, sizeof(h)) || !send_all(fd, b.pixels.data(), b.pixels.size() * sizeof(film_pixel)))
+            break;
+    }
+}
+
+/** Renderiza los trabajos [0, jobs) en workers procesos y suma sus resultados en la película.
+  * @param render Renderiza un trabajo en un buffer de la película; se llama en los trabajadores.
+  * @return Falso si no se han podido hacer todos los trabajos (no se ha podido crear ningún proceso o han muerto todos).
+  */
+inline bool render_distributed(int workers, int jobs, const std::function<film_buffer(int)>& render, film& out) {
+    struct worker {
+        pid_t pid;
+        int fd;
+        int32_t job;
+    };
+    std::vector<worker> pool;
+    for (int w = 0; w < workers; w++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            break;
+        pid_t pid = fork();
+        if (pid == 0) {
+            // El hijo sólo se queda con su socket, y sale con _exit() para no vaciar dos veces los buffers de salida del padre.
+            close(sv[0]);
+            for (size_t k = 0; k < pool.size(); k++)
+                close(pool[k].fd);
+            worker_loop(sv[1], render);
+            _exit(0);
+        }
+        close(sv[1]);
+        if (pid < 0) {
+            close(sv[0]);
+            break;
+        }
+        worker wk = {pid, sv[0], -1};
+        pool.push_back(wk);
+    }
+
+    std::deque<int32_t> pending;
+    for (int32_t j = 0; j < jobs; j++)
+        pending.push_back(j);
+    // Resultados que han llegado antes que alguno anterior, esperando su turno.
+    std::map<int32_t, film_buffer> arrived;
+    int32_t next = 0;
+    while (next < jobs) {
+        std::vector<pollfd> fds;
+        std::vector<size_t> owner;
+        for (size_t k = 0; k < pool.size(); k++) {
+            worker& wk = pool[k];
+            if (wk.fd >= 0 && wk.job < 0 && !pending.empty()) {
+                wk.job = pending.front();
+                pending.pop_front();
+                if (!send_all(wk.fd, &wk.job, sizeof(wk.job))) {
+                    pending.push_front(wk.job);
+                    close(wk.fd);
+                    wk.fd = wk.job = -1;
+                }
+            }
+            if (wk.fd >= 0 && wk.job >= 0) {
+                pollfd p = {wk.fd, POLLIN, 0};
+                fds.push_back(p);
+                owner.push_back(k);
+            }
+        }
+        if (fds.empty())
+            break;
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (size_t f = 0; f < fds.size(); f++) {
+            if (!fds[f].revents)
+                continue;
+            worker& wk = pool[owner[f]];
+            job_result h;
+            bool ok = recv_all(wk.fd, &h, sizeof(h)) && h.job == wk.job &&
+                      h.x0 >= out.x0 && h.y0 >= out.y0 && h.x1 <= out.x1 && h.y1 <= out.y1 && h.x0 <= h.x1 && h.y0 <= h.y1;
+            if (ok) {
+                film_buffer b(out.filter, h.x0, h.y0, h.x1, h.y1);
+                ok = recv_all(wk.fd, b.pixels.data(), b.pixels.size() * sizeof(film_pixel));
+                if (ok)
+                    arrived.insert(std::make_pair(h.job, b));
+            }
+            if (ok)
+                wk.job = -1;
+            else {
+                fprintf(stderr, "worker %d failed, job %d goes to another worker\n", int(wk.pid), int(wk.job));
+                pending.push_front(wk.job);
+                close(wk.fd);
+                wk.fd = wk.job = -1;
+            }
+        }
+        for (std::map<int32_t, film_buffer>::iterator it = arrived.find(next); it != arrived.end(); it = arrived.find(++next)) {
+            out.accumulate(it->second);
+            arrived.erase(it);
+        }
+    }
+
+    int32_t stop = -1;
+    for (size_t k = 0; k < pool.size(); k++) {
+        if (pool[k].fd >= 0) {
+            send_all(pool[k].fd, &stop, sizeof(stop));
+            close(pool[k].fd);
+        }
+        waitpid(pool[k].pid, 0, 0);
+    }
+    return next == jobs;
+}
+#endif
+
+#endif
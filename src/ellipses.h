@@ -6,6 +6,8 @@
 #include "onb.h"
 #include "pdf.h"
 #include "random.h"
+#include "sampler.h"
+#include "stats.h"
 
 /** Clase elipse, subclase de hittable, que representa el modelo de una elipse con generación de puntos en función del área.
   */
@@ -22,6 +24,10 @@ class ellipse: public hittable  {
         };
         /// Función que calcula si un rayo r interseca con la elipse en [tmin, tmax], y guarda los datos de intersección en el hit_record rec.
         virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        /// Sólo busca t, sin rellenar el hit_record.
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_query& q) const;
+        /// Rellena el hit_record de una intersección encontrada por intersect.
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
         /// Calcula la caja que engloba a la elipse. Como es dos dimensional, la caja añade "altura" en el eje en el que la elipse es plana.
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
         /// Genera la función de densidad del punto elegido con random. Es en función del área así que depende de la distancia del punto.
@@ -51,11 +57,11 @@ class ellipse: public hittable  {
    * @return Función de densidad del punto o+v sabiendo que ha sido generado por una uniforme en la elipse en función del área.
    */
 float ellipse::pdf_value(const vec3& o, const vec3& v) const {
-  hit_record rec;
-    if (this->hit(ray(o, v), 0.001, FLT_MAX, rec)) {
+  hit_query q;
+    if (this->intersect(ray(o, v), 0.001, FLT_MAX, q)) {
       float area = M_PI*axis1.length()*axis2.length();
-      float distance_squared = rec.t * rec.t * v.squared_length();
-      float cosine = fabs(dot(v, rec.normal) / v.length());
+      float distance_squared = q.t * q.t * v.squared_length();
+      float cosine = fabs(dot(v, perp) / v.length());
       return distance_squared / (cosine * area);
     }
     else
@@ -67,7 +73,10 @@ float ellipse::pdf_value(const vec3& o, const vec3& v) const {
    * @return Vector que apunta hacia el punto generado de forma aleatoria.
    */
 vec3 ellipse::random(const vec3& o) {
-    float rho = random_double(), phi = random_double()*2*M_PI;
+    STAT_INC(light_samples[stat_light_ellipse]);
+    float rho, phi;
+    sample_2d(stream_light_uv, rho, phi);
+    phi *= 2*M_PI;
     float x = sqrt(rho)*cos(phi);
     float y = sqrt(rho)*sin(phi);
     return center+x*axis1+y*axis2-o;
@@ -91,23 +100,27 @@ bool ellipse::bounding_box(float t0, float t1, aabb& box) const {
    * @return Booleano, es verdadero si interseca y false si no.
    */
 bool ellipse::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+/** Primera fase de la intersección: calcula t y comprueba que el punto cae dentro de la elipse, sin rellenar el hit_record.
+   * @param r Rayo que podría intersecar la elipse.
+   * @param t_min valor inicial del intervalo.
+   * @param t_max valor final del intervalo.
+   * @param q Donde se apunta la intersección si la hay.
+   * @return Booleano, es verdadero si interseca y false si no.
+   */
+bool ellipse::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
     float t = (k-r.origin().y()) / r.direction().y();
     if(t < t_min || t > t_max){
       return false;
     }
     else{
-      vec3 q = r.origin()+t*r.direction()-center;
-      float q_x = dot(q, axis1)/axis1.squared_length();
-      float q_y = dot(q, axis2)/axis2.squared_length();
-      float r_e = q_x*q_x + q_y*q_y;
-
-      if(r_e <= 1){
-        rec.normal = perp;
-        rec.p = r.point_at_parameter(t);
-        rec.mat_ptr = mat_ptr;
-        rec.t = t;
-        rec.u = (atan2(q_x, q_y)+M_PI)*1.0/(2*M_PI);
-        rec.v = sqrt(r_e);
+      vec3 d = r.origin()+t*r.direction()-center;
+      float q_x = dot(d, axis1)/axis1.squared_length();
+      float q_y = dot(d, axis2)/axis2.squared_length();
+      if(q_x*q_x + q_y*q_y <= 1){
+        set_query(q, t, this);
         return true;
       }
       else{
@@ -116,4 +129,22 @@ bool ellipse::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
     }
 }
 
+/** Segunda fase: rellena el hit_record de la intersección q. Las coordenadas uv (que usan atan2) sólo se calculan aquí,
+   * una vez por rayo.
+   * @param r Rayo que ha intersecado la elipse.
+   * @param q Intersección encontrada por intersect.
+   * @param rec hit_record donde se devuelve el resultado.
+   */
+void ellipse::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    rec.t = q.t;
+    rec.p = r.point_at_parameter(q.t);
+    vec3 d = rec.p-center;
+    float q_x = dot(d, axis1)/axis1.squared_length();
+    float q_y = dot(d, axis2)/axis2.squared_length();
+    rec.normal = perp;
+    rec.mat_ptr = mat_ptr;
+    rec.u = (atan2(q_x, q_y)+M_PI)*1.0/(2*M_PI);
+    rec.v = sqrt(q_x*q_x + q_y*q_y);
+}
+
 #endif
@@ -6,6 +6,8 @@
 #include "onb.h"
 #include "pdf.h"
 #include "random.h"
+#include "sampler.h"
+#include "stats.h"
 
 using namespace std;
 /// Función para eliminar NaNs
@@ -103,6 +105,16 @@ float bisection(EcuacionPhi& f, double a, double b, int n_max, float tol){
   }
 }
 
+/// Proyección del disco en la esfera de radio 1 centrada en un punto o: la elipse esférica y los parámetros para muestrearla.
+struct spherical_ellipse {
+  /// Base de la elipse esférica.
+  vec3 x_e, y_e, z_e;
+  /// Tangentes de los semiejes y semieje menor.
+  float a_t, b_t, beta;
+  /// Área de la elipse esférica, es decir, ángulo sólido del disco visto desde o.
+  float omega;
+};
+
 /** Clase elipse_sa, subclase de hittable, que representa el modelo de un disco con generación de puntos en función del ángulo sólido. Esta generación es uniforme en la elipse esférica que produce el disco al proyectarse en una esfera de radio 1. Se diferencia de la clase ellipse en las funciones pdf_value y random.
   */
 class ellipse_sa: public hittable  {
@@ -118,12 +130,18 @@ class ellipse_sa: public hittable  {
         };
         /// Función que calcula si un rayo r interseca con la elipse en [tmin, tmax], y guarda los datos de intersección en el hit_record rec.
         virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        /// Sólo busca t, sin rellenar el hit_record.
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_query& q) const;
+        /// Rellena el hit_record de una intersección encontrada por intersect.
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
         /// Calcula la caja que engloba a la elipse. Como es dos dimensional, la caja añade "altura" en el eje en el que la elipse es plana.
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
         /// Genera la función de distribución del punto elegido con random. Es en función del ángulo sólido así que es constante.
         virtual float  pdf_value(const vec3& o, const vec3& v) const;
         /// Genera un vector desde el punto o hacia un punto escogido de forma uniforme en la elipse respecto al ángulo sólido.
         virtual vec3 random(const vec3& o);
+        /// Calcula la elipse esférica que proyecta el disco visto desde o. No modifica el objeto, así que pdf_value no depende de la última llamada a random.
+        void project(const vec3& o, spherical_ellipse& e) const;
         /// Calcula el normal a la elipse y lo guarda en perp.
         void calcPerp(){
           perp = cross(axis1, axis2);
@@ -135,8 +153,6 @@ class ellipse_sa: public hittable  {
         vec3 axis1, axis2;
         /// Vector perpendicular a la elipse.
         vec3 perp;
-        /// Área de la elipse esférica, el disco proyectado.
-        float area_omega;
         /// Los extremos de la caja que engloba a la elipse.
         float x0, x1, z0, z1, k;
         /// Material de la elipse, todo hittable debe guardar el material.
@@ -149,9 +165,10 @@ class ellipse_sa: public hittable  {
    * @return Función de densidad del punto o+v sabiendo que ha sido generado por una uniforme en la elipse en función del ángulo sólido.
    */
 float ellipse_sa::pdf_value(const vec3& o, const vec3& v) const {
-  hit_record rec;
-    if (this->hit(ray(o, v), 0.001, FLT_MAX, rec)) {
-      return 1.0/area_omega;
+    if (this->occluded(ray(o, v), 0.001, FLT_MAX)) {
+      spherical_ellipse e;
+      project(o, e);
+      return 1.0/e.omega;
     }
     else
         return 0;
@@ -165,11 +182,32 @@ int n_it_bisection = 10;
    * @return Vector que apunta hacia el punto generado de forma aleatoria.
    */
 vec3 ellipse_sa::random(const vec3& o) {
+    STAT_INC(light_samples[stat_light_ellipse_sa]);
     float rho = random_double(), phi = random_double()*2*M_PI;
     float x = sqrt(rho)*cos(phi);
     float y = sqrt(rho)*sin(phi);
 
-    float e_1 = random_double(), e_2 = random_double();
+    float e_1, e_2;
+    sample_2d(stream_light_uv, e_1, e_2);
+    spherical_ellipse e;
+    project(o, e);
+    float a_t = e.a_t, b_t = e.b_t, beta = e.beta, Omega_D = e.omega;
+    vec3 x_e = e.x_e, y_e = e.y_e, z_e = e.z_e;
+    EcuacionPhi ec;
+    ec.setParameters(a_t, b_t, beta, e_1*Omega_D);
+    float phi_p = bisection(ec, -beta, beta, n_it_bisection, 0.001);
+    float h = (2*e_2-1)*h_p(phi_p, a_t, b_t);
+    float sq = sqrt(1-h*h);
+    vec3 q(h, sq*sin(phi_p), sq*cos(phi_p));
+    vec3 q2 = h*x_e + sq*sin(phi_p)*y_e + sq*cos(phi_p)*z_e;
+    return q2;
+}
+
+/** Calcula la elipse esférica que proyecta el disco en la esfera de radio 1 centrada en o.
+   * @param o Punto desde el que se mira el disco.
+   * @param e Donde se devuelven la base, los parámetros y el área de la elipse esférica.
+   */
+void ellipse_sa::project(const vec3& o, spherical_ellipse& e) const {
     vec3 z_d = -cross(axis1, axis2);
     z_d.make_unit_vector();
 
@@ -200,17 +238,13 @@ vec3 ellipse_sa::random(const vec3& o) {
     float a_t = tan(alpha);
     float b_t = tan(beta);
 
-    vec3 x_e = x_d, y_e = cross(z_e, x_e);
-    float Omega_D = omega_p(beta, a_t, b_t, beta);
-    EcuacionPhi ec;
-    ec.setParameters(a_t, b_t, beta, e_1*Omega_D);
-    float phi_p = bisection(ec, -beta, beta, n_it_bisection, 0.001);
-    float h = (2*e_2-1)*h_p(phi_p, a_t, b_t);
-    float sq = sqrt(1-h*h);
-    vec3 q(h, sq*sin(phi_p), sq*cos(phi_p));
-    vec3 q2 = h*x_e + sq*sin(phi_p)*y_e + sq*cos(phi_p)*z_e;
-    area_omega = Omega_D;
-    return q2;
+    e.x_e = x_d;
+    e.y_e = cross(z_e, x_d);
+    e.z_e = z_e;
+    e.a_t = a_t;
+    e.b_t = b_t;
+    e.beta = beta;
+    e.omega = omega_p(beta, a_t, b_t, beta);
 }
 
 /** Calcula la caja que engloba a la elipse, o bounding box, admitiendo que la elipse se pueda mover con el tiempo.
@@ -231,23 +265,27 @@ bool ellipse_sa::bounding_box(float t0, float t1, aabb& box) const {
    * @return Booleano, es verdadero si interseca y false si no.
    */
 bool ellipse_sa::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+/** Primera fase de la intersección: calcula t y comprueba que el punto cae dentro de la elipse, sin rellenar el hit_record.
+   * @param r Rayo que podría intersecar la elipse.
+   * @param t_min valor inicial del intervalo.
+   * @param t_max valor final del intervalo.
+   * @param q Donde se apunta la intersección si la hay.
+   * @return Booleano, es verdadero si interseca y false si no.
+   */
+bool ellipse_sa::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
     float t = dot(-r.origin()+center, perp)*1.0/dot(r.direction(), perp);
     if(t < t_min || t > t_max){
       return false;
     }
     else{
-      vec3 q = r.origin()+t*r.direction()-center;
-      float q_x = dot(q, axis1)/axis1.squared_length();
-      float q_y = dot(q, axis2)/axis2.squared_length();
-      float r_e = q_x*q_x + q_y*q_y;
-
-      if(r_e <= 1){
-        rec.normal = perp;
-        rec.p = r.point_at_parameter(t);
-        rec.mat_ptr = mat_ptr;
-        rec.t = t;
-        rec.u = (atan2(q_x, q_y)+M_PI)*1.0/(2*M_PI);
-        rec.v = sqrt(r_e);
+      vec3 d = r.origin()+t*r.direction()-center;
+      float q_x = dot(d, axis1)/axis1.squared_length();
+      float q_y = dot(d, axis2)/axis2.squared_length();
+      if(q_x*q_x + q_y*q_y <= 1){
+        set_query(q, t, this);
         return true;
       }
       else{
@@ -256,4 +294,22 @@ bool ellipse_sa::hit(const ray& r, float t_min, float t_max, hit_record& rec) co
     }
 }
 
+/** Segunda fase: rellena el hit_record de la intersección q. Las coordenadas uv (que usan atan2) sólo se calculan aquí,
+   * una vez por rayo.
+   * @param r Rayo que ha intersecado la elipse.
+   * @param q Intersección encontrada por intersect.
+   * @param rec hit_record donde se devuelve el resultado.
+   */
+void ellipse_sa::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    rec.t = q.t;
+    rec.p = r.point_at_parameter(q.t);
+    vec3 d = rec.p-center;
+    float q_x = dot(d, axis1)/axis1.squared_length();
+    float q_y = dot(d, axis2)/axis2.squared_length();
+    rec.normal = perp;
+    rec.mat_ptr = mat_ptr;
+    rec.u = (atan2(q_x, q_y)+M_PI)*1.0/(2*M_PI);
+    rec.v = sqrt(q_x*q_x + q_y*q_y);
+}
+
 #endif
@@ -0,0 +1,209 @@
+#ifndef FILMH
+#define FILMH
+
+#include <math.h>
+#include <algorithm>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "vec3.h"
+
+/** Película: reconstrucción de la imagen a partir de las muestras con un filtro. En lugar de promediar las muestras que
+  * caen dentro de cada píxel (el filtro de caja), cada muestra se reparte entre todos los píxeles cuyo centro está a
+  * menos del radio del filtro, con el peso del filtro a esa distancia, y cada píxel es la media ponderada de lo que le ha
+  * llegado. Con un filtro más suave que la caja los bordes se antialiasean mejor con las mismas muestras.
+  *
+  * Las coordenadas de la película van en píxeles desde la esquina superior izquierda: el píxel (i, r) de la fila r
+  * empezando por arriba tiene su centro en (i + 0.5, r + 0.5). Las muestras se dan por su píxel y su posición dentro de
+  * él, y no por su posición absoluta, porque al sumarlas en float una muestra pegada al borde acabaría en el píxel de
+  * al lado.
+  */
+
+/// Filtro de reconstrucción separable: el peso de una muestra en un píxel es evaluate(dx) * evaluate(dy).
+class pixel_filter {
+    public:
+        pixel_filter(float r) : radius(r) {}
+        virtual ~pixel_filter() {}
+        /// Peso a distancia x del centro del píxel, con |x| < radius.
+        virtual float evaluate(float x) const = 0;
+        float radius;
+};
+
+/// Caja de un píxel: cada muestra cuenta sólo en su píxel, la media de siempre.
+class box_filter : public pixel_filter {
+    public:
+        box_filter(float r = 0.5) : pixel_filter(r) {}
+        virtual float evaluate(float x) const { return 1; }
+};
+
+/// Tienda (triangular): el peso baja linealmente hasta cero en el radio.
+class tent_filter : public pixel_filter {
+    public:
+        tent_filter(float r = 1) : pixel_filter(r) {}
+        virtual float evaluate(float x) const { return fmax(0.0f, radius - fabs(x)); }
+};
+
+/// Gaussiana de parámetro alpha, desplazada para que valga cero en el radio.
+class gaussian_filter : public pixel_filter {
+    public:
+        gaussian_filter(float r = 1.5, float a = 2) : pixel_filter(r), alpha(a), edge(exp(-a*r*r)) {}
+        virtual float evaluate(float x) const { return fmax(0.0f, float(exp(-alpha*x*x)) - edge); }
+
+    private:
+        float alpha, edge;
+};
+
+/** Filtro de Mitchell y Netravali con B = C = 1/3, el compromiso que recomiendan entre emborronar y los anillos. Tiene
+  * lóbulos negativos, que afilan los bordes.
+  */
+class mitchell_filter : public pixel_filter {
+    public:
+        mitchell_filter(float r = 2, float b = 1.0/3, float c = 1.0/3) : pixel_filter(r), B(b), C(c) {}
+        virtual float evaluate(float x) const {
+            x = fabs(2 * x / radius);
+            if (x > 1)
+                return ((-B - 6*C)*x*x*x + (6*B + 30*C)*x*x + (-12*B - 48*C)*x + (8*B + 24*C)) / 6;
+            return ((12 - 9*B - 6*C)*x*x*x + (-18 + 12*B + 6*C)*x*x + (6 - 2*B)) / 6;
+        }
+
+    private:
+        float B, C;
+};
+
+/// Filtro de nombre dado (box, tent, gaussian o mitchell); 0 si no existe.
+inline pixel_filter *make_filter(const std::string& name) {
+    if (name == "box")
+        return new box_filter();
+    if (name == "tent")
+        return new tent_filter();
+    if (name == "gaussian")
+        return new gaussian_filter();
+    if (name == "mitchell")
+        return new mitchell_filter();
+    return 0;
+}
+
+/// Suma ponderada del color de las muestras de un píxel y suma de sus pesos.
+struct film_pixel {
+    float r, g, b, weight;
+};
+
+/// Máximo de píxeles por eje a los que llega una muestra: radio de filtro de hasta 3.5.
+const int film_max_footprint = 8;
+
+/// Rectángulo [x0, x1) x [y0, y1) de píxeles de la película que recoge muestras.
+class film_buffer {
+    public:
+        film_buffer(const pixel_filter *f, int px0, int py0, int px1, int py1)
+            : filter(f), x0(px0), y0(py0), x1(px1), y1(py1), pixels(std::max(0, px1 - px0) * std::max(0, py1 - py0)) {
+            film_pixel zero = {0, 0, 0, 0};
+            std::fill(pixels.begin(), pixels.end(), zero);
+        }
+
+        /** Reparte el color c de una muestra entre los píxeles del rectángulo a los que llega el filtro.
+          * @param px Columna del píxel de la muestra.
+          * @param py Fila del píxel, empezando por arriba.
+          * @param ox Posición de la muestra dentro del píxel, de izquierda a derecha, en [0, 1).
+          * @param oy Posición dentro del píxel de arriba abajo, en [0, 1).
+          */
+        void add_sample(int px, int py, float ox, float oy, const vec3& c) {
+            ox = fmin(fmax(ox, 0.0f), 0.99999994f);
+            oy = fmin(fmax(oy, 0.0f), 0.99999994f);
+            // Píxeles con centro en [muestra - radius, muestra + radius), para que la caja de radio 0.5 dé sólo el de la muestra.
+            float r = filter->radius;
+            int ia = std::max(x0, px + int(floor(ox - 0.5f - r)) + 1), ib = std::min(x1 - 1, px + int(floor(ox - 0.5f + r)));
+            int ja = std::max(y0, py + int(floor(oy - 0.5f - r)) + 1), jb = std::min(y1 - 1, py + int(floor(oy - 0.5f + r)));
+            ib = std::min(ib, ia + film_max_footprint - 1);
+            jb = std::min(jb, ja + film_max_footprint - 1);
+            float wx[film_max_footprint];
+            for (int i = ia; i <= ib; i++)
+                wx[i - ia] = filter->evaluate((i - px) + 0.5f - ox);
+            for (int j = ja; j <= jb; j++) {
+                float wy = filter->evaluate((j - py) + 0.5f - oy);
+                film_pixel *row = &pixels[(j - y0) * (x1 - x0)];
+                for (int i = ia; i <= ib; i++) {
+                    float w = wx[i - ia] * wy;
+                    film_pixel& p = row[i - x0];
+                    p.r += w * c[0];
+                    p.g += w * c[1];
+                    p.b += w * c[2];
+                    p.weight += w;
+                }
+            }
+        }
+
+        /// Suma lo acumulado en t, que tiene que estar dentro de este rectángulo.
+        void accumulate(const film_buffer& t) {
+            int w = t.x1 - t.x0;
+            for (int j = t.y0; j < t.y1; j++)
+                for (int i = t.x0; i < t.x1; i++) {
+                    const film_pixel& s = t.pixels[(j - t.y0) * w + i - t.x0];
+                    film_pixel& d = pixels[(j - y0) * (x1 - x0) + i - x0];
+                    d.r += s.r;
+                    d.g += s.g;
+                    d.b += s.b;
+                    d.weight += s.weight;
+                }
+        }
+
+        const pixel_filter *filter;
+        int x0, y0, x1, y1;
+        std::vector<film_pixel> pixels;
+};
+
+/** Película de toda la imagen. Cada bloque de la imagen puede acumular sus muestras en su propio film_buffer, que con
+  * el radio del filtro se sale del bloque y se solapa con los vecinos, y sumarlo después con merge(), que se puede
+  * llamar desde varios hilos. Las sumas en coma flotante dependen del orden, así que para una imagen reproducible los
+  * bloques se deben sumar siempre en el mismo orden.
+  */
+class film : public film_buffer {
+    public:
+        film(const pixel_filter *f, int width, int height) : film_buffer(f, 0, 0, width, height) {}
+
+        /// Buffer vacío para las muestras que caen en los píxeles [px0, px1) x [py0, py1): esos y los que alcanza el filtro.
+        film_buffer tile(int px0, int py0, int px1, int py1) const {
+            int margin = int(ceil(filter->radius - 0.5f));
+            return film_buffer(filter, std::max(x0, px0 - margin), std::max(y0, py0 - margin),
+                               std::min(x1, px1 + margin), std::min(y1, py1 + margin));
+        }
+
+        /// Suma a la película lo acumulado en un buffer de tile().
+        void merge(const film_buffer& t) {
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            accumulate(t);
+        }
+
+        /** Imagen reconstruida, por filas de arriba abajo. Los píxeles sin peso (o con peso negativo, que puede pasar con los
+          * lóbulos de Mitchell) quedan en negro, y los colores negativos se recortan a cero.
+          */
+        std::vector<vec3> resolve() const {
+            std::vector<vec3> image(pixels.size());
+            for (size_t k = 0; k < pixels.size(); k++) {
+                const film_pixel& p = pixels[k];
+                if (p.weight > 0)
+                    image[k] = vec3(fmax(0.0f, p.r / p.weight), fmax(0.0f, p.g / p.weight), fmax(0.0f, p.b / p.weight));
+                else
+                    image[k] = vec3(0, 0, 0);
+            }
+            return image;
+        }
+
+    private:
+        std::mutex merge_mutex;
+};
+
+/// Valor de 0 a 255 de una componente de color lineal, con corrección gamma 2.
+inline int ppm_value(float c) {
+    return std::min(std::max(int(255.99*sqrt(c)), 0), 255);
+}
+
+/// Escribe una imagen de nx x ny, por filas de arriba abajo, como PPM de texto.
+inline void write_ppm(std::ostream& out, const std::vector<vec3>& image, int nx, int ny) {
+    out << "P3\n" << nx << " " << ny << "\n255\n";
+    for (int k = 0; k < nx*ny; k++)
+        out << ppm_value(image[k][0]) << " " << ppm_value(image[k][1]) << " " << ppm_value(image[k][2]) << "\n";
+    out.flush();
+}
+
+#endif
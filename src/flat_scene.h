@@ -0,0 +1,640 @@
+#ifndef FLATSCENEH
+#define FLATSCENEH
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "aarect.h"
+#include "bvh.h"
+#include "ellipses.h"
+#include "ellipsessa.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "stats.h"
+#include "triangle_mesh.h"
+#include "xz_rect_solidangle.h"
+
+/// Tipos de primitiva de la escena plana. El tipo va en los 3 bits altos del identificador de primitiva.
+enum prim_type { prim_sphere = 0, prim_rect = 1, prim_ellipse = 2, prim_generic = 3 };
+const int prim_type_shift = 29;
+const uint32_t prim_index_mask = (1u << prim_type_shift) - 1;
+/// Número máximo de primitivas en una hoja del BVH de la escena plana.
+const int flat_leaf_size = 8;
+
+inline uint32_t make_prim_id(int type, uint32_t index) { return (uint32_t(type) << prim_type_shift) | index; }
+inline int prim_id_type(uint32_t id) { return id >> prim_type_shift; }
+inline uint32_t prim_id_index(uint32_t id) { return id & prim_index_mask; }
+
+/// Número de esferas que el núcleo de intersección prueba a la vez: 8 con AVX, 4 con SSE2 (siempre presente en x86-64).
+#if defined(__AVX__)
+const int sphere_simd_width = 8;
+#else
+const int sphere_simd_width = 4;
+#endif
+
+/** Esferas en estructura de vectores (SoA): cada campo en su propio vector contiguo.
+  * Los vectores se rellenan al final con sphere_simd_width esferas inválidas (centro NaN), de forma que el núcleo
+  * puede leer grupos completos sin comprobar el final.
+  */
+struct sphere_soa {
+    std::vector<float> cx, cy, cz, radius;
+    std::vector<material *> mat;
+    /// Número de esferas reales, sin contar el relleno.
+    size_t size() const { return mat.size(); }
+    void pad() {
+        for (int i = 0; i < sphere_simd_width; i++) {
+            cx.push_back(NAN); cy.push_back(NAN); cz.push_back(NAN);
+            radius.push_back(0);
+        }
+    }
+};
+
+/** Calcula, para sphere_simd_width esferas a partir de base, el t más cercano en (t_min, limit), o FLT_MAX si no hay corte.
+  * Las operaciones son las mismas y en el mismo orden que en sphere::hit, así que el resultado es idéntico.
+  */
+inline void sphere_group_t(const sphere_soa& s, uint32_t base, const vec3& o, const vec3& dir, float a, float t_min, float limit, float *t) {
+#if defined(__AVX__)
+    __m256 ocx = _mm256_sub_ps(_mm256_set1_ps(o[0]), _mm256_loadu_ps(&s.cx[base]));
+    __m256 ocy = _mm256_sub_ps(_mm256_set1_ps(o[1]), _mm256_loadu_ps(&s.cy[base]));
+    __m256 ocz = _mm256_sub_ps(_mm256_set1_ps(o[2]), _mm256_loadu_ps(&s.cz[base]));
+    __m256 r = _mm256_loadu_ps(&s.radius[base]), va = _mm256_set1_ps(a);
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, _mm256_set1_ps(dir[0])), _mm256_mul_ps(ocy, _mm256_set1_ps(dir[1]))),
+                             _mm256_mul_ps(ocz, _mm256_set1_ps(dir[2])));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+                             _mm256_mul_ps(r, r));
+    __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(va, c));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 sq = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+    __m256 nb = _mm256_sub_ps(zero, b);
+    __m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, sq), va), t1 = _mm256_div_ps(_mm256_add_ps(nb, sq), va);
+    __m256 vmin = _mm256_set1_ps(t_min), vmax = _mm256_set1_ps(limit);
+    __m256 valid = _mm256_cmp_ps(disc, zero, _CMP_GT_OQ);
+    __m256 hit0 = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t0, vmin, _CMP_GT_OQ), _mm256_cmp_ps(t0, vmax, _CMP_LT_OQ)));
+    __m256 hit1 = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t1, vmin, _CMP_GT_OQ), _mm256_cmp_ps(t1, vmax, _CMP_LT_OQ)));
+    __m256 res = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), t1, hit1), t0, hit0);
+    _mm256_storeu_ps(t, res);
+#elif defined(__SSE2__)
+    __m128 ocx = _mm_sub_ps(_mm_set1_ps(o[0]), _mm_loadu_ps(&s.cx[base]));
+    __m128 ocy = _mm_sub_ps(_mm_set1_ps(o[1]), _mm_loadu_ps(&s.cy[base]));
+    __m128 ocz = _mm_sub_ps(_mm_set1_ps(o[2]), _mm_loadu_ps(&s.cz[base]));
+    __m128 r = _mm_loadu_ps(&s.radius[base]), va = _mm_set1_ps(a);
+    __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, _mm_set1_ps(dir[0])), _mm_mul_ps(ocy, _mm_set1_ps(dir[1]))),
+                          _mm_mul_ps(ocz, _mm_set1_ps(dir[2])));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+                          _mm_mul_ps(r, r));
+    __m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+    __m128 zero = _mm_setzero_ps();
+    __m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+    __m128 nb = _mm_sub_ps(zero, b);
+    __m128 t0 = _mm_div_ps(_mm_sub_ps(nb, sq), va), t1 = _mm_div_ps(_mm_add_ps(nb, sq), va);
+    __m128 vmin = _mm_set1_ps(t_min), vmax = _mm_set1_ps(limit);
+    __m128 valid = _mm_cmpgt_ps(disc, zero);
+    __m128 hit0 = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t0, vmin), _mm_cmplt_ps(t0, vmax)));
+    __m128 hit1 = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t1, vmin), _mm_cmplt_ps(t1, vmax)));
+    __m128 res = _mm_or_ps(_mm_and_ps(hit1, t1), _mm_andnot_ps(hit1, _mm_set1_ps(FLT_MAX)));
+    res = _mm_or_ps(_mm_and_ps(hit0, t0), _mm_andnot_ps(hit0, res));
+    _mm_storeu_ps(t, res);
+#else
+    for (int l = 0; l < sphere_simd_width; l++) {
+        float ocx = o[0] - s.cx[base + l], ocy = o[1] - s.cy[base + l], ocz = o[2] - s.cz[base + l];
+        float b = ocx*dir[0] + ocy*dir[1] + ocz*dir[2];
+        float c = ocx*ocx + ocy*ocy + ocz*ocz - s.radius[base + l]*s.radius[base + l];
+        float discriminant = b*b - a*c;
+        float sq = sqrt(discriminant > 0 ? discriminant : 0);
+        float t0 = (-b - sq)/a, t1 = (-b + sq)/a;
+        bool hit0 = discriminant > 0 && t0 > t_min && t0 < limit;
+        bool hit1 = discriminant > 0 && t1 > t_min && t1 < limit;
+        t[l] = hit0 ? t0 : (hit1 ? t1 : FLT_MAX);
+    }
+#endif
+}
+
+/** Núcleo de intersección de un rayo con count esferas a partir de first, en grupos de sphere_simd_width.
+  * Primero se calcula el t de todo el grupo a la vez y después se reduce al mínimo. Punto, normal y uv no se calculan
+  * aquí: sólo hacen falta para la ganadora. Un grupo puede pasarse del final del rango y probar esferas de la hoja
+  * siguiente, lo cual es correcto porque también son geometría de la escena.
+   * @return Índice de la esfera más cercana, o -1 si ninguna mejora t_max. Si hay ganadora, t_max se actualiza.
+   */
+inline int nearest_sphere(const sphere_soa& s, uint32_t first, uint32_t count, const vec3& o, const vec3& dir, float t_min, float& t_max) {
+    float a = dot(dir, dir);
+    int best = -1;
+    float t[sphere_simd_width];
+    for (uint32_t base = first; base < first + count; base += sphere_simd_width) {
+        sphere_group_t(s, base, o, dir, a, t_min, t_max, t);
+        for (int l = 0; l < sphere_simd_width; l++) {
+            if (t[l] < t_max) {
+                t_max = t[l];
+                best = base + l;
+            }
+        }
+    }
+    return best;
+}
+
+/// Rectángulos alineados con los ejes. axis es el eje normal (0 = yz_rect, 1 = xz_rect, 2 = xy_rect), y [a0,a1]x[b0,b1] el rango en los otros dos.
+struct rect_soa {
+    std::vector<float> a0, a1, b0, b1, k;
+    std::vector<unsigned char> axis, flip;
+    std::vector<material *> mat;
+};
+
+/// Elipses (ellipse y ellipse_sa), con el plano dado por el centro y el normal perp.
+struct ellipse_soa {
+    std::vector<vec3> center, axis1, axis2, perp;
+    std::vector<material *> mat;
+};
+
+/// Primitiva recogida del árbol de hittables antes de construir el BVH.
+struct flat_prim_source {
+    int type;
+    const hittable *obj;
+    bool flip;
+};
+
+/** Escena plana: las primitivas se agrupan por tipo en vectores contiguos (SoA) y las hojas del BVH guardan identificadores
+  * compactos de primitiva. La intersección se despacha con un switch sobre el tipo en lugar de una llamada virtual, y los
+  * datos de cada hoja quedan contiguos en memoria. Los objetos que no tienen tipo propio (instancias, cajas, esferas en
+  * movimiento...) se guardan como genéricos y se intersecan con su intersect(). Las mallas de triángulos también: cada
+  * una es una sola entrada que recorre su propio BVH, el que se guarda en la caché de la malla, en lugar de repartir sus
+  * triángulos por el BVH de la escena. Así el BVH de la escena hace de nivel superior (TLAS) sobre las instancias y las
+  * mallas, cuyos BVH (BLAS) se comparten entre todas las instancias que apuntan a ellos.
+  * La API de hittable sigue sirviendo para describir la escena: este objeto se construye a partir de ella.
+  */
+class flat_scene: public hittable  {
+    public:
+        flat_scene() {}
+        /// Aplana el árbol de hittable_list, bvh_node y flip_normals que cuelga de world y construye el BVH.
+        flat_scene(hittable *world);
+        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        /// Recorre el BVH buscando el t más cercano y la primitiva, sin rellenar ningún hit_record.
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_query& q) const;
+        /// Rellena el hit_record de la primitiva ganadora.
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            if (nodes.empty())
+                return false;
+            box = aabb(vec3(nodes[0].bmin[0], nodes[0].bmin[1], nodes[0].bmin[2]),
+                       vec3(nodes[0].bmax[0], nodes[0].bmax[1], nodes[0].bmax[2]));
+            return true;
+        }
+
+        /// Recoge recursivamente las primitivas de h.
+        void collect(const hittable *h, bool flip, std::vector<flat_prim_source>& out);
+        /// Añade la primitiva s a los vectores de su tipo y devuelve su identificador.
+        uint32_t emit(const flat_prim_source& s);
+        /// Caja de la primitiva s.
+        aabb source_box(const flat_prim_source& s) const;
+
+        /// Recorre el BVH sin orden y termina en la primera primitiva que corta el rayo.
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
+        /** Recorre el BVH una sola vez para todo el paquete: cada nodo se visita si lo corta alguno de los rayos, y se
+           * prueba contra todos a la vez. En las hojas sólo se intersecan los rayos que cortan su caja.
+           */
+        virtual void intersect_packet(const ray_packet& p, float t_min, bool *hit, hit_query *q) const;
+
+        /** Busca la primitiva más cercana en la hoja n. Actualiza t_max y best. Los genéricos escriben en q.
+           * Con any_hit vuelve en cuanto encuentra una, y los genéricos sólo se consultan con occluded().
+           */
+        void intersect_leaf(const ray& r, const mesh_bvh_node& n, float t_min, float& t_max, uint32_t& best, hit_query& q,
+                            bool any_hit = false) const;
+        /// Rellena el hit_record de la primitiva id una vez que se sabe que es la más cercana.
+        void fill_record(const ray& r, uint32_t id, float t, hit_record& rec) const;
+
+        std::vector<mesh_bvh_node> nodes;
+        /// Identificadores de primitiva en el orden de las hojas. En cada hoja están agrupados por tipo.
+        std::vector<uint32_t> prims;
+        sphere_soa spheres;
+        rect_soa rects;
+        ellipse_soa ellipses;
+        std::vector<const hittable *> generics;
+};
+
+/// Indica si h es uno de los rectángulos alineados con los ejes.
+bool is_rect(const hittable *h) {
+    return dynamic_cast<const xy_rect *>(h) || dynamic_cast<const xz_rect *>(h) || dynamic_cast<const yz_rect *>(h)
+        || dynamic_cast<const xz_rect_sa *>(h);
+}
+
+void flat_scene::collect(const hittable *h, bool flip, std::vector<flat_prim_source>& out) {
+    flat_prim_source s;
+    s.obj = h;
+    s.flip = flip;
+    if (const hittable_list *l = dynamic_cast<const hittable_list *>(h)) {
+        for (int i = 0; i < l->list_size; i++)
+            collect(l->list[i], flip, out);
+        return;
+    }
+    if (const bvh_node *b = dynamic_cast<const bvh_node *>(h)) {
+        collect(b->left, flip, out);
+        if (b->right != b->left)
+            collect(b->right, flip, out);
+        return;
+    }
+    if (const flip_normals *f = dynamic_cast<const flip_normals *>(h)) {
+        // Los rectángulos invertidos se guardan como rectángulos con el normal cambiado de signo.
+        // Un flip_normals sobre cualquier otra cosa se conserva entero como genérico.
+        if (is_rect(f->ptr)) {
+            collect(f->ptr, !flip, out);
+            return;
+        }
+        s.type = prim_generic;
+    }
+    else if (dynamic_cast<const sphere *>(h))
+        s.type = prim_sphere;
+    else if (is_rect(h))
+        s.type = prim_rect;
+    else if (dynamic_cast<const ellipse *>(h) || dynamic_cast<const ellipse_sa *>(h))
+        s.type = prim_ellipse;
+    else
+        s.type = prim_generic;
+    out.push_back(s);
+}
+
+aabb flat_scene::source_box(const flat_prim_source& s) const {
+    aabb box;
+    if (!s.obj->bounding_box(0, 1, box))
+        std::cerr << "no bounding box in flat_scene constructor\n";
+    return box;
+}
+
+uint32_t flat_scene::emit(const flat_prim_source& s) {
+    switch (s.type) {
+        case prim_sphere: {
+            const sphere *p = (const sphere *) s.obj;
+            spheres.cx.push_back(p->center.x());
+            spheres.cy.push_back(p->center.y());
+            spheres.cz.push_back(p->center.z());
+            spheres.radius.push_back(p->radius);
+            spheres.mat.push_back(p->mat_ptr);
+            return make_prim_id(prim_sphere, spheres.size() - 1);
+        }
+        case prim_rect: {
+            float a0, a1, b0, b1, k;
+            int axis;
+            material *mat;
+            if (const xy_rect *p = dynamic_cast<const xy_rect *>(s.obj)) {
+                a0 = p->x0; a1 = p->x1; b0 = p->y0; b1 = p->y1; k = p->k; axis = 2; mat = p->mp;
+            }
+            else if (const xz_rect *p = dynamic_cast<const xz_rect *>(s.obj)) {
+                a0 = p->x0; a1 = p->x1; b0 = p->z0; b1 = p->z1; k = p->k; axis = 1; mat = p->mp;
+            }
+            else if (const xz_rect_sa *p = dynamic_cast<const xz_rect_sa *>(s.obj)) {
+                a0 = p->x0; a1 = p->x1; b0 = p->z0; b1 = p->z1; k = p->k; axis = 1; mat = p->mp;
+            }
+            else {
+                const yz_rect *q = (const yz_rect *) s.obj;
+                a0 = q->y0; a1 = q->y1; b0 = q->z0; b1 = q->z1; k = q->k; axis = 0; mat = q->mp;
+            }
+            rects.a0.push_back(a0); rects.a1.push_back(a1);
+            rects.b0.push_back(b0); rects.b1.push_back(b1);
+            rects.k.push_back(k);
+            rects.axis.push_back(axis);
+            rects.flip.push_back(s.flip);
+            rects.mat.push_back(mat);
+            return make_prim_id(prim_rect, rects.mat.size() - 1);
+        }
+        case prim_ellipse: {
+            if (const ellipse *p = dynamic_cast<const ellipse *>(s.obj)) {
+                ellipses.center.push_back(p->center); ellipses.axis1.push_back(p->axis1);
+                ellipses.axis2.push_back(p->axis2); ellipses.perp.push_back(p->perp);
+                ellipses.mat.push_back(p->mat_ptr);
+            }
+            else {
+                const ellipse_sa *q = (const ellipse_sa *) s.obj;
+                ellipses.center.push_back(q->center); ellipses.axis1.push_back(q->axis1);
+                ellipses.axis2.push_back(q->axis2); ellipses.perp.push_back(q->perp);
+                ellipses.mat.push_back(q->mat_ptr);
+            }
+            return make_prim_id(prim_ellipse, ellipses.mat.size() - 1);
+        }
+        default:
+            generics.push_back(s.obj);
+            return make_prim_id(prim_generic, generics.size() - 1);
+    }
+}
+
+flat_scene::flat_scene(hittable *world) {
+    std::vector<flat_prim_source> sources;
+    collect(world, false, sources);
+    uint32_t n = sources.size();
+    if (n == 0)
+        return;
+    mesh_build_data d;
+    d.boxes.resize(n);
+    d.centroids.resize(n);
+    d.order.resize(n);
+    for (uint32_t i = 0; i < n; i++) {
+        d.boxes[i] = source_box(sources[i]);
+        d.centroids[i] = 0.5*(d.boxes[i].min() + d.boxes[i].max());
+        d.order[i] = i;
+    }
+    build_mesh_bvh_node(d, nodes, 0, n, 0, flat_leaf_size);
+    // Dentro de cada hoja se agrupan las primitivas por tipo, y se guardan en los vectores SoA en el orden de las hojas,
+    // así que cada hoja recorre rangos contiguos de cada tipo.
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].count == 0)
+            continue;
+        std::stable_sort(&d.order[0] + nodes[i].offset, &d.order[0] + nodes[i].offset + nodes[i].count,
+                         [&](uint32_t a, uint32_t b) { return sources[a].type < sources[b].type; });
+    }
+    prims.resize(n);
+    for (uint32_t i = 0; i < n; i++)
+        prims[i] = emit(sources[d.order[i]]);
+    spheres.pad();
+}
+
+void flat_scene::intersect_leaf(const ray& r, const mesh_bvh_node& n, float t_min, float& t_max, uint32_t& best, hit_query& q,
+                                bool any_hit) const {
+    uint32_t i = n.offset, end = n.offset + n.count;
+    vec3 o = r.origin(), dir = r.direction();
+    while (i < end) {
+        // Tramo de primitivas consecutivas del mismo tipo, que ocupan posiciones consecutivas de su vector.
+        int type = prim_id_type(prims[i]);
+        uint32_t first = prim_id_index(prims[i]);
+        uint32_t run = 1;
+        while (i + run < end && prim_id_type(prims[i + run]) == type)
+            run++;
+        switch (type) {
+            case prim_sphere: {
+                STAT_ADD(prim_tests[stat_sphere], run);
+                int j = nearest_sphere(spheres, first, run, o, dir, t_min, t_max);
+                if (j >= 0)
+                    best = make_prim_id(prim_sphere, j);
+                break;
+            }
+            case prim_rect: {
+                STAT_ADD(prim_tests[stat_rect], run);
+                for (uint32_t j = first; j < first + run; j++) {
+                    int k = rects.axis[j];
+                    int ia = (k == 0) ? 1 : 0;
+                    int ib = (k == 2) ? 1 : 2;
+                    float t = (rects.k[j] - o[k]) / dir[k];
+                    if (t < t_min || t > t_max)
+                        continue;
+                    float x = o[ia] + t*dir[ia];
+                    float y = o[ib] + t*dir[ib];
+                    if (x < rects.a0[j] || x > rects.a1[j] || y < rects.b0[j] || y > rects.b1[j])
+                        continue;
+                    t_max = t;
+                    best = make_prim_id(prim_rect, j);
+                }
+                break;
+            }
+            case prim_ellipse: {
+                STAT_ADD(prim_tests[stat_ellipse], run);
+                for (uint32_t j = first; j < first + run; j++) {
+                    const vec3& center = ellipses.center[j];
+                    float t = dot(center - o, ellipses.perp[j]) / dot(dir, ellipses.perp[j]);
+                    if (t < t_min || t > t_max)
+                        continue;
+                    vec3 d = o + t*dir - center;
+                    float q_x = dot(d, ellipses.axis1[j]) / ellipses.axis1[j].squared_length();
+                    float q_y = dot(d, ellipses.axis2[j]) / ellipses.axis2[j].squared_length();
+                    if (q_x*q_x + q_y*q_y <= 1) {
+                        t_max = t;
+                        best = make_prim_id(prim_ellipse, j);
+                    }
+                }
+                break;
+            }
+            default: {
+                STAT_ADD(prim_tests[stat_other], run);
+                for (uint32_t j = first; j < first + run; j++) {
+                    if (any_hit) {
+                        if (generics[j]->occluded(r, t_min, t_max)) {
+                            best = make_prim_id(prim_generic, j);
+                            return;
+                        }
+                    }
+                    else if (generics[j]->intersect(r, t_min, t_max, q)) {
+                        t_max = q.t;
+                        best = make_prim_id(prim_generic, j);
+                    }
+                }
+                break;
+            }
+        }
+        if (any_hit && best != 0xffffffff)
+            return;
+        i += run;
+    }
+}
+
+void flat_scene::fill_record(const ray& r, uint32_t id, float t, hit_record& rec) const {
+    uint32_t j = prim_id_index(id);
+    rec.t = t;
+    rec.p = r.point_at_parameter(t);
+    switch (prim_id_type(id)) {
+        case prim_sphere: {
+            vec3 center(spheres.cx[j], spheres.cy[j], spheres.cz[j]);
+            rec.normal = (rec.p - center) / spheres.radius[j];
+            get_sphere_uv(rec.normal, rec.u, rec.v);
+            rec.mat_ptr = spheres.mat[j];
+            break;
+        }
+        case prim_rect: {
+            int k = rects.axis[j];
+            int ia = (k == 0) ? 1 : 0;
+            int ib = (k == 2) ? 1 : 2;
+            rec.u = (rec.p[ia] - rects.a0[j]) / (rects.a1[j] - rects.a0[j]);
+            rec.v = (rec.p[ib] - rects.b0[j]) / (rects.b1[j] - rects.b0[j]);
+            vec3 normal(0, 0, 0);
+            normal[k] = rects.flip[j] ? -1 : 1;
+            rec.normal = normal;
+            rec.mat_ptr = rects.mat[j];
+            break;
+        }
+        case prim_ellipse: {
+            vec3 q = rec.p - ellipses.center[j];
+            float q_x = dot(q, ellipses.axis1[j]) / ellipses.axis1[j].squared_length();
+            float q_y = dot(q, ellipses.axis2[j]) / ellipses.axis2[j].squared_length();
+            rec.normal = ellipses.perp[j];
+            rec.u = (atan2(q_x, q_y)+M_PI)*1.0/(2*M_PI);
+            rec.v = sqrt(q_x*q_x + q_y*q_y);
+            rec.mat_ptr = ellipses.mat[j];
+            break;
+        }
+    }
+}
+
+bool flat_scene::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+bool flat_scene::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
+    if (nodes.empty())
+        return false;
+    watertight_ray wr(r);
+    uint32_t best = 0xffffffff;
+    uint32_t stack[128];
+    int top = 0;
+    float t_enter;
+    if (!hit_node_box(wr, nodes[0], t_min, t_max, t_enter))
+        return false;
+    stack[top++] = 0;
+    while (top > 0) {
+        const mesh_bvh_node& n = nodes[stack[--top]];
+        STAT_INC(node_visits);
+        if (n.count > 0) {
+            intersect_leaf(r, n, t_min, t_max, best, q);
+            continue;
+        }
+        uint32_t left = &n - &nodes[0] + 1, right = n.offset;
+        float t_left, t_right;
+        bool hit_left = hit_node_box(wr, nodes[left], t_min, t_max, t_left);
+        bool hit_right = hit_node_box(wr, nodes[right], t_min, t_max, t_right);
+        if (hit_left && hit_right) {
+            if (t_left < t_right) {
+                stack[top++] = right;
+                stack[top++] = left;
+            }
+            else {
+                stack[top++] = left;
+                stack[top++] = right;
+            }
+        }
+        else if (hit_left)
+            stack[top++] = left;
+        else if (hit_right)
+            stack[top++] = right;
+    }
+    if (best == 0xffffffff)
+        return false;
+    // Si el más cercano es un genérico, q ya lo describe.
+    if (prim_id_type(best) != prim_generic) {
+        set_query(q, t_max, this);
+        q.prim = best;
+    }
+    return true;
+}
+
+void flat_scene::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    fill_record(r, q.prim, q.t, rec);
+}
+
+bool flat_scene::occluded(const ray& r, float t_min, float t_max) const {
+    if (nodes.empty())
+        return false;
+    watertight_ray wr(r);
+    uint32_t best = 0xffffffff;
+    hit_query q;
+    uint32_t stack[128];
+    int top = 0;
+    float t_enter;
+    if (!hit_node_box(wr, nodes[0], t_min, t_max, t_enter))
+        return false;
+    stack[top++] = 0;
+    while (top > 0) {
+        const mesh_bvh_node& n = nodes[stack[--top]];
+        STAT_INC(node_visits);
+        if (n.count > 0) {
+            intersect_leaf(r, n, t_min, t_max, best, q, true);
+            if (best != 0xffffffff)
+                return true;
+            continue;
+        }
+        // Cualquier intersección vale, así que no hace falta ordenar los hijos.
+        uint32_t left = &n - &nodes[0] + 1, right = n.offset;
+        if (hit_node_box(wr, nodes[right], t_min, t_max, t_enter))
+            stack[top++] = right;
+        if (hit_node_box(wr, nodes[left], t_min, t_max, t_enter))
+            stack[top++] = left;
+    }
+    return false;
+}
+
+/** Prueba la caja del nodo n contra los rayos del paquete, con las inversas de las direcciones en inv_x, inv_y, inv_z.
+  * El bucle no tiene saltos, para que el compilador lo pueda vectorizar.
+  * @param mask Se pone a 1 para los rayos que cortan la caja en [t_min, t_max[i]].
+  * @return Verdadero si la corta alguno.
+  */
+inline bool packet_hit_node_box(const ray_packet& p, const float *inv_x, const float *inv_y, const float *inv_z,
+                                const mesh_bvh_node& n, float t_min, const float *t_max, unsigned char *mask) {
+    int any = 0;
+    for (int i = 0; i < p.size; i++) {
+        float x0 = (n.bmin[0] - p.ox[i]) * inv_x[i], x1 = (n.bmax[0] - p.ox[i]) * inv_x[i];
+        float y0 = (n.bmin[1] - p.oy[i]) * inv_y[i], y1 = (n.bmax[1] - p.oy[i]) * inv_y[i];
+        float z0 = (n.bmin[2] - p.oz[i]) * inv_z[i], z1 = (n.bmax[2] - p.oz[i]) * inv_z[i];
+        float lo = x0 < x1 ? x0 : x1, hi = x0 < x1 ? x1 : x0;
+        float ylo = y0 < y1 ? y0 : y1, yhi = y0 < y1 ? y1 : y0;
+        float zlo = z0 < z1 ? z0 : z1, zhi = z0 < z1 ? z1 : z0;
+        lo = ylo > lo ? ylo : lo;
+        lo = zlo > lo ? zlo : lo;
+        lo = t_min > lo ? t_min : lo;
+        hi = yhi < hi ? yhi : hi;
+        hi = zhi < hi ? zhi : hi;
+        hi = t_max[i] < hi ? t_max[i] : hi;
+        mask[i] = lo <= hi;
+        any |= mask[i];
+    }
+    return any;
+}
+
+void flat_scene::intersect_packet(const ray_packet& p, float t_min, bool *hit, hit_query *q) const {
+    int n = p.size;
+    float inv_x[ray_packet_max], inv_y[ray_packet_max], inv_z[ray_packet_max], t_max[ray_packet_max];
+    uint32_t best[ray_packet_max];
+    unsigned char mask[ray_packet_max];
+    ray rays[ray_packet_max];
+    for (int i = 0; i < n; i++) {
+        rays[i] = p.get(i);
+        inv_x[i] = 1.0f / p.dx[i];
+        inv_y[i] = 1.0f / p.dy[i];
+        inv_z[i] = 1.0f / p.dz[i];
+        t_max[i] = FLT_MAX;
+        best[i] = 0xffffffff;
+        hit[i] = false;
+    }
+    if (nodes.empty() || n == 0)
+        return;
+    // Los hijos se ordenan por la dirección del primer rayo: en un paquete coherente vale para todos.
+    vec3 d0(p.dx[0], p.dy[0], p.dz[0]);
+    uint32_t stack[128];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const mesh_bvh_node& node = nodes[stack[--top]];
+        // En un paquete la visita es compartida y se cuenta una vez.
+        STAT_INC(node_visits);
+        if (!packet_hit_node_box(p, inv_x, inv_y, inv_z, node, t_min, t_max, mask))
+            continue;
+        if (node.count > 0) {
+            for (int i = 0; i < n; i++) {
+                if (mask[i])
+                    intersect_leaf(rays[i], node, t_min, t_max[i], best[i], q[i]);
+            }
+            continue;
+        }
+        uint32_t left = &node - &nodes[0] + 1, right = node.offset;
+        float c_left = 0, c_right = 0;
+        for (int a = 0; a < 3; a++) {
+            c_left += (nodes[left].bmin[a] + nodes[left].bmax[a]) * d0[a];
+            c_right += (nodes[right].bmin[a] + nodes[right].bmax[a]) * d0[a];
+        }
+        if (c_left < c_right) {
+            stack[top++] = right;
+            stack[top++] = left;
+        }
+        else {
+            stack[top++] = left;
+            stack[top++] = right;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (best[i] == 0xffffffff)
+            continue;
+        hit[i] = true;
+        if (prim_id_type(best[i]) != prim_generic) {
+            set_query(q[i], t_max[i], this);
+            q[i].prim = best[i];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef HEATMAPH
+#define HEATMAPH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/** Mapas de coste por píxel: tiempo, rayos trazados y profundidad media de los caminos. Sirven para ver qué zonas de
+  * la imagen son caras (la esfera de cristal, los bordes de la luz...) y para decidir dónde tomar más muestras.
+  */
+
+/// Rayos que lleva el camino actual del hilo, sin contar el primario. Los integradores los incrementan siempre.
+struct path_counters {
+    uint32_t bounces, shadows;
+};
+
+inline path_counters& thread_path_counters() {
+    static thread_local path_counters c = {0, 0};
+    return c;
+}
+
+/// Buffers de coste, por filas de arriba abajo como la imagen.
+class pixel_heatmap {
+    public:
+        pixel_heatmap(int w, int h) : nx(w), ny(h), seconds(w*h, 0), rays(w*h, 0), depth(w*h, 0), samples(w*h, 0) {}
+
+        /** Suma el coste de una muestra.
+          * @param k Índice del píxel en la imagen.
+          * @param s Segundos que ha costado.
+          * @param c Contadores del camino; el rayo primario se suma aparte.
+          */
+        void add(int k, double s, const path_counters& c) {
+            seconds[k] += s;
+            rays[k] += 1 + c.bounces + c.shadows;
+            depth[k] += c.bounces;
+            samples[k]++;
+        }
+
+        /** Escribe los tres mapas junto a la imagen: prefix_time, prefix_rays y prefix_depth, cada uno en PFM con los
+          * valores de verdad (segundos y rayos totales del píxel, rebotes medios por muestra) y en PPM en falso color.
+          * @return Falso si no se ha podido escribir algún fichero.
+          */
+        bool write(const std::string& prefix) const {
+            std::vector<float> mean_depth(nx*ny);
+            for (int k = 0; k < nx*ny; k++)
+                mean_depth[k] = samples[k] ? depth[k] / samples[k] : 0;
+            bool ok = true;
+            ok &= write_map(prefix + "_time", seconds);
+            ok &= write_map(prefix + "_rays", rays);
+            ok &= write_map(prefix + "_depth", mean_depth);
+            return ok;
+        }
+
+    private:
+        bool write_map(const std::string& name, const std::vector<float>& v) const {
+            return write_pfm(name + ".pfm", v) && write_false_color(name + ".ppm", v);
+        }
+
+        /// PFM de un canal: filas de abajo arriba, floats en el orden de bytes de la máquina (escala negativa si es little endian).
+        bool write_pfm(const std::string& name, const std::vector<float>& v) const {
+            FILE *f = fopen(name.c_str(), "wb");
+            if (!f)
+                return false;
+            const uint16_t probe = 1;
+            bool little = *(const uint8_t *) &probe == 1;
+            fprintf(f, "Pf\n%d %d\n%s\n", nx, ny, little ? "-1.0" : "1.0");
+            bool ok = true;
+            for (int j = ny-1; j >= 0; j--)
+                ok &= fwrite(&v[j*nx], sizeof(float), nx, f) == size_t(nx);
+            return fclose(f) == 0 && ok;
+        }
+
+        /** PPM en falso color, de negro (coste nulo) a azul, rojo, amarillo y blanco. La escala satura en el percentil 99
+          * para que unos pocos píxeles carísimos no dejen el resto en negro.
+          */
+        bool write_false_color(const std::string& name, const std::vector<float>& v) const {
+            std::vector<float> sorted(v);
+            size_t p = std::min(sorted.size() - 1, size_t(0.99 * sorted.size()));
+            std::nth_element(sorted.begin(), sorted.begin() + p, sorted.end());
+            float top = sorted[p] > 0 ? sorted[p] : 1;
+            static const float ramp[5][3] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+            FILE *f = fopen(name.c_str(), "w");
+            if (!f)
+                return false;
+            fprintf(f, "P3\n%d %d\n255\n", nx, ny);
+            for (int k = 0; k < nx*ny; k++) {
+                float x = std::min(1.0f, std::max(0.0f, v[k] / top)) * 4;
+                int a = std::min(3, int(x));
+                float t = x - a;
+                int c[3];
+                for (int i = 0; i < 3; i++)
+                    c[i] = int(255.99 * ((1-t)*ramp[a][i] + t*ramp[a+1][i]));
+                fprintf(f, "%d %d %d\n", c[0], c[1], c[2]);
+            }
+            return fclose(f) == 0;
+        }
+
+        int nx, ny;
+        std::vector<float> seconds, rays, depth, samples;
+};
+
+#endif
@@ -14,6 +14,7 @@
 #include "aabb.h"
 
 #include <float.h>
+#include <stdint.h>
 
 
 class material;
@@ -36,14 +37,96 @@ struct hit_record
     material *mat_ptr;
 };
 
+class hittable;
+
+/** Resultado de la fase barata de la intersección: el t más cercano y qué primitiva lo da, sin punto, normal, uv ni material.
+  * El hit_record completo se calcula después una sola vez, para la intersección ganadora, con resolve_hit.
+  */
+struct hit_query
+{
+    float t;
+    /// Primitiva que sabe completar el hit_record con surface(), o 0 si rec ya está completo.
+    const hittable *obj;
+    /// Instancia en cuyo espacio de objeto está obj, o 0 si obj está en coordenadas del mundo.
+    const hittable *inst;
+    /// Datos propios de la primitiva para surface(): índice de subprimitiva y coordenadas baricéntricas.
+    uint32_t prim;
+    float b1, b2;
+    /// Verdadero si hay que invertir el normal al final (flip_normals).
+    bool flip;
+    /// hit_record ya completo, para los objetos que sólo implementan hit().
+    hit_record rec;
+};
+
 class hittable  {
     public:
         virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(float t0, float t1, aabb& box) const = 0;
         virtual float  pdf_value(const vec3& o, const vec3& v) const  {return 0.0;}
         virtual vec3 random(const vec3& o) {return vec3(1, 0, 0);}
+        /** Fase barata: busca la intersección más cercana en [t_min, t_max] y sólo guarda en q su t y la primitiva.
+           * Sólo modifica q si encuentra una intersección. Por defecto llama a hit() y guarda el hit_record completo.
+           */
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
+            if (hit(r, t_min, t_max, q.rec)) {
+                q.t = q.rec.t;
+                q.obj = 0;
+                q.inst = 0;
+                q.flip = false;
+                return true;
+            }
+            else
+                return false;
+        }
+        /// Fase cara: completa rec para la intersección q que ha encontrado intersect() en este objeto con el rayo r.
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const {
+            rec = q.rec;
+        }
+        /** Consulta de visibilidad: verdadero si el rayo corta algo en [t_min, t_max]. Termina en la primera intersección que
+           * encuentra, no necesariamente la más cercana, y nunca construye un hit_record.
+           */
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            hit_query q;
+            return intersect(r, t_min, t_max, q);
+        }
+        /** intersect() para todos los rayos de un paquete, sin límite superior. En hit[i] se indica si el rayo i corta algo,
+           * y entonces q[i] describe la intersección. Por defecto se consulta rayo a rayo.
+           */
+        virtual void intersect_packet(const ray_packet& p, float t_min, bool *hit, hit_query *q) const {
+            for (int i = 0; i < p.size; i++)
+                hit[i] = intersect(p.get(i), t_min, FLT_MAX, q[i]);
+        }
 };
 
+/// Apunta en q una intersección de la primitiva obj en t, que se completará después con obj->surface().
+inline void set_query(hit_query& q, float t, const hittable *obj) {
+    q.t = t;
+    q.obj = obj;
+    q.inst = 0;
+    q.flip = false;
+}
+
+/// Calcula el hit_record completo de la intersección q, encontrada con intersect() para el rayo r.
+void resolve_hit(const ray& r, const hit_query& q, hit_record& rec) {
+    if (q.inst)
+        q.inst->surface(r, q, rec);
+    else if (q.obj)
+        q.obj->surface(r, q, rec);
+    else
+        rec = q.rec;
+    if (q.flip)
+        rec.normal = -rec.normal;
+}
+
+/// hit() en dos fases, para los objetos que implementan intersect() y surface().
+inline bool hit_deferred(const hittable *h, const ray& r, float t_min, float t_max, hit_record& rec) {
+    hit_query q;
+    if (!h->intersect(r, t_min, t_max, q))
+        return false;
+    resolve_hit(r, q, rec);
+    return true;
+}
+
 class flip_normals : public hittable {
     public:
         flip_normals(hittable *p) : ptr(p) {}
@@ -55,9 +138,28 @@ class flip_normals : public hittable {
             else
                 return false;
         }
+        /// La inversión del normal se aplica al resolver la intersección, si es que este objeto resulta el más cercano.
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
+            if (ptr->intersect(r, t_min, t_max, q)) {
+                q.flip = !q.flip;
+                return true;
+            }
+            else
+                return false;
+        }
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            return ptr->occluded(r, t_min, t_max);
+        }
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             return ptr->bounding_box(t0, t1, box);
         }
+        /// Una luz invertida se muestrea igual que la original.
+        virtual float pdf_value(const vec3& o, const vec3& v) const {
+            return ptr->pdf_value(o, v);
+        }
+        virtual vec3 random(const vec3& o) {
+            return ptr->random(o);
+        }
         hittable *ptr;
 };
 
@@ -65,6 +167,9 @@ class translate : public hittable {
     public:
         translate(hittable *p, const vec3& displacement) : ptr(p), offset(displacement) {}
         virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+        }
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
         hittable *ptr;
         vec3 offset;
@@ -93,6 +198,7 @@ class rotate_y : public hittable {
     public:
         rotate_y(hittable *p, float angle);
         virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             box = bbox; return hasbox;}
         hittable *ptr;
@@ -154,4 +260,14 @@ bool rotate_y::hit(const ray& r, float t_min, float t_max, hit_record& rec) cons
         return false;
 }
 
+bool rotate_y::occluded(const ray& r, float t_min, float t_max) const {
+    vec3 origin = r.origin();
+    vec3 direction = r.direction();
+    origin[0] = cos_theta*r.origin()[0] - sin_theta*r.origin()[2];
+    origin[2] =  sin_theta*r.origin()[0] + cos_theta*r.origin()[2];
+    direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
+    direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
+    return ptr->occluded(ray(origin, direction, r.time()), t_min, t_max);
+}
+
 #endif
@@ -13,6 +13,7 @@
 
 #include "hittable.h"
 #include "random.h"
+#include "sampler.h"
 
 
 class hittable_list: public hittable  {
@@ -20,6 +21,8 @@ class hittable_list: public hittable  {
         hittable_list() {}
         hittable_list(hittable **l, int n) {list = l; list_size = n; }
         virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_query& q) const;
+        virtual bool occluded(const ray& r, float tmin, float tmax) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
         virtual float  pdf_value(const vec3& o, const vec3& v) const;
         virtual vec3 random(const vec3& o) ;
@@ -37,7 +40,7 @@ float hittable_list::pdf_value(const vec3& o, const vec3& v) const {
 }
 
 vec3 hittable_list::random(const vec3& o) {
-        int index = int(random_double() * list_size);
+        int index = int(sample_1d(stream_light_select) * list_size);
         return list[ index ]->random(o);
 }
 
@@ -61,17 +64,27 @@ bool hittable_list::bounding_box(float t0, float t1, aabb& box) const {
 }
 
 bool hittable_list::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-        hit_record temp_rec;
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+// Each child only overwrites q when it finds something closer, so no temporary records are copied around.
+bool hittable_list::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
         bool hit_anything = false;
-        double closest_so_far = t_max;
+        float closest_so_far = t_max;
         for (int i = 0; i < list_size; i++) {
-            if (list[i]->hit(r, t_min, closest_so_far, temp_rec)) {
+            if (list[i]->intersect(r, t_min, closest_so_far, q)) {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                closest_so_far = q.t;
             }
         }
         return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, float t_min, float t_max) const {
+        for (int i = 0; i < list_size; i++)
+            if (list[i]->occluded(r, t_min, t_max))
+                return true;
+        return false;
+}
+
 #endif
@@ -0,0 +1,216 @@
+#ifndef INSTANCEH
+#define INSTANCEH
+
+#include <cmath>
+#include "hittable.h"
+
+/** Transformación afín guardada como matriz 3x4: las tres primeras columnas son la parte lineal y la cuarta la traslación.
+  */
+class affine_transform {
+    public:
+        /// El constructor por defecto crea la identidad.
+        affine_transform() {
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 4; j++)
+                    m[i][j] = (i == j) ? 1 : 0;
+        }
+        /// Traslación por el vector offset.
+        static affine_transform translation(const vec3& offset) {
+            affine_transform a;
+            for (int i = 0; i < 3; i++)
+                a.m[i][3] = offset[i];
+            return a;
+        }
+        /// Escalado independiente en cada eje.
+        static affine_transform scaling(const vec3& s) {
+            affine_transform a;
+            for (int i = 0; i < 3; i++)
+                a.m[i][i] = s[i];
+            return a;
+        }
+        /// Rotación de angle grados alrededor de un eje cualquiera que pasa por el origen (fórmula de Rodrigues).
+        static affine_transform rotation(const vec3& axis, float angle) {
+            float radians = (M_PI / 180.) * angle;
+            float c = cos(radians), s = sin(radians), t = 1 - c;
+            vec3 n = unit_vector(axis);
+            float x = n.x(), y = n.y(), z = n.z();
+            affine_transform a;
+            a.m[0][0] = t*x*x + c;   a.m[0][1] = t*x*y - s*z; a.m[0][2] = t*x*z + s*y;
+            a.m[1][0] = t*x*y + s*z; a.m[1][1] = t*y*y + c;   a.m[1][2] = t*y*z - s*x;
+            a.m[2][0] = t*x*z - s*y; a.m[2][1] = t*y*z + s*x; a.m[2][2] = t*z*z + c;
+            return a;
+        }
+        /// Rotación alrededor del eje Y, con el mismo convenio que rotate_y.
+        static affine_transform rotation_y(float angle) {
+            return rotation(vec3(0, 1, 0), angle);
+        }
+
+        /// Composición: (A*B)(p) = A(B(p)).
+        affine_transform operator*(const affine_transform& b) const {
+            affine_transform a;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 4; j++) {
+                    float sum = (j == 3) ? m[i][3] : 0;
+                    for (int k = 0; k < 3; k++)
+                        sum += m[i][k]*b.m[k][j];
+                    a.m[i][j] = sum;
+                }
+            }
+            return a;
+        }
+
+        /// Aplica la transformación a un punto.
+        vec3 point(const vec3& p) const {
+            return vec3(m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+                        m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+                        m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3]);
+        }
+        /// Aplica sólo la parte lineal, para vectores de dirección.
+        vec3 vector(const vec3& v) const {
+            return vec3(m[0][0]*v[0] + m[0][1]*v[1] + m[0][2]*v[2],
+                        m[1][0]*v[0] + m[1][1]*v[1] + m[1][2]*v[2],
+                        m[2][0]*v[0] + m[2][1]*v[1] + m[2][2]*v[2]);
+        }
+        /// Aplica la traspuesta de la parte lineal. Llamada sobre la inversa transforma normales.
+        vec3 transposed_vector(const vec3& v) const {
+            return vec3(m[0][0]*v[0] + m[1][0]*v[1] + m[2][0]*v[2],
+                        m[0][1]*v[0] + m[1][1]*v[1] + m[2][1]*v[2],
+                        m[0][2]*v[0] + m[1][2]*v[1] + m[2][2]*v[2]);
+        }
+
+        /// Calcula la inversa, que existe siempre que la parte lineal no sea singular.
+        affine_transform inverse() const {
+            affine_transform a;
+            float det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                      - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                      + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+            float inv_det = 1.0 / det;
+            a.m[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+            a.m[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * inv_det;
+            a.m[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+            a.m[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * inv_det;
+            a.m[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+            a.m[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * inv_det;
+            a.m[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+            a.m[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * inv_det;
+            a.m[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+            vec3 t = a.vector(vec3(m[0][3], m[1][3], m[2][3]));
+            for (int i = 0; i < 3; i++)
+                a.m[i][3] = -t[i];
+            return a;
+        }
+
+        /// Indica si la parte lineal es ortonormal, en cuyo caso las normales no hay que renormalizarlas.
+        bool is_rigid() const {
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    float d = m[0][i]*m[0][j] + m[1][i]*m[1][j] + m[2][i]*m[2][j];
+                    if (fabs(d - (i == j ? 1 : 0)) > 1e-5)
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        float m[3][4];
+};
+
+/** Instancia de un objeto: una transformación afín y su inversa que apuntan a una estructura de nivel inferior (BLAS) compartida.
+  * Muchas instancias pueden apuntar al mismo BLAS sin duplicar su geometría, y el rayo se transforma una sola vez por instancia,
+  * en lugar de una vez por cada envoltorio translate/rotate_y. No hace falta un BVH propio sobre las instancias: flat_scene
+  * las guarda como entradas genéricas de su BVH, que hace de estructura de nivel superior (TLAS).
+  */
+class instance: public hittable  {
+    public:
+        instance() {}
+        /// El constructor. Necesita el objeto compartido (normalmente un bvh_node) y la transformación de objeto a mundo.
+        instance(hittable *p, const affine_transform& object_to_world);
+        /// Transforma el rayo al espacio del objeto, interseca y devuelve el punto y el normal en coordenadas del mundo.
+        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        /// Interseca en el espacio del objeto y deja q apuntando a esta instancia; el hit_record se pasa al mundo en surface.
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_query& q) const;
+        /// Completa el hit_record en el espacio del objeto y transforma el punto y el normal al mundo.
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            return ptr->occluded(ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time()), t_min, t_max);
+        }
+        /// Caja en coordenadas del mundo, precalculada en el constructor.
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            box = bbox; return hasbox;}
+        /// Densidad de muestrear la dirección v desde o, calculada en el espacio del objeto. Es exacta para transformaciones rígidas.
+        virtual float pdf_value(const vec3& o, const vec3& v) const {
+            return ptr->pdf_value(world_to_object.point(o), world_to_object.vector(v));
+        }
+        /// Genera una dirección hacia el objeto desde o, en coordenadas del mundo.
+        virtual vec3 random(const vec3& o) {
+            return object_to_world.vector(ptr->random(world_to_object.point(o)));
+        }
+        /// Objeto compartido entre instancias.
+        hittable *ptr;
+        /// Transformación de objeto a mundo y su inversa.
+        affine_transform object_to_world, world_to_object;
+        /// Verdadero si la transformación conserva longitudes, y por tanto los normales siguen siendo unitarios.
+        bool rigid;
+        bool hasbox;
+        aabb bbox;
+};
+
+instance::instance(hittable *p, const affine_transform& m) : ptr(p), object_to_world(m) {
+    world_to_object = m.inverse();
+    rigid = m.is_rigid();
+    hasbox = ptr->bounding_box(0, 1, bbox);
+    vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+    vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                vec3 corner(i ? bbox.max().x() : bbox.min().x(),
+                            j ? bbox.max().y() : bbox.min().y(),
+                            k ? bbox.max().z() : bbox.min().z());
+                vec3 tester = object_to_world.point(corner);
+                for (int c = 0; c < 3; c++) {
+                    if (tester[c] > max[c])
+                        max[c] = tester[c];
+                    if (tester[c] < min[c])
+                        min[c] = tester[c];
+                }
+            }
+        }
+    }
+    bbox = aabb(min, max);
+}
+
+bool instance::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+bool instance::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
+    // La transformación es afín, así que el parámetro t es el mismo en ambos espacios.
+    ray local_r(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+    if (!ptr->intersect(local_r, t_min, t_max, q))
+        return false;
+    if (q.inst) {
+        // Instancia dentro de instancia: q sólo guarda un nivel, así que la interior se resuelve ya.
+        hit_record local_rec;
+        resolve_hit(local_r, q, local_rec);
+        q.rec = local_rec;
+        q.obj = 0;
+        q.flip = false;
+    }
+    q.inst = this;
+    return true;
+}
+
+void instance::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    ray local_r(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+    if (q.obj)
+        q.obj->surface(local_r, q, rec);
+    else
+        rec = q.rec;
+    rec.p = object_to_world.point(rec.p);
+    rec.normal = world_to_object.transposed_vector(rec.normal);
+    if (!rigid)
+        rec.normal.make_unit_vector();
+}
+
+#endif
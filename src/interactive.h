@@ -0,0 +1,183 @@
+#ifndef INTERACTIVEH
+#define INTERACTIVEH
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "film.h"
+#include "service.h"
+
+/** Vista previa interactiva: el render se va refinando por pasadas de una muestra por píxel, y tras cada pasada la
+  * imagen se copia a un fichero proyectado en memoria que un visor local puede ir leyendo. La cámara se cambia
+  * escribiendo líneas en una tubería con nombre; al cambiarla se empieza a acumular de nuevo, sin reconstruir la escena.
+  */
+
+/** Imagen PPM binaria (P6) proyectada en memoria. La cabecera tiene ancho fijo, así que los píxeles están siempre en el
+  * mismo sitio, y lleva en un comentario el número de imagen escrita, que sube con cada una, y las muestras por píxel
+  * que tiene: un visor sabe que hay imagen nueva cuando cambia el número. Se actualiza después de los píxeles.
+  */
+class mapped_image {
+    public:
+        mapped_image() : data(0), bytes(0), width(0), height(0), frame(0) {}
+        ~mapped_image() {
+            if (data)
+                munmap(data, bytes);
+        }
+
+        /// Crea (o trunca) el fichero path para una imagen de w x h y lo proyecta. @return Falso si no se ha podido.
+        bool open(const std::string& path, int w, int h) {
+            width = w;
+            height = h;
+            header = format_header(0, 0);
+            bytes = header.size() + size_t(w) * h * 3;
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                return false;
+            bool ok = ftruncate(fd, bytes) == 0;
+            void *p = ok ? mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (p == MAP_FAILED)
+                return false;
+            data = (char *) p;
+            memcpy(data, header.data(), header.size());
+            return true;
+        }
+
+        /** Copia una imagen de w x h, por filas de arriba abajo, con corrección gamma 2. Si es más pequeña que la del
+          * fichero, cada píxel se repite en el bloque que le toca.
+          * @param passes Muestras por píxel de la imagen, 0 para la vista previa.
+          */
+        void write(const std::vector<vec3>& image, int w, int h, int passes) {
+            unsigned char *p = (unsigned char *) data + header.size();
+            for (int j = 0; j < height; j++) {
+                const vec3 *row = &image[size_t(j * h / height) * w];
+                for (int i = 0; i < width; i++, p += 3) {
+                    const vec3& c = row[i * w / width];
+                    p[0] = ppm_value(c[0]);
+                    p[1] = ppm_value(c[1]);
+                    p[2] = ppm_value(c[2]);
+                }
+            }
+            std::string h2 = format_header(++frame, passes);
+            memcpy(data, h2.data(), h2.size());
+        }
+
+    private:
+        std::string format_header(unsigned f, int passes) const {
+            char s[96];
+            snprintf(s, sizeof(s), "P6\n# frame %010u passes %010d\n%d %d\n255\n", f, passes, width, height);
+            return s;
+        }
+
+        char *data;
+        size_t bytes;
+        int width, height;
+        unsigned frame;
+        std::string header;
+};
+
+/** Tubería con nombre por la que llegan las órdenes, una por línea. El proceso la abre también para escribir, para que
+  * no se cierre cuando un cliente acaba de escribir y se vaya.
+  */
+class control_pipe {
+    public:
+        control_pipe() : fd(-1), keep_open(-1) {}
+        ~control_pipe() {
+            if (fd >= 0)
+                close(fd);
+            if (keep_open >= 0)
+                close(keep_open);
+        }
+
+        /// Abre la tubería path, creándola si no existe. @return Falso si no se ha podido.
+        bool open(const std::string& path) {
+            if (mkfifo(path.c_str(), 0600) != 0 && errno != EEXIST)
+                return false;
+            fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK);
+            if (fd < 0)
+                return false;
+            keep_open = ::open(path.c_str(), O_WRONLY | O_NONBLOCK);
+            return true;
+        }
+
+        /// Cierto si ha llegado algo por leer.
+        bool ready() {
+            if (pending.find('\n') != std::string::npos)
+                return true;
+            pollfd p = {fd, POLLIN, 0};
+            return fd >= 0 && poll(&p, 1, 0) > 0 && (p.revents & POLLIN) != 0;
+        }
+
+        /** Líneas completas que han llegado, sin bloquear.
+          * @param wait_ms Si no hay ninguna, espera hasta ese tiempo a que llegue algo (-1 sin límite).
+          */
+        std::vector<std::string> read_lines(int wait_ms = 0) {
+            std::vector<std::string> lines;
+            if (fd < 0)
+                return lines;
+            if (wait_ms != 0 && pending.find('\n') == std::string::npos) {
+                pollfd p = {fd, POLLIN, 0};
+                poll(&p, 1, wait_ms);
+            }
+            char chunk[512];
+            ssize_t n;
+            while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+                pending.append(chunk, n);
+            size_t nl;
+            while ((nl = pending.find('\n')) != std::string::npos) {
+                lines.push_back(pending.substr(0, nl));
+                pending.erase(0, nl + 1);
+            }
+            return lines;
+        }
+
+    private:
+        int fd, keep_open;
+        std::string pending;
+};
+
+/** Aplica a la cámara de r una orden de la tubería: claves lookfrom=x,y,z, lookat=x,y,z y vfov=grados, las que se
+  * quieran en la misma línea.
+  * @param error Motivo si la orden no es válida. Se deja vacío si la línea no tiene ninguna clave.
+  * @return Cierto si la cámara ha cambiado; si no, r no cambia.
+  */
+inline bool parse_camera_command(const std::string& line, render_request& r, std::string& error) {
+    render_request c = r;
+    std::istringstream in(line);
+    std::string word;
+    bool any = false;
+    while (in >> word) {
+        any = true;
+        size_t eq = word.find('=');
+        std::string key = word.substr(0, eq), value = eq == std::string::npos ? "" : word.substr(eq + 1);
+        bool ok;
+        if (key == "lookfrom")
+            ok = parse_vec3(value, c.lookfrom);
+        else if (key == "lookat")
+            ok = parse_vec3(value, c.lookat);
+        else if (key == "vfov")
+            ok = (c.vfov = atof(value.c_str())) > 0 && c.vfov < 180;
+        else
+            ok = false;
+        if (!ok) {
+            error = "bad " + word;
+            return false;
+        }
+    }
+    if (!any)
+        return false;
+    r = c;
+    return true;
+}
+#endif
+
+#endif
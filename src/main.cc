@@ -10,10 +10,23 @@
 //==================================================================================================
 
 #include "aarect.h"
+#include "adaptive.h"
+#include "blue_noise.h"
 #include "box.h"
 #include "bvh.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "film.h"
+#include "flat_scene.h"
+#include "heatmap.h"
 #include "camera.h"
+#include "checkpoint.h"
+#include "direct_light.h"
 #include "hittable_list.h"
+#include "instance.h"
+#include "interactive.h"
+#include "mesh_cache.h"
+#include "mesh_loader.h"
 #include "material.h"
 #include "moving_sphere.h"
 #ifdef _MSC_VER
@@ -21,11 +34,16 @@
 #endif
 #include "pdf.h"
 #include "random.h"
+#include "sampler.h"
+#include "service.h"
 #include "sphere.h"
+#include "stats.h"
+#include "timers.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "surface_texture.h"
 #include "texture.h"
+#include "wavefront.h"
 #include "rectangleMap.h"
 #include "xz_rect_solidangle.h"
 #include "ellipses.h"
@@ -51,40 +69,128 @@ inline vec3 de_nan(const vec3& c) {
 
 
 
-vec3 color(const ray& r, hittable *world, hittable *light_shape, int depth) {
+vec3 color(const ray& r, hittable *world, hittable *light_shape, int depth);
+
+/// Igual que color(), pero con la intersección más cercana q ya calculada, por ejemplo en un paquete de rayos primarios.
+vec3 color_hit(const ray& r, const hit_query& q, hittable *world, hittable *light_shape, int depth) {
     hit_record hrec;
-    if (world->hit(r, 0.001, MAXFLOAT, hrec)) {
-        scatter_record srec;
-        vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.p);
-        if (depth < 50 && hrec.mat_ptr->scatter(r, hrec, srec)) {
-            if (srec.is_specular) {
-                return srec.attenuation * color(srec.specular_ray, world, light_shape, depth+1);
-            }
-            else {
-                hittable_pdf plight(light_shape, hrec.p);
-                mixture_pdf p(&plight, srec.pdf_ptr);
-                ray scattered = ray(hrec.p, p.generate(), r.time());
-                float pdf_val = p.value(scattered.direction());
-                delete srec.pdf_ptr;
-                return emitted
-                     + srec.attenuation * hrec.mat_ptr->scattering_pdf(r, hrec, scattered)
-                                        * color(scattered, world, light_shape, depth+1)
-                                        / pdf_val;
-            }
+    resolve_hit(r, q, hrec);
+    scatter_record srec;
+    vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.p);
+    if (depth < 50 && TIMED("scatter", hrec.mat_ptr->scatter(r, hrec, srec))) {
+        if (srec.is_specular) {
+            return srec.attenuation * color(srec.specular_ray, world, light_shape, depth+1);
+        }
+        else {
+            hittable_pdf plight(light_shape, hrec.p);
+            mixture_pdf p(&plight, srec.pdf_ptr);
+            ray scattered = ray(hrec.p, TIMED("pdf generate", p.generate()), r.time());
+            float pdf_val = TIMED("pdf value", p.value(scattered.direction()));
+            delete srec.pdf_ptr;
+            return emitted
+                 + srec.attenuation * hrec.mat_ptr->scattering_pdf(r, hrec, scattered)
+                                    * color(scattered, world, light_shape, depth+1)
+                                    / pdf_val;
         }
-        else
-            return emitted;
     }
-    else
+    else {
+        STAT_PATH(depth);
+        return emitted;
+    }
+}
+
+vec3 color(const ray& r, hittable *world, hittable *light_shape, int depth) {
+    STAT_INC(secondary_rays);
+    thread_path_counters().bounces++;
+    hit_query q;
+    if (TIMED("intersect", world->intersect(r, 0.001, MAXFLOAT, q)))
+        return color_hit(r, q, world, light_shape, depth);
+    else {
+        STAT_PATH(depth);
         return vec3(0,0,0);
+    }
+}
+
+/** Luz directa en el punto difuso hrec: se muestrea un punto en las luces, se comprueba con un rayo de sombra que no hay
+  * nada en medio y se pondera con MIS frente a la densidad de la BSDF.
+  * @param r Rayo que ha llegado a hrec.
+  * @param hrec Punto donde se estima la luz directa.
+  * @param srec Resultado de scatter en hrec, con la densidad de la BSDF.
+  * @param world Escena.
+  * @param lights Lista de emisores, con sus materiales.
+  * @return Contribución de la luz directa.
+  */
+vec3 direct_light(const ray& r, const hit_record& hrec, const scatter_record& srec, hittable *world, hittable *lights) {
+    light_sample ls;
+    if (!TIMED("light sample", sample_direct_light(r, hrec, srec, lights, ls)))
+        return vec3(0,0,0);
+    STAT_INC(shadow_rays);
+    thread_path_counters().shadows++;
+    if (TIMED("shadow", world->occluded(ls.shadow, 0.001, ls.t_max)))
+        return vec3(0,0,0);
+    return ls.contribution;
+}
+
+/** Integrador con estimación explícita de la luz directa (next event estimation). En cada vértice difuso se suma la luz
+  * directa con direct_light y el camino sigue con una muestra independiente de la BSDF. La emisión que encuentra esa
+  * muestra también la ha podido muestrear direct_light en el vértice anterior, así que se pondera con el peso MIS
+  * complementario para no contarla dos veces.
+  * @param r Rayo.
+  * @param world Escena.
+  * @param lights Lista de emisores, con sus materiales.
+  * @param depth Número de rebotes.
+  * @param prev_p Vértice anterior del camino.
+  * @param prev_pdf Densidad con la que la BSDF de prev_p generó r, o 0 si r sale de la cámara o de un rebote especular.
+  * @return Radiancia que llega por r.
+  */
+vec3 color_nee(const ray& r, hittable *world, hittable *lights, int depth, const vec3& prev_p, float prev_pdf);
+
+/// Igual que color_nee(), pero con la intersección más cercana q ya calculada.
+vec3 color_nee_hit(const ray& r, const hit_query& q, hittable *world, hittable *lights, int depth, const vec3& prev_p, float prev_pdf) {
+    hit_record hrec;
+    resolve_hit(r, q, hrec);
+    vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.p);
+    if (prev_pdf > 0 && emitted.squared_length() > 0)
+        emitted *= power_heuristic(prev_pdf, TIMED("pdf value", lights->pdf_value(prev_p, r.direction())));
+    scatter_record srec;
+    if (depth >= 50 || !TIMED("scatter", hrec.mat_ptr->scatter(r, hrec, srec))) {
+        STAT_PATH(depth);
+        return emitted;
+    }
+    if (srec.is_specular)
+        return emitted + srec.attenuation * color_nee(srec.specular_ray, world, lights, depth+1, hrec.p, 0);
+    vec3 direct = direct_light(r, hrec, srec, world, lights);
+    ray scattered(hrec.p, TIMED("pdf generate", srec.pdf_ptr->generate()), r.time());
+    float pdf_val = TIMED("pdf value", srec.pdf_ptr->value(scattered.direction()));
+    delete srec.pdf_ptr;
+    if (pdf_val <= 0) {
+        STAT_PATH(depth);
+        return emitted + direct;
+    }
+    return emitted + direct
+         + srec.attenuation * hrec.mat_ptr->scattering_pdf(r, hrec, scattered)
+                            * color_nee(scattered, world, lights, depth+1, hrec.p, pdf_val)
+                            / pdf_val;
+}
+
+vec3 color_nee(const ray& r, hittable *world, hittable *lights, int depth, const vec3& prev_p, float prev_pdf) {
+    STAT_INC(secondary_rays);
+    thread_path_counters().bounces++;
+    hit_query q;
+    if (!TIMED("intersect", world->intersect(r, 0.001, MAXFLOAT, q))) {
+        STAT_PATH(depth);
+        return vec3(0,0,0);
+    }
+    return color_nee_hit(r, q, world, lights, depth, prev_p, prev_pdf);
 }
 
 /** Función que crea una caja de cornell con una luz rectangular normal.
   * @param scene Vector de objetos donde se guardará la caja de cornell
   * @param cam Donde se devuelve la cámara que toma la imagen
   * @param aspect Relación de aspecto de la imagen
+  * @param lights Donde se devuelve la lista de emisores de la escena
   */
-void cornell_box(hittable **scene, camera **cam, float aspect) {
+void cornell_box(hittable **scene, camera **cam, float aspect, hittable **lights) {
     int i = 0;
     hittable **list = new hittable*[8];
     material *red = new lambertian( new constant_texture(vec3(0.65, 0.05, 0.05)) );
@@ -94,14 +200,17 @@ void cornell_box(hittable **scene, camera **cam, float aspect) {
     list[i++] = new flip_normals(new yz_rect(0, 555, 0, 555, 555, green));
     list[i++] = new yz_rect(0, 555, 0, 555, 0, red);
     list[i++] = new flip_normals(new xz_rect_sa(213, 343, 227, 332, 554, light));
+    hittable **emitters = new hittable*[1];
+    emitters[0] = list[i-1];
     list[i++] = new flip_normals(new xz_rect(0, 555, 0, 555, 555, white));
     list[i++] = new xz_rect(0, 555, 0, 555, 0, white);
     list[i++] = new flip_normals(new xy_rect(0, 555, 0, 555, 555, white));
     material *glass = new dielectric(1.5);
     list[i++] = new sphere(vec3(190, 90, 190),90 , glass);
-    list[i++] = new translate(new rotate_y(
-                    new box(vec3(0, 0, 0), vec3(165, 330, 165), white),  15), vec3(265,0,295));
+    list[i++] = new instance(new box(vec3(0, 0, 0), vec3(165, 330, 165), white),
+                    affine_transform::translation(vec3(265,0,295)) * affine_transform::rotation_y(15));
     *scene = new hittable_list(list,i);
+    *lights = new hittable_list(emitters, 1);
     vec3 lookfrom(278, 278, -800);
     vec3 lookat(278,278,0);
     float dist_to_focus = 10.0;
@@ -115,8 +224,9 @@ void cornell_box(hittable **scene, camera **cam, float aspect) {
   * @param scene Vector de objetos donde se guardará la caja de cornell
   * @param cam Donde se devuelve la cámara que toma la imagen
   * @param aspect Relación de aspecto de la imagen
+  * @param lights Donde se devuelve la lista de emisores de la escena
   */
-void cornell_box2(hittable **scene, camera **cam, float aspect) {
+void cornell_box2(hittable **scene, camera **cam, float aspect, hittable **lights) {
     int i = 0;
     hittable **list = new hittable*[7];
     material *red = new lambertian( new constant_texture(vec3(0.65, 0.05, 0.05)) );
@@ -133,14 +243,17 @@ void cornell_box2(hittable **scene, camera **cam, float aspect) {
     list[i++] = new yz_rect(p_left_down.y(), p_left_down.y()+y_ax, p_left_down.z(), p_left_down.z()+z_ax, p_left_down.x(), red);
     //list[i++] = new flip_normals(new xz_rect(213, 343, 227, 332, 554, light));
     list[i++] = new flip_normals(new xz_rect(100, 455, 100, 455, 554, light));
+    hittable **emitters = new hittable*[1];
+    emitters[0] = list[i-1];
     list[i++] = new xz_rect(p_left_down.x(), p_left_down.x()+x_ax, p_left_down.z(), p_left_down.z()+z_ax, p_left_down.y(), white);
     list[i++] = new flip_normals(new xy_rect(p_left_down.x(), p_left_down.x()+x_ax, p_left_down.y(), p_left_down.y()+y_ax, p_left_down.z()+z_ax, white));
     material *glass = new dielectric(1.5);
     list[i++] = new sphere(vec3(190, 90, 190),90 , glass);
-    list[i++] = new translate(new rotate_y(
-                    new box(vec3(0, 0, 0), vec3(165, 330, 165), white),  15), vec3(265,0,295));
+    list[i++] = new instance(new box(vec3(0, 0, 0), vec3(165, 330, 165), white),
+                    affine_transform::translation(vec3(265,0,295)) * affine_transform::rotation_y(15));
 
     *scene = new hittable_list(list,i);
+    *lights = new hittable_list(emitters, 1);
     vec3 lookfrom(278, 278, -800);
     vec3 lookat(278,278,0);
     float dist_to_focus = 10.0;
@@ -154,8 +267,9 @@ void cornell_box2(hittable **scene, camera **cam, float aspect) {
   * @param scene Vector de objetos donde se guardará la caja de cornell
   * @param cam Donde se devuelve la cámara que toma la imagen
   * @param aspect Relación de aspecto de la imagen
+  * @param lights Donde se devuelve la lista de emisores de la escena
   */
-void scene_mat(hittable **scene, camera **cam, float aspect) {
+void scene_mat(hittable **scene, camera **cam, float aspect, hittable **lights) {
     int i = 0;
     hittable **list = new hittable*[9];
     material *red = new lambertian( new constant_texture(vec3(0.65, 0.05, 0.05)) );
@@ -165,6 +279,8 @@ void scene_mat(hittable **scene, camera **cam, float aspect) {
     list[i++] = new flip_normals(new yz_rect(0, 555, 0, 555, 555, green));
     list[i++] = new yz_rect(0, 555, 0, 555, 0, red);
     list[i++] = new flip_normals(new xz_rect(213, 343, 227, 332, 554, light));
+    hittable **emitters = new hittable*[1];
+    emitters[0] = list[i-1];
     list[i++] = new flip_normals(new xz_rect(0, 555, 0, 555, 555, white));
     list[i++] = new xz_rect(0, 555, 0, 555, 0, white);
     list[i++] = new flip_normals(new xy_rect(0, 555, 0, 555, 555, white));
@@ -174,6 +290,7 @@ void scene_mat(hittable **scene, camera **cam, float aspect) {
     list[i++] = new sphere(vec3(305, 70, 165),70, green);
 
     *scene = new hittable_list(list,i);
+    *lights = new hittable_list(emitters, 1);
     vec3 lookfrom(278, 278, -800);
     vec3 lookat(278,278,0);
     float dist_to_focus = 10.0;
@@ -188,8 +305,9 @@ void scene_mat(hittable **scene, camera **cam, float aspect) {
   * @param scene Vector de objetos donde se guardará la caja de cornell
   * @param cam Donde se devuelve la cámara que toma la imagen
   * @param aspect Relación de aspecto de la imagen
+  * @param lights Donde se devuelve la lista de emisores de la escena
   */
-void cornell_box_ellipse(hittable **scene, camera **cam, float aspect) {
+void cornell_box_ellipse(hittable **scene, camera **cam, float aspect, hittable **lights) {
     int i = 0;
     hittable **list = new hittable*[8];
     material *red = new lambertian( new constant_texture(vec3(0.65, 0.05, 0.05)) );
@@ -199,14 +317,17 @@ void cornell_box_ellipse(hittable **scene, camera **cam, float aspect) {
     list[i++] = new flip_normals(new yz_rect(0, 555, 0, 555, 555, green));
     list[i++] = new yz_rect(0, 555, 0, 555, 0, red);
     list[i++] = new ellipse(vec3(278, 554, 280), vec3(70,0,0), vec3(0,0,70), light);
+    hittable **emitters = new hittable*[1];
+    emitters[0] = list[i-1];
     list[i++] = new flip_normals(new xz_rect(0, 555, 0, 555, 555, white));
     list[i++] = new xz_rect(0, 555, 0, 555, 0, white);
     list[i++] = new flip_normals(new xy_rect(0, 555, 0, 555, 555, white));
     material *glass = new dielectric(1.5);
     list[i++] = new sphere(vec3(190, 90, 190),90 , glass);
-    list[i++] = new translate(new rotate_y(
-                    new box(vec3(0, 0, 0), vec3(165, 330, 165), white),  15), vec3(265,0,295));
+    list[i++] = new instance(new box(vec3(0, 0, 0), vec3(165, 330, 165), white),
+                    affine_transform::translation(vec3(265,0,295)) * affine_transform::rotation_y(15));
     *scene = new hittable_list(list,i);
+    *lights = new hittable_list(emitters, 1);
     vec3 lookfrom(278, 278, -800);
     vec3 lookat(278,278,0);
     float dist_to_focus = 10.0;
@@ -216,7 +337,296 @@ void cornell_box_ellipse(hittable **scene, camera **cam, float aspect) {
                       vfov, aspect, aperture, dist_to_focus, 0.0, 1.0);
 }
 
-int main() {
+/** Función que crea una caja de cornell con una luz de elipse y una malla de triángulos leída de un fichero OBJ o PLY
+  * en lugar de la caja. La primera vez se guarda una caché binaria junto al fichero, y las siguientes se usa esa caché.
+  * @param scene Vector de objetos donde se guardará la caja de cornell
+  * @param cam Donde se devuelve la cámara que toma la imagen
+  * @param aspect Relación de aspecto de la imagen
+  * @param lights Donde se devuelve la lista de emisores de la escena
+  * @param path Ruta del fichero de la malla
+  */
+void cornell_box_mesh(hittable **scene, camera **cam, float aspect, hittable **lights, const char *path) {
+    cornell_box_ellipse(scene, cam, aspect, lights);
+    material *white = new lambertian( new constant_texture(vec3(0.73, 0.73, 0.73)) );
+    std::string cache = std::string(path) + ".cache";
+    triangle_mesh *mesh = TIMED("mesh load", load_cached_mesh(path, cache.c_str(), load_mesh, white));
+    aabb box;
+    if (!mesh || !mesh->bounding_box(0, 1, box)) {
+        cerr << "could not load mesh " << path << ", rendering the box instead\n";
+        return;
+    }
+    // La malla se escala para que ocupe la altura de la caja y se apoya en el suelo en su misma posición.
+    vec3 size = box.max() - box.min();
+    float scale = 330 / ffmax(size.x(), ffmax(size.y(), size.z()));
+    vec3 base = 0.5*(box.min() + box.max());
+    base[1] = box.min().y();
+    hittable_list *list = (hittable_list *) *scene;
+    list->list[list->list_size-1] = new instance(mesh,
+                    affine_transform::translation(vec3(265,0,295)) * affine_transform::rotation_y(15)
+                  * affine_transform::translation(vec3(82.5,0,82.5)) * affine_transform::scaling(vec3(scale, scale, scale)) * affine_transform::translation(-base));
+}
+
+/** Sampler de nombre dado (random, stratified, sobol o halton) para una imagen de nx x ny con ns muestras por píxel; con
+  * blue_noise, repartido además en ruido azul. 0 para random y para los nombres que no existen: se usa random_double().
+  */
+sampler *make_sampler(const string& name, bool blue_noise, int nx, int ny, int ns) {
+    sampler *s = 0;
+    if (name == "stratified")
+        s = new stratified_sampler(ns);
+    else if (name == "sobol")
+        s = new sobol_sampler();
+    else if (name == "halton")
+        s = new halton_sampler();
+    // El ruido azul reparte una secuencia común que estratifique los bloques consecutivos: Sobol salvo que se pida Halton.
+    if (blue_noise)
+        s = new blue_noise_sampler(name == "halton" ? s : new sobol_sampler(), nx, ny, ns);
+    return s;
+}
+
+/// Lo que usa render_tile(): la escena, la imagen y lo que se lleva por píxel; variance, features y heat pueden ser 0.
+struct tile_target {
+    hittable *world, *lights, *light_shape;
+    camera *cam;
+    int nx, ny;
+    bool nee;
+    int *samples;
+    pixel_variance *variance;
+    feature_buffers *features;
+    pixel_heatmap *heat;
+};
+
+/// Los rayos primarios se trazan por paquetes, uno por muestra de cada bloque de packet_w x packet_h píxeles.
+const int packet_w = 4, packet_h = 4;
+
+/** Toma count muestras de cada píxel del bloque cuya esquina superior izquierda es (i0, j0), con j0 contando desde
+  * abajo, y las acumula en tile, que tiene que cubrir el bloque y el margen del filtro.
+  */
+void render_tile(const tile_target& target, int i0, int j0, int count, film_buffer& tile) {
+    hittable *world = target.world, *lights = target.lights, *light_shape = target.light_shape;
+    camera *cam = target.cam;
+    int nx = target.nx, ny = target.ny;
+    bool nee = target.nee;
+    int *samples = target.samples;
+    pixel_variance *variance = target.variance;
+    feature_buffers *features = target.features;
+    pixel_heatmap *heat = target.heat;
+    int px[ray_packet_max], py[ray_packet_max];
+    int n = 0;
+    for (int j = j0; j > j0 - packet_h && j >= 0; j--)
+        for (int i = i0; i < i0 + packet_w && i < nx; i++) {
+            px[n] = i;
+            py[n] = j;
+            n++;
+        }
+    for (int s=0; s < count; s++) {
+        float u[ray_packet_max], v[ray_packet_max], fx[ray_packet_max], fy[ray_packet_max];
+        sample_state states[ray_packet_max];
+        for (int k = 0; k < n; k++) {
+            int pixel = (ny-1-py[k])*nx + px[k];
+            start_sample(states[k], pixel, samples[pixel]);
+            use_sample_state(&states[k]);
+            float du, dv;
+            sample_2d(stream_pixel, du, dv);
+            u[k] = float(px[k]+du)/ float(nx);
+            v[k] = float(py[k]+dv)/ float(ny);
+            // Posición dentro del píxel, con la vertical de arriba abajo como las filas de la imagen.
+            fx[k] = du;
+            fy[k] = 1 - dv;
+        }
+        std::chrono::steady_clock::time_point t0;
+        if (heat)
+            t0 = std::chrono::steady_clock::now();
+        ray_packet p;
+        TIMED("camera rays", cam->get_rays(u, v, n, p, states));
+        bool hit[ray_packet_max];
+        hit_query q[ray_packet_max];
+        TIMED("intersect", world->intersect_packet(p, 0.001, hit, q));
+        STAT_ADD(primary_rays, n);
+        // El coste del paquete de rayos primarios se reparte a partes iguales entre sus píxeles.
+        double packet_share = 0;
+        if (heat) {
+            std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+            packet_share = std::chrono::duration<double>(t1 - t0).count() / n;
+            t0 = t1;
+        }
+        for (int k = 0; k < n; k++) {
+            int pixel = (ny-1-py[k])*nx + px[k];
+            path_counters& counters = thread_path_counters();
+            counters.bounces = counters.shadows = 0;
+            use_sample_state(&states[k]);
+            vec3 col(0, 0, 0);
+            if (!hit[k])
+                STAT_PATH(0);
+            else {
+                ray r = p.get(k);
+                if (features) {
+                    hit_record rec;
+                    resolve_hit(r, q[k], rec);
+                    features->add(pixel, r, rec);
+                }
+                if (nee)
+                    col = de_nan(color_nee_hit(r, q[k], world, lights, 0, r.origin(), 0));
+                else
+                    col = de_nan(color_hit(r, q[k], world, light_shape, 0));
+            }
+            tile.add_sample(px[k], ny-1-py[k], fx[k], fy[k], col);
+            samples[pixel]++;
+            if (variance)
+                variance->add(pixel, col);
+            if (heat) {
+                std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+                heat->add(pixel, packet_share + std::chrono::duration<double>(t1 - t0).count(), counters);
+                t0 = t1;
+            }
+        }
+    }
+    use_sample_state(0);
+}
+
+/** Construye la escena: la caja de Cornell con la luz de elipse, con la malla de mesh_path en lugar de la caja si no es
+  * 0, aplanada con su BVH.
+  * @param cam Donde se devuelve la cámara de la escena para la relación de aspecto aspect.
+  */
+render_scene build_scene(const char *mesh_path, float aspect, camera **cam) {
+    TRACE_SCOPE("scene");
+    render_scene scene;
+    // El mundo, se utiliza la función dependiendo de qué luz se quiera usar.
+    if (mesh_path)
+        cornell_box_mesh(&scene.world, cam, aspect, &scene.lights, mesh_path);
+    else
+        cornell_box_ellipse(&scene.world, cam, aspect, &scene.lights);
+    // Para renderizar, la escena se aplana en vectores de primitivas agrupadas por tipo con su propio BVH.
+    scene.world = TIMED("bvh build", new flat_scene(scene.world));
+
+    // La luz se define en light_shape, se descomenta la que se quiera usar. Tiene que coincidir con la que se usa en el mundo.
+
+    hittable *light_shape = new ellipse(vec3(278, 554, 280), vec3(70,0,0), vec3(0,0,70), 0);
+    //hittable *light_shape = new xz_rect_sa(213, 343, 227, 332, 554, 0);
+    //hittable *light_shape = new xz_rect(100, 455, 100, 455, 554, 0);
+
+    hittable *glass_sphere = new sphere(vec3(190, 90, 190),90 , 0);
+    hittable **a = new hittable*[2];
+    a[0] = light_shape;
+    a[1] = glass_sphere;
+    scene.light_shape = new hittable_list(a,2);
+    return scene;
+}
+
+/** Toma count muestras de cada píxel de la imagen de target y las suma a image. Las filas de bloques se reparten entre
+  * threads hilos, cada una con su semilla, que depende también de seed, y se suman en orden: la imagen no depende de
+  * cuántos hilos haya.
+  * @param s Sampler de todos los hilos (0 para random_double()); los samplers no guardan estado, así que se comparte.
+  * @param interrupted Si no es nula, el hilo que llama la consulta entre fila y fila; si devuelve cierto, la pasada se
+  * deja a medias y no se suma nada.
+  * @return Falso si la pasada se ha interrumpido.
+  */
+bool render_pass(const tile_target& target, film& image, int count, int threads, uint32_t seed, sampler *s,
+                 const std::function<bool()>& interrupted = std::function<bool()>()) {
+    int rows = (target.ny + packet_h - 1) / packet_h;
+    vector<film_buffer> bands;
+    for (int row = 0; row < rows; row++)
+        bands.push_back(image.tile(0, row*packet_h, target.nx, std::min(target.ny, (row+1)*packet_h)));
+    std::atomic<int> next(0);
+    std::atomic<bool> stop(false);
+    auto work = [&](bool caller) {
+        sampler *previous = current_sampling().s;
+        current_sampling().s = s;
+        for (int row; !stop && (row = next++) < rows; ) {
+            if (caller && interrupted && interrupted()) {
+                stop = true;
+                break;
+            }
+            random_state() = uint64_t(hash_u32(row ^ seed)) << 32 | hash_u32(row ^ 0x5bd1e995 ^ hash_u32(seed));
+            for (int i0 = 0; i0 < target.nx; i0 += packet_w)
+                render_tile(target, i0, target.ny-1 - row*packet_h, count, bands[row]);
+        }
+        current_sampling().s = previous;
+    };
+    vector<std::thread> pool;
+    for (int t = 1; t < std::min(threads, rows); t++)
+        pool.push_back(std::thread(work, false));
+    work(true);
+    for (size_t t = 0; t < pool.size(); t++)
+        pool[t].join();
+    if (stop)
+        return false;
+    for (int row = 0; row < rows; row++)
+        image.accumulate(bands[row]);
+    return true;
+}
+
+#ifndef _MSC_VER
+/** Vista previa interactiva de la escena: pasadas de una muestra por píxel que se acumulan y se escriben en image_path
+  * tras cada una, hasta max_passes. Por control_path (si no es 0) llegan cambios de cámara, que interrumpen la pasada en
+  * curso y empiezan de nuevo la acumulación, y "quit" para acabar. Después de cada cambio va primero una pasada a un
+  * cuarto de resolución en cada eje, que cuesta la dieciseisava parte y da una imagen casi en seguida.
+  */
+int render_interactive(const render_scene& scene, int nx, int ny, bool nee, const pixel_filter *filter, sampler *s,
+                       int threads, int max_passes, const char *image_path, const char *control_path) {
+    mapped_image view;
+    if (!view.open(image_path, nx, ny)) {
+        cerr << "could not map " << image_path << endl;
+        return 1;
+    }
+    control_pipe control;
+    if (control_path && !control.open(control_path)) {
+        cerr << "could not open control pipe " << control_path << endl;
+        return 1;
+    }
+    render_request r = default_request();
+    film image_film(filter, nx, ny);
+    vector<int> samples(nx*ny);
+    camera *cam = 0;
+    int passes = 0;
+    bool reset = true;
+    for (;;) {
+        // Sin nada que refinar se espera a la siguiente orden en lugar de dar vueltas.
+        vector<string> lines = control.read_lines(passes >= max_passes ? -1 : 0);
+        for (size_t k = 0; k < lines.size(); k++) {
+            string error;
+            if (lines[k] == "quit")
+                return 0;
+            if (parse_camera_command(lines[k], r, error))
+                reset = true;
+            else if (!error.empty())
+                cerr << error << endl;
+        }
+        if (passes >= max_passes && !reset) {
+            if (!control_path)
+                return 0;
+            continue;
+        }
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        if (reset) {
+            delete cam;
+            cam = new camera(r.lookfrom, r.lookat, vec3(0,1,0), r.vfov, float(ny) / float(nx), 0, 10, 0, 1);
+            film_pixel zero = {0, 0, 0, 0};
+            std::fill(image_film.pixels.begin(), image_film.pixels.end(), zero);
+            std::fill(samples.begin(), samples.end(), 0);
+            passes = 0;
+            int px = (nx + 3) / 4, py = (ny + 3) / 4;
+            box_filter box;
+            film preview(&box, px, py);
+            vector<int> preview_samples(px*py, 0);
+            tile_target target = {scene.world, scene.lights, scene.light_shape, cam, px, py, nee, preview_samples.data(), 0, 0, 0};
+            render_pass(target, preview, 1, threads, 0, s);
+            view.write(preview.resolve(), px, py, 0);
+            cerr << "preview " << std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() * 1000 << " ms" << endl;
+            reset = false;
+            continue;
+        }
+        // Una pasada completa tarda bastante más que la vista previa, así que se deja a medias si llega una orden.
+        vector<int> samples_before = samples;
+        tile_target target = {scene.world, scene.lights, scene.light_shape, cam, nx, ny, nee, samples.data(), 0, 0, 0};
+        if (render_pass(target, image_film, 1, threads, passes + 1, s, [&control]() { return control.ready(); }))
+            view.write(image_film.resolve(), nx, ny, ++passes);
+        else
+            samples.swap(samples_before);
+    }
+}
+#endif
+
+int main(int argc, char **argv) {
   // Al main se le han añadido las luces nuevas, en la definición de light_shape, y en lugar de llamar a la función cornell_box se llama a la correspondiente según qué luz queramos. La mayoría del código del main se ha dejado intacto.
 
   // Hay también comentarios referentes a las órdenes necesarias para crear los batches de imágenes usados para los experimentos. En lugar de imprimir por pantalla el ppm, se imprimía directamente en los ficheros necesarios.
@@ -230,52 +640,343 @@ int main() {
     int nx = 500;
     int ny = 500;
     int ns = 10;
-    cout << "P3\n" << nx << " " << ny << "\n255\n";
-    hittable *world;
+    // Opciones: -nee usa el integrador con estimación explícita de la luz directa, -wavefront lanza los caminos por lotes
+    // en etapas en lugar de uno a uno, -bin (con -wavefront) agrupa los rayos secundarios por dirección y origen antes de
+    // trazarlos, -timers escribe al final el desglose de tiempos por fases, -trace fichero guarda la traza de las fases
+    // gruesas, -heatmap nombre guarda los mapas de coste por píxel, -adaptive error sigue tomando muestras en los píxeles
+    // cuyo error relativo estimado supere el dado, -budget segundos limita el tiempo de ese muestreo adaptativo, y un
+    // -sampler random|stratified|sobol|halton elige cómo se reparten las muestras de cada píxel, -bluenoise reparte además
+    // el error entre píxeles vecinos en ruido azul, -denoise filtra el resultado guiándose por el color base, la normal y
+    // la profundidad del primer impacto, -filter box|tent|gaussian|mitchell elige el filtro de reconstrucción con el que
+    // cada muestra se reparte entre los píxeles cercanos, -checkpoint fichero guarda lo acumulado cada
+    // -checkpoint_interval segundos (300 por defecto), -resume fichero sigue un render desde su checkpoint, -workers n
+    // reparte las filas de bloques entre n procesos, -daemon socket se queda atendiendo trabajos de render por ese socket
+    // Unix con -threads hilos (uno por núcleo por defecto), -interactive fichero va refinando la imagen por pasadas de una
+    // muestra y la escribe en ese fichero proyectado en memoria tras cada una, con la cámara que llegue por la tubería
+    // -control, y un fichero OBJ o PLY se pone en lugar de la caja.
+    bool nee = false, wavefront = false, bins = false, timers = false, blue_noise = false, denoise = false;
+    float adaptive_target = 0, adaptive_budget = 0, checkpoint_interval = 300;
+    int workers = 0, threads = std::max(1u, std::thread::hardware_concurrency());
+    const char *daemon_path = 0, *interactive_path = 0, *control_path = 0, *mesh_path = 0, *trace_path = 0, *heatmap_path = 0, *checkpoint_path = 0, *resume_path = 0;
+    string sampler_name = "random", filter_name = "box";
+    for (int k = 1; k < argc; k++) {
+        if (string(argv[k]) == "-nee")
+            nee = true;
+        else if (string(argv[k]) == "-wavefront")
+            wavefront = true;
+        else if (string(argv[k]) == "-bin")
+            wavefront = bins = true;
+        else if (string(argv[k]) == "-timers")
+            timers = true;
+        else if (string(argv[k]) == "-trace" && k+1 < argc)
+            trace_path = argv[++k];
+        else if (string(argv[k]) == "-adaptive" && k+1 < argc)
+            adaptive_target = atof(argv[++k]);
+        else if (string(argv[k]) == "-budget" && k+1 < argc)
+            adaptive_budget = atof(argv[++k]);
+        else if (string(argv[k]) == "-bluenoise")
+            blue_noise = true;
+        else if (string(argv[k]) == "-denoise")
+            denoise = true;
+        else if (string(argv[k]) == "-filter" && k+1 < argc)
+            filter_name = argv[++k];
+        else if (string(argv[k]) == "-sampler" && k+1 < argc)
+            sampler_name = argv[++k];
+        else if (string(argv[k]) == "-heatmap" && k+1 < argc)
+            heatmap_path = argv[++k];
+        else if (string(argv[k]) == "-checkpoint" && k+1 < argc)
+            checkpoint_path = argv[++k];
+        else if (string(argv[k]) == "-checkpoint_interval" && k+1 < argc)
+            checkpoint_interval = atof(argv[++k]);
+        else if (string(argv[k]) == "-resume" && k+1 < argc)
+            resume_path = argv[++k];
+        else if (string(argv[k]) == "-workers" && k+1 < argc)
+            workers = atoi(argv[++k]);
+        else if (string(argv[k]) == "-daemon" && k+1 < argc)
+            daemon_path = argv[++k];
+        else if (string(argv[k]) == "-threads" && k+1 < argc)
+            threads = atoi(argv[++k]);
+        else if (string(argv[k]) == "-interactive" && k+1 < argc)
+            interactive_path = argv[++k];
+        else if (string(argv[k]) == "-control" && k+1 < argc)
+            control_path = argv[++k];
+        else if (argv[k][0] == '-') {
+            // Una opción mal escrita no se toma por el fichero de la malla; las que llevan valor llegan aquí sin él.
+            cerr << "unknown option or missing value: " << argv[k] << endl;
+            return 1;
+        }
+        else
+            mesh_path = argv[k];
+    }
+    current_sampling().s = make_sampler(sampler_name, blue_noise, nx, ny, ns);
+    if (sampler_name != "random" && sampler_name != "stratified" && sampler_name != "sobol" && sampler_name != "halton")
+        cerr << "unknown sampler " << sampler_name << ", using random\n";
+    pixel_filter *filter = make_filter(filter_name);
+    if (!filter) {
+        cerr << "unknown filter " << filter_name << ", using box\n";
+        filter = new box_filter();
+    }
+#ifdef RENDER_TIMERS
+    timers_registry::get().tracing = trace_path != 0;
+#else
+    if (timers || trace_path)
+        cerr << "-timers y -trace necesitan compilar con -DRENDER_TIMERS\n";
+#endif
+    if (daemon_path) {
+#ifdef _MSC_VER
+        cerr << "-daemon no está disponible en Windows\n";
+        return 1;
+#else
+        // Cada escena se construye una vez, la primera que se pide; la cámara de cada trabajo la pone el servicio.
+        auto build = [](const string& name) {
+            camera *unused;
+            render_scene scene = build_scene(name == "cornell" ? 0 : name.c_str(), 1, &unused);
+            delete unused;
+            return scene;
+        };
+        // Los samplers de -sampler y -bluenoise dependen del tamaño de la imagen y de las muestras por píxel, así que hay
+        // uno por cada combinación que se pida. No guardan estado y se comparten entre los hilos del servicio.
+        std::map<string, sampler *> samplers;
+        std::mutex samplers_mutex;
+        // Las franjas son filas de bloques, con su propia semilla como en -workers.
+        auto render_band = [&](const render_scene& scene, const render_request& r, camera *cam, int band, int *samples,
+                               film_buffer& out) {
+            {
+                std::lock_guard<std::mutex> lock(samplers_mutex);
+                string key = to_string(r.width) + "x" + to_string(r.height) + " " + to_string(r.spp);
+                if (!samplers.count(key))
+                    samplers[key] = make_sampler(sampler_name, blue_noise, r.width, r.height, r.spp);
+                current_sampling().s = samplers[key];
+            }
+            tile_target target = {scene.world, scene.lights, scene.light_shape, cam, r.width, r.height, r.nee, samples, 0, 0, 0};
+            random_state() = uint64_t(hash_u32(band)) << 32 | hash_u32(band ^ 0x5bd1e995);
+            for (int i0 = 0; i0 < r.width; i0 += packet_w)
+                render_tile(target, i0, r.height-1 - band*packet_h, r.spp, out);
+        };
+        render_service service(build, render_band, packet_h, threads);
+        if (!service.serve(daemon_path)) {
+            cerr << "could not listen on " << daemon_path << endl;
+            return 1;
+        }
+        return 0;
+#endif
+    }
     camera *cam;
     float aspect = float(ny) / float(nx);
+    render_scene scene = build_scene(mesh_path, aspect, &cam);
+    if (interactive_path) {
+#ifdef _MSC_VER
+        cerr << "-interactive no está disponible en Windows\n";
+        return 1;
+#else
+        // Tantas pasadas como muestras pediría el render normal con el tope del muestreo adaptativo.
+        return render_interactive(scene, nx, ny, nee, filter, current_sampling().s, threads, ns * adaptive_max_factor, interactive_path, control_path);
+#endif
+    }
+    hittable *world = scene.world, *lights = scene.lights;
 
-    // El mundo, se utiliza la función dependiendo de qué luz se quiera usar.
-    cornell_box_ellipse(&world, &cam, aspect);
-
-    // La luz se define en light_shape, se descomenta la que se quiera usar. Tiene que coincidir con la que se usa en el mundo.
-
-    hittable *light_shape = new ellipse(vec3(278, 554, 280), vec3(70,0,0), vec3(0,0,70), 0);
-    //hittable *light_shape = new xz_rect_sa(213, 343, 227, 332, 554, 0);
-    //hittable *light_shape = new xz_rect(100, 455, 100, 455, 554, 0);
-
-    hittable *glass_sphere = new sphere(vec3(190, 90, 190),90 , 0);
-    hittable *a[2];
-    a[0] = light_shape;
-    a[1] = glass_sphere;
-    hittable_list hlist(a,2);
 
-    for (int j = ny-1; j >= 0; j--) {
-        for (int i = 0; i < nx; i++) {
-            vec3 col(0, 0, 0);
-            for (int s=0; s < ns; s++) {
-                float u = float(i+random_double())/ float(nx);
-                float v = float(j+random_double())/ float(ny);
-                ray r = cam->get_ray(u, v);
-                vec3 p = r.point_at_parameter(2.0);
-                col += de_nan(color(r, world, &hlist, 0));
+    // Suma de las muestras de cada píxel, repartidas con el filtro de reconstrucción.
+    film image_film(filter, nx, ny);
+    // Número de muestras de cada píxel, que con el muestreo adaptativo no es el mismo para todos.
+    vector<int> samples(nx*ny, 0);
+    // La varianza de cada píxel la usan el muestreo adaptativo y el filtro de ruido.
+    pixel_variance *variance = 0;
+    if (adaptive_target > 0 && wavefront) {
+        cerr << "-adaptive no está disponible con -wavefront\n";
+        adaptive_target = 0;
+    }
+    if (adaptive_target > 0 || denoise)
+        variance = new pixel_variance(nx*ny);
+    feature_buffers *features = denoise ? new feature_buffers(nx*ny) : 0;
+    // Estado del render por paquetes para los checkpoints: lo acumulado, el generador aleatorio (los samplers dependen sólo
+    // del número de muestra, que sale de samples) y el progreso, en filas de bloques de la primera pasada y en pasadas
+    // adaptativas completas.
+    struct { int32_t rows, passes; } progress = {0, 0};
+    if ((checkpoint_path || resume_path) && wavefront) {
+        cerr << "-checkpoint y -resume no están disponibles con -wavefront\n";
+        checkpoint_path = resume_path = 0;
+    }
+    if (resume_path && !checkpoint_path)
+        checkpoint_path = resume_path;
+#ifdef _MSC_VER
+    if (workers > 0) {
+        cerr << "-workers no está disponible en Windows\n";
+        workers = 0;
+    }
+#endif
+    // Los procesos sólo devuelven su trozo de película, así que no se combinan con lo que necesita el resto de cosas que
+    // se acumulan por píxel.
+    if (workers > 0 && (wavefront || adaptive_target > 0 || denoise || heatmap_path || checkpoint_path)) {
+        cerr << "-workers no está disponible con -wavefront, -adaptive, -denoise, -heatmap ni -checkpoint\n";
+        workers = 0;
+    }
+    string config = to_string(nx) + "x" + to_string(ny) + " ns " + to_string(ns) + (nee ? " nee" : "") +
+                    " sampler " + sampler_name + (blue_noise ? " bluenoise" : "") + " filter " + filter_name +
+                    (denoise ? " denoise" : "") + " adaptive " + to_string(adaptive_target) +
+                    " scene " + (mesh_path ? mesh_path : "cornell");
+    checkpoint state(config);
+    state.add(image_film);
+    state.add(samples);
+    if (variance)
+        state.add(*variance);
+    if (features)
+        state.add(*features);
+    state.add(&random_state(), sizeof(random_state()));
+    state.add(&progress, sizeof(progress));
+    if (resume_path) {
+        string error;
+        if (!state.load(resume_path, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+        cerr << "resuming at tile row " << progress.rows << ", adaptive pass " << progress.passes << endl;
+    }
+    std::chrono::steady_clock::time_point last_checkpoint = std::chrono::steady_clock::now();
+    // Guarda un checkpoint si ha pasado el intervalo desde el anterior.
+    auto save_checkpoint = [&]() {
+        if (!checkpoint_path || std::chrono::duration<double>(std::chrono::steady_clock::now() - last_checkpoint).count() < checkpoint_interval)
+            return;
+        TRACE_SCOPE("checkpoint");
+        if (!state.save(checkpoint_path))
+            cerr << "could not write checkpoint " << checkpoint_path << endl;
+        last_checkpoint = std::chrono::steady_clock::now();
+    };
+    // Los mapas de coste sólo se llevan en el integrador por paquetes: en el wavefront cada etapa procesa a la vez
+    // caminos de muchos píxeles y el tiempo no se puede repartir entre ellos.
+    pixel_heatmap *heat = 0;
+    if (heatmap_path && wavefront)
+        cerr << "-heatmap no está disponible con -wavefront\n";
+    else if (heatmap_path)
+        heat = new pixel_heatmap(nx, ny);
+    if (wavefront) {
+        TRACE_SCOPE("render");
+        wavefront_integrator integrator(world, lights, scene.light_shape, nee, bins);
+        integrator.features = features;
+        integrator.variance = variance;
+        integrator.render(cam, nx, ny, ns, image_film);
+        std::fill(samples.begin(), samples.end(), ns);
+        cerr << "intersect " << integrator.intersect_seconds << " s, cache misses ";
+        if (integrator.intersect_misses.available())
+            cerr << integrator.intersect_misses.value() << endl;
+        else
+            cerr << "not available" << endl;
+    }
+    else {
+        TRACE_SCOPE("render");
+        tile_target target = {world, lights, scene.light_shape, cam, nx, ny, nee, samples.data(), variance, features, heat};
+        // Las muestras de cada bloque se acumulan aparte, en un buffer que cubre también los píxeles vecinos a los que llega el
+        // filtro, y se suman a la película al acabar.
+        // En los procesos de -workers las muestras van al buffer del trabajo en lugar de a la película.
+        film_buffer *job_film = 0;
+        auto trace_tile = [&](int i0, int j0, int count) {
+            film_buffer tile = image_film.tile(i0, ny-1-j0, std::min(i0 + packet_w, nx), std::min(ny-1-j0 + packet_h, ny));
+            render_tile(target, i0, j0, count, tile);
+            if (job_film)
+                job_film->accumulate(tile);
+            else
+                image_film.merge(tile);
+        };
+        if (workers > 0) {
+            // Cada trabajo es una fila de bloques, con su propia semilla para random_double(): así da igual qué proceso
+            // la haga y en qué orden.
+            auto render_row = [&](int row) {
+                film_buffer b = image_film.tile(0, row*packet_h, nx, std::min(ny, (row+1)*packet_h));
+                job_film = &b;
+                random_state() = uint64_t(hash_u32(row)) << 32 | hash_u32(row ^ 0x5bd1e995);
+                for (int i0 = 0; i0 < nx; i0 += packet_w)
+                    trace_tile(i0, ny-1 - row*packet_h, ns);
+                job_film = 0;
+                return b;
+            };
+            if (!render_distributed(workers, (ny + packet_h - 1) / packet_h, render_row, image_film)) {
+                cerr << "distributed render failed" << endl;
+                return 1;
+            }
+            std::fill(samples.begin(), samples.end(), ns);
+        }
+        int row = 0;
+        for (int j0 = ny-1; j0 >= 0 && workers == 0; j0 -= packet_h, row++) {
+            if (row < progress.rows)
+                continue;
+            TRACE_SCOPE("tile row");
+            for (int i0 = 0; i0 < nx; i0 += packet_w)
+                trace_tile(i0, j0, ns);
+            progress.rows = row + 1;
+            save_checkpoint();
+        }
+        // Muestreo adaptativo: tras las ns muestras de todos los píxeles, se toman tandas de ns más sólo en los bloques con
+        // algún píxel por encima del error objetivo, hasta que no quede ninguno, se acabe el tiempo o se llegue al tope.
+        if (adaptive_target > 0) {
+            TRACE_SCOPE("adaptive");
+            int passes = progress.passes;
+            bool out_of_time = false;
+            while (!out_of_time && passes + 1 < adaptive_max_factor) {
+                vector<pair<int, int> > tiles;
+                for (int j0 = ny-1; j0 >= 0; j0 -= packet_h)
+                    for (int i0 = 0; i0 < nx; i0 += packet_w) {
+                        bool noisy = false;
+                        for (int j = j0; j > j0 - packet_h && j >= 0 && !noisy; j--)
+                            for (int i = i0; i < i0 + packet_w && i < nx && !noisy; i++)
+                                noisy = variance->relative_error((ny-1-j)*nx + i) > adaptive_target;
+                        if (noisy)
+                            tiles.push_back(make_pair(i0, j0));
+                    }
+                if (tiles.empty())
+                    break;
+                passes++;
+                for (size_t t = 0; t < tiles.size() && !out_of_time; t++) {
+                    trace_tile(tiles[t].first, tiles[t].second, ns);
+                    out_of_time = adaptive_budget > 0 && std::chrono::duration<double>(
+                                      std::chrono::high_resolution_clock::now() - t1).count() > adaptive_budget;
+                }
+                cerr << "adaptive pass " << passes << ": " << tiles.size() << " tiles" << endl;
+                if (!out_of_time) {
+                    progress.passes = passes;
+                    save_checkpoint();
+                }
             }
-            col /= float(ns);
-            col = vec3( sqrt(col[0]), sqrt(col[1]), sqrt(col[2]) );
-            int ir = int(255.99*col[0]);
-            int ig = int(255.99*col[1]);
-            int ib = int(255.99*col[2]);
-            ir = clip(ir, 0, 255);
-            ig = clip(ig, 0, 255);
-            ib = clip(ib, 0, 255);
-
-            cout << ir << " " << ig << " " << ib << "\n";
+            long total = 0;
+            for (int k = 0; k < nx*ny; k++)
+                total += samples[k];
+            cerr << "adaptive: " << double(total) / (nx*ny) << " samples per pixel" << (out_of_time ? ", out of time" : "") << endl;
         }
     }
+
+    vector<vec3> image = image_film.resolve();
+    if (features) {
+        TRACE_SCOPE("denoise");
+        auto d0 = std::chrono::steady_clock::now();
+        vector<float> mean_variance(nx*ny);
+        for (int k = 0; k < nx*ny; k++)
+            mean_variance[k] = variance->mean_variance(k);
+        atrous_denoiser(nx, ny, *features, samples).run(image, mean_variance);
+        cerr << "denoise " << std::chrono::duration<double>(std::chrono::steady_clock::now() - d0).count() << " s" << endl;
+    }
+
+    {
+        TRACE_SCOPE("output");
+        write_ppm(cout, image, nx, ny);
+    }
     auto t2 = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count();
 
     cerr << ns << " " << duration << endl;
+#ifdef RENDER_STATS
+    // Compilado con -DRENDER_STATS, los contadores se guardan en stats.json.
+    ofstream stats_file("stats.json");
+    write_stats_json(stats_file, duration * 1e-6);
+#endif
+    if (heat && !heat->write(heatmap_path))
+        cerr << "could not write heatmap " << heatmap_path << endl;
+#ifdef RENDER_TIMERS
+    if (timers)
+        write_timer_report(cerr);
+    if (trace_path) {
+        ofstream trace_file(trace_path);
+        write_chrome_trace(trace_file);
+    }
+#endif
     //f.close();
   //}
   //f_c.close();
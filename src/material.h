@@ -62,6 +62,10 @@ class material  {
         virtual vec3 emitted(const ray& r_in, const hit_record& rec, float u, float v, const vec3& p) const {
             return vec3(0,0,0);
         }
+        /// Color base de la superficie en el punto, para guiar el filtro de ruido. Blanco si no tiene.
+        virtual vec3 base_color(const hit_record& rec) const {
+            return vec3(1,1,1);
+        }
 };
 
 class dielectric : public material {
@@ -93,7 +97,7 @@ class dielectric : public material {
              else {
                 reflect_prob = 1.0;
              }
-             if (random_double() < reflect_prob) {
+             if (sample_1d(stream_bsdf) < reflect_prob) {
                 srec.specular_ray = ray(hrec.p, reflected);
              }
              else {
@@ -117,6 +121,7 @@ class metal : public material {
             srec.pdf_ptr = 0;
             return true;
         }
+        virtual vec3 base_color(const hit_record& rec) const { return albedo; }
         vec3 albedo;
         float fuzz;
 };
@@ -138,6 +143,7 @@ class lambertian : public material {
             srec.pdf_ptr = new cosine_pdf(hrec.normal);
             return true;
         }
+        virtual vec3 base_color(const hit_record& rec) const { return albedo->value(rec.u, rec.v, rec.p); }
         texture *albedo;
 };
 
@@ -0,0 +1,264 @@
+#ifndef MESHCACHEH
+#define MESHCACHEH
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "triangle_mesh.h"
+
+/** Formato binario de caché de mallas. El fichero se proyecta en memoria con mmap y los buffers se usan tal cual,
+  * sin deserializar: la cabecera guarda el desplazamiento de cada buffer, alineado a 64 bytes.
+  * Sirve para construir una vez (parsear y construir el BVH) y renderizar muchas veces.
+  */
+const char mesh_cache_magic[8] = {'T', 'F', 'G', 'M', 'E', 'S', 'H', 0};
+/// Versión del formato. Hay que incrementarla si cambia la cabecera o la estructura mesh_bvh_node.
+const uint32_t mesh_cache_version = 2;
+/// Marca para detectar ficheros escritos en una máquina con otro orden de bytes.
+const uint32_t mesh_cache_byte_order = 0x01020304;
+/// Alineamiento de cada buffer dentro del fichero.
+const uint64_t mesh_cache_alignment = 64;
+
+/// Identificador del fichero fuente, para saber si la caché está obsoleta. Todo ceros si el fichero no existe.
+struct mesh_source_stamp {
+    int64_t mtime;
+    uint64_t size;
+};
+
+/// Cabecera del fichero de caché. Todos los campos son de tamaño fijo.
+struct mesh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    uint32_t node_count;
+    uint32_t node_size;
+    mesh_source_stamp source_stamp;
+    uint64_t positions_offset;
+    uint64_t normals_offset;
+    uint64_t uvs_offset;
+    uint64_t indices_offset;
+    uint64_t nodes_offset;
+    uint64_t file_size;
+};
+
+/// Devuelve la fecha de modificación y el tamaño del fichero, en campos separados para que no se puedan confundir.
+mesh_source_stamp file_stamp(const char *path) {
+    mesh_source_stamp s = {0, 0};
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return s;
+    s.mtime = int64_t(st.st_mtime);
+    s.size = uint64_t(st.st_size);
+    return s;
+}
+
+/// Escribe size bytes completos, reintentando escrituras parciales.
+bool write_all(int fd, const void *data, size_t size) {
+    const char *p = (const char *) data;
+    while (size > 0) {
+        ssize_t w = write(fd, p, size);
+        if (w < 0)
+            return false;
+        p += w;
+        size -= w;
+    }
+    return true;
+}
+
+/// Redondea offset al siguiente múltiplo del alineamiento de la caché.
+uint64_t mesh_cache_align(uint64_t offset) {
+    return (offset + mesh_cache_alignment - 1) & ~(mesh_cache_alignment - 1);
+}
+
+/** Escribe la malla, con su BVH ya construido, en un fichero de caché. Se escribe en un fichero temporal de nombre
+   * único que después se renombra, así que un lector nunca ve un fichero a medio escribir, y dos procesos que
+   * construyen a la vez la caché de la misma malla no escriben en el mismo fichero: queda la del último rename.
+   * @param path Ruta del fichero de caché.
+   * @param m Malla a guardar.
+   * @param source_stamp Identificador del fichero fuente, ver file_stamp.
+   * @return Verdadero si se ha podido escribir.
+   */
+bool write_mesh_cache(const char *path, const triangle_mesh& m, mesh_source_stamp source_stamp) {
+    mesh_cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, mesh_cache_magic, sizeof(h.magic));
+    h.version = mesh_cache_version;
+    h.byte_order = mesh_cache_byte_order;
+    h.vertex_count = m.vertex_count;
+    h.triangle_count = m.triangle_count;
+    h.node_count = m.node_count;
+    h.node_size = sizeof(mesh_bvh_node);
+    h.source_stamp = source_stamp;
+
+    const void *data[5] = {m.positions, m.normals, m.uvs, m.indices, m.nodes};
+    uint64_t sizes[5] = {uint64_t(m.positions ? 3*sizeof(float)*m.vertex_count : 0),
+                         uint64_t(m.normals ? 3*sizeof(float)*m.vertex_count : 0),
+                         uint64_t(m.uvs ? 2*sizeof(float)*m.vertex_count : 0),
+                         uint64_t(3*sizeof(uint32_t)*m.triangle_count),
+                         uint64_t(sizeof(mesh_bvh_node)*m.node_count)};
+    uint64_t *offsets[5] = {&h.positions_offset, &h.normals_offset, &h.uvs_offset, &h.indices_offset, &h.nodes_offset};
+    uint64_t end = mesh_cache_align(sizeof(h));
+    for (int i = 0; i < 5; i++) {
+        *offsets[i] = sizes[i] ? end : 0;
+        end = mesh_cache_align(end + sizes[i]);
+    }
+    h.file_size = end;
+
+    std::string tmp = std::string(path) + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+        return false;
+    // mkstemp crea el fichero sólo para su dueño; la caché la tienen que poder leer los demás.
+    fchmod(fd, 0644);
+    static const char zeros[mesh_cache_alignment] = {0};
+    bool ok = write_all(fd, &h, sizeof(h));
+    uint64_t pos = sizeof(h);
+    for (int i = 0; i < 5 && ok; i++) {
+        if (sizes[i] == 0)
+            continue;
+        ok = write_all(fd, zeros, *offsets[i] - pos) && write_all(fd, data[i], sizes[i]);
+        pos = *offsets[i] + sizes[i];
+    }
+    ok = ok && write_all(fd, zeros, h.file_size - pos) && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/** Malla cuyos buffers están dentro de un fichero de caché proyectado en memoria. Las páginas se cargan bajo demanda
+  * la primera vez que se tocan, sin deserializar nada; al abrirla sólo se leen los índices y el BVH para validarlos.
+  */
+class mapped_triangle_mesh: public triangle_mesh  {
+    public:
+        mapped_triangle_mesh(void *addr, size_t len, material *m) : triangle_mesh(), map_addr(addr), map_size(len) {
+            mat_ptr = m;
+            const char *base = (const char *) addr;
+            const mesh_cache_header *h = (const mesh_cache_header *) base;
+            set_views((const float *) (base + h->positions_offset),
+                      h->normals_offset ? (const float *) (base + h->normals_offset) : 0,
+                      h->uvs_offset ? (const float *) (base + h->uvs_offset) : 0,
+                      h->vertex_count,
+                      (const uint32_t *) (base + h->indices_offset),
+                      h->triangle_count,
+                      (const mesh_bvh_node *) (base + h->nodes_offset),
+                      h->node_count);
+        }
+        ~mapped_triangle_mesh() { munmap(map_addr, map_size); }
+        void *map_addr;
+        size_t map_size;
+};
+
+/// Cierto si el buffer de size bytes en offset cae dentro del fichero, detrás de la cabecera y bien alineado.
+bool mesh_cache_range(uint64_t offset, uint64_t size, uint64_t file_size) {
+    return offset >= sizeof(mesh_cache_header) && offset % mesh_cache_alignment == 0
+        && offset <= file_size && size <= file_size - offset;
+}
+
+/** Comprueba que los índices y el BVH de una caché no se salen de sus buffers, para que un fichero corrupto no haga
+  * leer fuera de la proyección al renderizar: cada índice de vértice menor que vertex_count, las hojas dentro de los
+  * triángulos y los hijos derechos detrás de su padre (el izquierdo es el siguiente), sin pasar de la profundidad que
+  * admite la pila del recorrido.
+  */
+bool mesh_cache_consistent(const char *base, const mesh_cache_header& h) {
+    const uint32_t *indices = (const uint32_t *) (base + h.indices_offset);
+    for (uint64_t i = 0; i < 3*uint64_t(h.triangle_count); i++)
+        if (indices[i] >= h.vertex_count)
+            return false;
+    const mesh_bvh_node *nodes = (const mesh_bvh_node *) (base + h.nodes_offset);
+    std::vector<unsigned char> depth(h.node_count, 0);
+    for (uint32_t i = 0; i < h.node_count; i++) {
+        const mesh_bvh_node& n = nodes[i];
+        if (n.count > 0) {
+            if (uint64_t(n.offset) + n.count > h.triangle_count)
+                return false;
+            continue;
+        }
+        if (n.offset <= i + 1 || n.offset >= h.node_count || depth[i] >= 64)
+            return false;
+        depth[i + 1] = std::max(depth[i + 1], (unsigned char) (depth[i] + 1));
+        depth[n.offset] = std::max(depth[n.offset], (unsigned char) (depth[i] + 1));
+    }
+    return true;
+}
+
+/** Abre un fichero de caché y devuelve la malla proyectada en memoria.
+   * @param path Ruta del fichero de caché.
+   * @param m Material de la malla.
+   * @param source_stamp Si no es 0, la caché se rechaza cuando no coincide con el identificador guardado.
+   * @return La malla, o 0 si el fichero no existe, está obsoleto o no es válido.
+   */
+mapped_triangle_mesh *open_mesh_cache(const char *path, material *m, const mesh_source_stamp *source_stamp = 0) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || uint64_t(st.st_size) < sizeof(mesh_cache_header)) {
+        close(fd);
+        return 0;
+    }
+    void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return 0;
+    const mesh_cache_header *h = (const mesh_cache_header *) addr;
+    bool valid = memcmp(h->magic, mesh_cache_magic, sizeof(h->magic)) == 0
+              && h->version == mesh_cache_version
+              && h->byte_order == mesh_cache_byte_order
+              && h->node_size == sizeof(mesh_bvh_node)
+              && h->file_size == uint64_t(st.st_size)
+              && h->vertex_count > 0 && h->triangle_count > 0 && h->node_count > 0
+              && mesh_cache_range(h->positions_offset, 3*sizeof(float)*uint64_t(h->vertex_count), h->file_size)
+              && (h->normals_offset == 0
+                  || mesh_cache_range(h->normals_offset, 3*sizeof(float)*uint64_t(h->vertex_count), h->file_size))
+              && (h->uvs_offset == 0 || mesh_cache_range(h->uvs_offset, 2*sizeof(float)*uint64_t(h->vertex_count), h->file_size))
+              && mesh_cache_range(h->indices_offset, 3*sizeof(uint32_t)*uint64_t(h->triangle_count), h->file_size)
+              && mesh_cache_range(h->nodes_offset, sizeof(mesh_bvh_node)*uint64_t(h->node_count), h->file_size)
+              && (source_stamp == 0 || (h->source_stamp.mtime == source_stamp->mtime
+                                        && h->source_stamp.size == source_stamp->size))
+              && mesh_cache_consistent((const char *) addr, *h);
+    if (!valid) {
+        std::cerr << "mesh cache " << path << " is stale or invalid\n";
+        munmap(addr, st.st_size);
+        return 0;
+    }
+    // El BVH se recorre desde la raíz en todos los rayos: se pide al sistema que empiece a leer ya.
+    madvise(addr, st.st_size, MADV_WILLNEED);
+    return new mapped_triangle_mesh(addr, st.st_size, m);
+}
+
+/** Construir una vez, renderizar muchas: abre la caché si está al día con el fichero fuente y, si no, construye la malla
+   * con build, la guarda en la caché y la devuelve.
+   * @param source Fichero fuente de la malla (por ejemplo un OBJ). Sólo se usa para comprobar si la caché está al día.
+   * @param cache Ruta del fichero de caché.
+   * @param build Función que rellena los buffers de la malla a partir del fichero fuente.
+   * @param m Material de la malla.
+   * @return La malla, o 0 si no se ha podido construir.
+   */
+triangle_mesh *load_cached_mesh(const char *source, const char *cache, bool (*build)(const char *, mesh_buffers&), material *m) {
+    mesh_source_stamp stamp = file_stamp(source);
+    triangle_mesh *mesh = open_mesh_cache(cache, m, &stamp);
+    if (mesh)
+        return mesh;
+    mesh_buffers data;
+    if (!build(source, data))
+        return 0;
+    mesh = new triangle_mesh(data, m);
+    if (!write_mesh_cache(cache, *mesh, stamp))
+        std::cerr << "could not write mesh cache " << cache << "\n";
+    return mesh;
+}
+
+#endif
@@ -0,0 +1,623 @@
+#ifndef MESHLOADERH
+#define MESHLOADERH
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "triangle_mesh.h"
+
+/** Fichero de sólo lectura proyectado en memoria. Los cargadores recorren el fichero directamente, sin iostream ni copias.
+  */
+struct mapped_file {
+    mapped_file() : data(0), size(0) {}
+    ~mapped_file() {
+        if (data)
+            munmap((void *) data, size);
+    }
+    /// Proyecta el fichero path. Devuelve falso si no existe o está vacío.
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            return false;
+        // Los cargadores leen el fichero una vez de principio a fin.
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        data = (const char *) addr;
+        size = st.st_size;
+        return true;
+    }
+    const char *data;
+    size_t size;
+};
+
+/// Número de hilos que usan los cargadores. Ficheros pequeños se leen con uno solo.
+int loader_threads(size_t bytes) {
+    int n = std::thread::hardware_concurrency();
+    if (n < 1)
+        n = 1;
+    int by_size = int(bytes / (1 << 20)) + 1;
+    return n < by_size ? n : by_size;
+}
+
+/// Ejecuta f(i) para i en [0, n) con un hilo por índice. El hilo llamante ejecuta el último.
+template <class F>
+void run_parallel(int n, F f) {
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n - 1; i++)
+        workers.push_back(std::thread(f, i));
+    f(n - 1);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+/// Lee un número real en notación decimal o científica y avanza p. Es independiente del locale, a diferencia de strtof.
+inline float parse_float(const char *&p, const char *end) {
+    while (p < end && is_blank(*p)) p++;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = (*p++ == '-');
+    double value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value*10 + (*p++ - '0');
+    if (p < end && *p == '.') {
+        p++;
+        double scale = 0.1;
+        while (p < end && *p >= '0' && *p <= '9') {
+            value += (*p++ - '0')*scale;
+            scale *= 0.1;
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool eneg = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            eneg = (*p++ == '-');
+        int e = 0;
+        while (p < end && *p >= '0' && *p <= '9')
+            e = e*10 + (*p++ - '0');
+        value *= pow(10.0, eneg ? -e : e);
+    }
+    return neg ? -value : value;
+}
+
+/// Lee un entero con signo y avanza p.
+inline long parse_int(const char *&p, const char *end) {
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = (*p++ == '-');
+    long value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value*10 + (*p++ - '0');
+    return neg ? -value : value;
+}
+
+/// Índice que marca una referencia ausente en una esquina de cara OBJ (por ejemplo "f 1//2" no tiene uv).
+const uint32_t obj_no_index = 0xffffffff;
+
+/// Trozo del fichero OBJ que procesa un hilo, con lo que cuenta en la primera pasada y dónde escribe en la segunda.
+struct obj_chunk {
+    const char *begin, *end;
+    uint32_t v, vt, vn, tris;
+    uint32_t v_base, vt_base, vn_base, tri_base;
+    bool error;
+};
+
+/// Cuenta los vértices de una línea de cara, empezando justo después de la 'f'. Un '#' empieza un comentario.
+inline int count_face_corners(const char *p, const char *end) {
+    int corners = 0;
+    bool in_token = false;
+    for (; p < end && *p != '\n' && *p != '#'; p++) {
+        bool blank = is_blank(*p);
+        if (!blank && !in_token)
+            corners++;
+        in_token = !blank;
+    }
+    return corners;
+}
+
+/// Convierte un índice OBJ (1 es el primero, negativo es relativo al final) en un índice desde 0.
+inline uint32_t resolve_obj_index(long i, uint32_t count) {
+    if (i > 0 && uint32_t(i) <= count)
+        return i - 1;
+    if (i < 0 && uint32_t(-i) <= count)
+        return count + i;
+    return obj_no_index;
+}
+
+/** Carga un fichero Wavefront OBJ. El fichero se proyecta en memoria y se divide en trozos por saltos de línea.
+  * Una primera pasada paralela sólo cuenta líneas de cada tipo; con las sumas prefijas cada hilo sabe en qué posición
+  * de los buffers de la malla escribe, y la segunda pasada parsea y escribe directamente allí.
+  * Las caras con más de tres vértices se triangulan en abanico.
+   * @param path Ruta del fichero.
+   * @param m Buffers donde se devuelve la malla, sin BVH.
+   * @return Verdadero si el fichero se ha leído sin errores.
+   */
+bool load_obj(const char *path, mesh_buffers& m) {
+    mapped_file f;
+    if (!f.open(path)) {
+        std::cerr << "cannot open " << path << "\n";
+        return false;
+    }
+    const char *data = f.data, *file_end = f.data + f.size;
+    int n = loader_threads(f.size);
+    std::vector<obj_chunk> chunks(n);
+    for (int i = 0; i < n; i++) {
+        const char *b = (i == 0) ? data : chunks[i-1].end;
+        const char *e = (i == n - 1) ? file_end : data + f.size*(i + 1)/n;
+        if (e < b)
+            e = b;
+        while (e < file_end && e > data && e[-1] != '\n')
+            e++;
+        chunks[i].begin = b;
+        chunks[i].end = e;
+    }
+
+    run_parallel(n, [&](int i) {
+        obj_chunk& c = chunks[i];
+        c.v = c.vt = c.vn = c.tris = 0;
+        c.error = false;
+        for (const char *p = c.begin; p < c.end; ) {
+            while (p < c.end && is_blank(*p)) p++;
+            if (p + 1 < c.end && p[0] == 'v') {
+                if (is_blank(p[1])) c.v++;
+                else if (p[1] == 't') c.vt++;
+                else if (p[1] == 'n') c.vn++;
+            }
+            else if (p + 1 < c.end && p[0] == 'f' && is_blank(p[1])) {
+                int k = count_face_corners(p + 1, c.end);
+                if (k >= 3)
+                    c.tris += k - 2;
+            }
+            const char *nl = (const char *) memchr(p, '\n', c.end - p);
+            p = nl ? nl + 1 : c.end;
+        }
+    });
+
+    uint32_t nv = 0, nvt = 0, nvn = 0, ntris = 0;
+    for (int i = 0; i < n; i++) {
+        chunks[i].v_base = nv;   nv += chunks[i].v;
+        chunks[i].vt_base = nvt; nvt += chunks[i].vt;
+        chunks[i].vn_base = nvn; nvn += chunks[i].vn;
+        chunks[i].tri_base = ntris; ntris += chunks[i].tris;
+    }
+    std::vector<float> uvs(2*size_t(nvt)), normals(3*size_t(nvn));
+    std::vector<uint32_t> corner_v(3*size_t(ntris)), corner_vt(nvt ? 3*size_t(ntris) : 0), corner_vn(nvn ? 3*size_t(ntris) : 0);
+    m.positions.resize(3*size_t(nv));
+
+    run_parallel(n, [&](int i) {
+        obj_chunk& c = chunks[i];
+        uint32_t v = c.v_base, vt = c.vt_base, vn = c.vn_base, tri = c.tri_base;
+        for (const char *p = c.begin; p < c.end; ) {
+            while (p < c.end && is_blank(*p)) p++;
+            const char *nl = (const char *) memchr(p, '\n', c.end - p);
+            const char *line_end = nl ? nl : c.end;
+            if (p + 1 < line_end && p[0] == 'v' && is_blank(p[1])) {
+                p++;
+                for (int k = 0; k < 3; k++)
+                    m.positions[3*size_t(v) + k] = parse_float(p, line_end);
+                v++;
+            }
+            else if (p + 1 < line_end && p[0] == 'v' && p[1] == 't') {
+                p += 2;
+                for (int k = 0; k < 2; k++)
+                    uvs[2*size_t(vt) + k] = parse_float(p, line_end);
+                vt++;
+            }
+            else if (p + 1 < line_end && p[0] == 'v' && p[1] == 'n') {
+                p += 2;
+                for (int k = 0; k < 3; k++)
+                    normals[3*size_t(vn) + k] = parse_float(p, line_end);
+                vn++;
+            }
+            else if (p + 1 < line_end && p[0] == 'f' && is_blank(p[1])) {
+                p++;
+                // Las esquinas acaban donde empiece un comentario, igual que en count_face_corners.
+                const char *hash = (const char *) memchr(p, '#', line_end - p);
+                const char *face_end = hash ? hash : line_end;
+                uint32_t first[3], prev[3], cur[3];
+                int corners = 0;
+                while (true) {
+                    while (p < face_end && is_blank(*p)) p++;
+                    if (p >= face_end)
+                        break;
+                    cur[0] = resolve_obj_index(parse_int(p, face_end), v);
+                    cur[1] = cur[2] = obj_no_index;
+                    if (p < face_end && *p == '/') {
+                        p++;
+                        if (p < face_end && *p != '/')
+                            cur[1] = resolve_obj_index(parse_int(p, face_end), vt);
+                        if (p < face_end && *p == '/') {
+                            p++;
+                            cur[2] = resolve_obj_index(parse_int(p, face_end), vn);
+                        }
+                    }
+                    while (p < face_end && !is_blank(*p)) p++;
+                    if (cur[0] == obj_no_index)
+                        c.error = true;
+                    if (corners >= 2) {
+                        const uint32_t *tri_corners[3] = {first, prev, cur};
+                        for (int k = 0; k < 3; k++) {
+                            size_t at = 3*size_t(tri) + k;
+                            corner_v[at] = tri_corners[k][0];
+                            if (nvt) corner_vt[at] = tri_corners[k][1];
+                            if (nvn) corner_vn[at] = tri_corners[k][2];
+                        }
+                        tri++;
+                    }
+                    if (corners == 0)
+                        memcpy(first, cur, sizeof(cur));
+                    memcpy(prev, cur, sizeof(cur));
+                    corners++;
+                }
+            }
+            p = nl ? nl + 1 : c.end;
+        }
+    });
+    for (int i = 0; i < n; i++) {
+        if (chunks[i].error) {
+            std::cerr << "bad vertex index in " << path << "\n";
+            return false;
+        }
+    }
+
+    // Si cada esquina usa el mismo índice para posición, uv y normal, los buffers se usan tal cual.
+    // Si no, se desindexa: cada esquina pasa a ser un vértice propio.
+    bool has_uv = nvt > 0, has_n = nvn > 0, shared = true;
+    for (size_t i = 0; i < corner_v.size(); i++) {
+        if (has_uv && corner_vt[i] == obj_no_index) has_uv = false;
+        if (has_n && corner_vn[i] == obj_no_index) has_n = false;
+    }
+    for (size_t i = 0; i < corner_v.size() && shared; i++) {
+        if ((has_uv && corner_vt[i] != corner_v[i]) || (has_n && corner_vn[i] != corner_v[i]))
+            shared = false;
+    }
+    if (shared && (!has_uv || nvt == nv) && (!has_n || nvn == nv)) {
+        m.indices.swap(corner_v);
+        if (has_uv) m.uvs.swap(uvs);
+        if (has_n) m.normals.swap(normals);
+        return true;
+    }
+    std::vector<float> positions(3*corner_v.size());
+    if (has_uv) m.uvs.resize(2*corner_v.size());
+    if (has_n) m.normals.resize(3*corner_v.size());
+    m.indices.resize(corner_v.size());
+    for (size_t i = 0; i < corner_v.size(); i++) {
+        memcpy(&positions[3*i], &m.positions[3*size_t(corner_v[i])], 3*sizeof(float));
+        if (has_uv) memcpy(&m.uvs[2*i], &uvs[2*size_t(corner_vt[i])], 2*sizeof(float));
+        if (has_n) memcpy(&m.normals[3*i], &normals[3*size_t(corner_vn[i])], 3*sizeof(float));
+        m.indices[i] = i;
+    }
+    m.positions.swap(positions);
+    return true;
+}
+
+/// Tipos escalares de PLY.
+enum ply_type { ply_int8, ply_uint8, ply_int16, ply_uint16, ply_int32, ply_uint32, ply_float32, ply_float64, ply_invalid };
+
+/// Tamaño en bytes de un tipo PLY.
+int ply_type_size(ply_type t) {
+    static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8, 0};
+    return sizes[t];
+}
+
+/// Traduce el nombre de un tipo de la cabecera PLY.
+ply_type ply_type_from_name(const std::string& s) {
+    if (s == "char" || s == "int8") return ply_int8;
+    if (s == "uchar" || s == "uint8") return ply_uint8;
+    if (s == "short" || s == "int16") return ply_int16;
+    if (s == "ushort" || s == "uint16") return ply_uint16;
+    if (s == "int" || s == "int32") return ply_int32;
+    if (s == "uint" || s == "uint32") return ply_uint32;
+    if (s == "float" || s == "float32") return ply_float32;
+    if (s == "double" || s == "float64") return ply_float64;
+    return ply_invalid;
+}
+
+/// Lee un valor binario de tipo t, dando la vuelta a los bytes si el fichero tiene el orden contrario al de la máquina.
+inline double read_ply_value(const char *p, ply_type t, bool swap) {
+    unsigned char b[8];
+    int size = ply_type_size(t);
+    for (int i = 0; i < size; i++)
+        b[i] = p[swap ? size - 1 - i : i];
+    switch (t) {
+        case ply_int8:    return *(int8_t *) b;
+        case ply_uint8:   return *(uint8_t *) b;
+        case ply_int16:   { int16_t v; memcpy(&v, b, 2); return v; }
+        case ply_uint16:  { uint16_t v; memcpy(&v, b, 2); return v; }
+        case ply_int32:   { int32_t v; memcpy(&v, b, 4); return v; }
+        case ply_uint32:  { uint32_t v; memcpy(&v, b, 4); return v; }
+        case ply_float32: { float v; memcpy(&v, b, 4); return v; }
+        case ply_float64: { double v; memcpy(&v, b, 8); return v; }
+        default:          return 0;
+    }
+}
+
+/// Propiedad de un elemento PLY. Si is_list, count_type es el tipo del contador y type el de cada valor.
+struct ply_property {
+    std::string name;
+    ply_type type, count_type;
+    bool is_list;
+};
+
+/// Elemento PLY (por ejemplo vertex o face) con su número de registros y sus propiedades.
+struct ply_element {
+    std::string name;
+    size_t count;
+    std::vector<ply_property> props;
+    /// Tamaño de cada registro, o 0 si tiene listas y por tanto es variable.
+    size_t stride() const {
+        size_t s = 0;
+        for (size_t i = 0; i < props.size(); i++) {
+            if (props[i].is_list)
+                return 0;
+            s += ply_type_size(props[i].type);
+        }
+        return s;
+    }
+};
+
+/** Lee el contador de la lista pr que empieza en p y comprueba que la lista entera cabe antes de end.
+  * @param k Donde se devuelve el número de valores de la lista.
+  * @return Falso si el registro está cortado o el contador es negativo.
+  */
+inline bool read_ply_list(const ply_property& pr, const char *p, const char *end, bool swap, size_t& k) {
+    size_t count_size = ply_type_size(pr.count_type);
+    if (size_t(end - p) < count_size)
+        return false;
+    double count = read_ply_value(p, pr.count_type, swap);
+    if (count < 0)
+        return false;
+    k = size_t(count);
+    return (size_t(end - p) - count_size) / ply_type_size(pr.type) >= k;
+}
+
+/// Avanza p sobre la propiedad pr de un registro. Devuelve 0 si no cabe antes de end.
+inline const char *skip_ply_property(const ply_property& pr, const char *p, const char *end, bool swap) {
+    if (!pr.is_list)
+        return size_t(end - p) < size_t(ply_type_size(pr.type)) ? 0 : p + ply_type_size(pr.type);
+    size_t k;
+    if (!read_ply_list(pr, p, end, swap, k))
+        return 0;
+    return p + ply_type_size(pr.count_type) + k*ply_type_size(pr.type);
+}
+
+/// Avanza p sobre un registro de longitud variable del elemento e. Devuelve 0 si el registro no cabe antes de end.
+const char *skip_ply_record(const ply_element& e, const char *p, const char *end, bool swap) {
+    for (size_t i = 0; i < e.props.size() && p; i++)
+        p = skip_ply_property(e.props[i], p, end, swap);
+    return p;
+}
+
+/** Carga un fichero PLY binario (en cualquier orden de bytes). Los vértices y, si todas las caras son triángulos,
+  * también las caras tienen registros de tamaño fijo y se reparten entre hilos que escriben directamente en los buffers.
+   * @param path Ruta del fichero.
+   * @param m Buffers donde se devuelve la malla, sin BVH.
+   * @return Verdadero si el fichero se ha leído sin errores.
+   */
+bool load_ply(const char *path, mesh_buffers& m) {
+    mapped_file f;
+    if (!f.open(path)) {
+        std::cerr << "cannot open " << path << "\n";
+        return false;
+    }
+    const char *p = f.data, *end = f.data + f.size;
+    std::vector<ply_element> elements;
+    bool swap = false, binary = false, header_ok = false;
+    uint32_t one = 1;
+    bool little_endian_host = *(char *) &one == 1;
+    std::string line;
+    while (p < end) {
+        const char *nl = (const char *) memchr(p, '\n', end - p);
+        if (!nl)
+            break;
+        line.assign(p, nl - p);
+        p = nl + 1;
+        if (!line.empty() && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+        std::vector<std::string> w;
+        size_t i = 0;
+        while (i < line.size()) {
+            while (i < line.size() && line[i] == ' ') i++;
+            size_t j = i;
+            while (j < line.size() && line[j] != ' ') j++;
+            if (j > i)
+                w.push_back(line.substr(i, j - i));
+            i = j;
+        }
+        if (w.empty())
+            continue;
+        if (w[0] == "format" && w.size() > 1) {
+            binary = (w[1] == "binary_little_endian" || w[1] == "binary_big_endian");
+            swap = (w[1] == "binary_little_endian") != little_endian_host;
+        }
+        else if (w[0] == "element" && w.size() > 2) {
+            ply_element e;
+            e.name = w[1];
+            e.count = strtoull(w[2].c_str(), 0, 10);
+            elements.push_back(e);
+        }
+        else if (w[0] == "property" && !elements.empty()) {
+            ply_property pr;
+            pr.is_list = (w.size() > 4 && w[1] == "list");
+            pr.count_type = pr.is_list ? ply_type_from_name(w[2]) : ply_invalid;
+            pr.type = ply_type_from_name(pr.is_list ? w[3] : w[1]);
+            pr.name = w[w.size()-1];
+            // El contador de una lista tiene que ser entero.
+            if (pr.type == ply_invalid || (pr.is_list && (pr.count_type == ply_invalid || pr.count_type == ply_float32
+                                                          || pr.count_type == ply_float64))) {
+                std::cerr << "unsupported PLY property type in " << path << "\n";
+                return false;
+            }
+            elements.back().props.push_back(pr);
+        }
+        else if (w[0] == "end_header") {
+            header_ok = true;
+            break;
+        }
+    }
+    if (!header_ok || !binary) {
+        std::cerr << path << " is not a binary PLY file\n";
+        return false;
+    }
+
+    for (size_t ei = 0; ei < elements.size(); ei++) {
+        const ply_element& e = elements[ei];
+        size_t stride = e.stride();
+        if (e.name == "vertex") {
+            if (stride == 0 || e.count > size_t(end - p) / stride) {
+                std::cerr << "bad vertex element in " << path << "\n";
+                return false;
+            }
+            // Desplazamiento dentro del registro de cada propiedad que interesa: x y z nx ny nz u v.
+            int offsets[8];
+            ply_type types[8];
+            const char *names[8][3] = {{"x", "", ""}, {"y", "", ""}, {"z", "", ""}, {"nx", "", ""}, {"ny", "", ""}, {"nz", "", ""},
+                                       {"u", "s", "texture_u"}, {"v", "t", "texture_v"}};
+            for (int k = 0; k < 8; k++) {
+                offsets[k] = -1;
+                int off = 0;
+                for (size_t i = 0; i < e.props.size(); i++) {
+                    for (int a = 0; a < 3; a++)
+                        if (names[k][a][0] && e.props[i].name == names[k][a]) {
+                            offsets[k] = off;
+                            types[k] = e.props[i].type;
+                        }
+                    off += ply_type_size(e.props[i].type);
+                }
+            }
+            if (offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0) {
+                std::cerr << "PLY vertices without position in " << path << "\n";
+                return false;
+            }
+            bool has_n = offsets[3] >= 0 && offsets[4] >= 0 && offsets[5] >= 0;
+            bool has_uv = offsets[6] >= 0 && offsets[7] >= 0;
+            m.positions.resize(3*e.count);
+            if (has_n) m.normals.resize(3*e.count);
+            if (has_uv) m.uvs.resize(2*e.count);
+            const char *base = p;
+            int n = loader_threads(stride*e.count);
+            run_parallel(n, [&](int t) {
+                for (size_t i = e.count*t/n; i < e.count*(t + 1)/n; i++) {
+                    const char *r = base + i*stride;
+                    for (int k = 0; k < 3; k++)
+                        m.positions[3*i + k] = read_ply_value(r + offsets[k], types[k], swap);
+                    if (has_n)
+                        for (int k = 0; k < 3; k++)
+                            m.normals[3*i + k] = read_ply_value(r + offsets[3 + k], types[3 + k], swap);
+                    if (has_uv)
+                        for (int k = 0; k < 2; k++)
+                            m.uvs[2*i + k] = read_ply_value(r + offsets[6 + k], types[6 + k], swap);
+                }
+            });
+            p += stride*e.count;
+        }
+        else if (e.name == "face") {
+            int list = -1;
+            for (size_t i = 0; i < e.props.size(); i++)
+                if (e.props[i].is_list && (e.props[i].name == "vertex_indices" || e.props[i].name == "vertex_index"))
+                    list = i;
+            if (list < 0) {
+                std::cerr << "PLY faces without vertex_indices in " << path << "\n";
+                return false;
+            }
+            const ply_property& pr = e.props[list];
+            int count_size = ply_type_size(pr.count_type), item_size = ply_type_size(pr.type);
+            size_t tri_stride = count_size + 3*item_size;
+            bool all_triangles = e.props.size() == 1 && e.count <= size_t(end - p) / tri_stride;
+            for (size_t i = 0; i < e.count && all_triangles; i++)
+                all_triangles = read_ply_value(p + i*tri_stride, pr.count_type, swap) == 3;
+            if (all_triangles) {
+                // Registros de tamaño fijo: cada hilo lee su rango de caras y escribe en su rango de índices.
+                m.indices.resize(3*e.count);
+                const char *base = p;
+                int n = loader_threads(tri_stride*e.count);
+                run_parallel(n, [&](int t) {
+                    for (size_t i = e.count*t/n; i < e.count*(t + 1)/n; i++) {
+                        const char *r = base + i*tri_stride + count_size;
+                        for (int k = 0; k < 3; k++)
+                            m.indices[3*i + k] = read_ply_value(r + k*item_size, pr.type, swap);
+                    }
+                });
+                p += tri_stride*e.count;
+            }
+            else {
+                // Cada registro ocupa al menos un byte: el número de caras no puede pasar del tamaño que queda.
+                m.indices.reserve(3*std::min(e.count, size_t(end - p)));
+                for (size_t i = 0; i < e.count; i++) {
+                    // Las propiedades anteriores a la lista, que también pueden ser listas, se saltan una a una.
+                    const char *r = p;
+                    for (int pi = 0; pi < list && r; pi++)
+                        r = skip_ply_property(e.props[pi], r, end, swap);
+                    size_t k;
+                    if (!r || !read_ply_list(pr, r, end, swap, k)) {
+                        std::cerr << "truncated or corrupt PLY file " << path << "\n";
+                        return false;
+                    }
+                    r += count_size;
+                    uint32_t first = k > 0 ? uint32_t(read_ply_value(r, pr.type, swap)) : 0;
+                    for (size_t c = 2; c < k; c++) {
+                        m.indices.push_back(first);
+                        m.indices.push_back(read_ply_value(r + (c - 1)*item_size, pr.type, swap));
+                        m.indices.push_back(read_ply_value(r + c*item_size, pr.type, swap));
+                    }
+                    p = skip_ply_record(e, p, end, swap);
+                    if (!p) {
+                        std::cerr << "truncated or corrupt PLY file " << path << "\n";
+                        return false;
+                    }
+                }
+            }
+        }
+        else if (stride) {
+            if (e.count > size_t(end - p) / stride) {
+                std::cerr << "truncated PLY file " << path << "\n";
+                return false;
+            }
+            p += stride*e.count;
+        }
+        else {
+            for (size_t i = 0; i < e.count; i++) {
+                p = skip_ply_record(e, p, end, swap);
+                if (!p) {
+                    std::cerr << "truncated or corrupt PLY file " << path << "\n";
+                    return false;
+                }
+            }
+        }
+    }
+    uint32_t nv = m.vertex_count();
+    for (size_t i = 0; i < m.indices.size(); i++) {
+        if (m.indices[i] >= nv) {
+            std::cerr << "bad vertex index in " << path << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Carga un OBJ o un PLY según la extensión del fichero.
+bool load_mesh(const char *path, mesh_buffers& m) {
+    std::string s(path);
+    if (s.size() > 4 && s.compare(s.size() - 4, 4, ".ply") == 0)
+        return load_ply(path, m);
+    return load_obj(path, m);
+}
+
+#endif
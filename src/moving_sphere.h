@@ -19,6 +19,8 @@ class moving_sphere: public hittable  {
         moving_sphere() {}
         moving_sphere(vec3 cen0, vec3 cen1, float t0, float t1, float r, material *m) : center0(cen0), center1(cen1), time0(t0),time1(t1), radius(r), mat_ptr(m)  {};
         virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_query& q) const;
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
         vec3 center(float time) const;
         vec3 center0, center1;
@@ -41,8 +43,12 @@ bool moving_sphere::bounding_box(float t0, float t1, aabb& box) const {
 
 
 
-// replace "center" with "center(r.time())"
 bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+// replace "center" with "center(r.time())"
+bool moving_sphere::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
     vec3 oc = r.origin() - center(r.time());
     float a = dot(r.direction(), r.direction());
     float b = dot(oc, r.direction());
@@ -51,24 +57,25 @@ bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec)
     if (discriminant > 0) {
         float temp = (-b - sqrt(discriminant))/a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
+            set_query(q, temp, this);
             return true;
         }
         temp = (-b + sqrt(discriminant))/a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = (rec.p - center(r.time())) / radius;
-            rec.mat_ptr = mat_ptr;
+            set_query(q, temp, this);
             return true;
         }
     }
     return false;
 }
 
+void moving_sphere::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    rec.t = q.t;
+    rec.p = r.point_at_parameter(rec.t);
+    rec.normal = (rec.p - center(r.time())) / radius;
+    rec.mat_ptr = mat_ptr;
+}
+
 
 #endif
 
@@ -13,11 +13,12 @@
 
 #include "onb.h"
 #include "random.h"
+#include "sampler.h"
 
 
 inline vec3 random_cosine_direction() {
-    float r1 = random_double();
-    float r2 = random_double();
+    float r1, r2;
+    sample_2d(stream_bsdf, r1, r2);
     float z = sqrt(1-r2);
     float phi = 2*M_PI*r1;
     float x = cos(phi)*sqrt(r2);
@@ -26,8 +27,8 @@ inline vec3 random_cosine_direction() {
 }
 
 inline vec3 random_to_sphere(float radius, float distance_squared) {
-    float r1 = random_double();
-    float r2 = random_double();
+    float r1, r2;
+    sample_2d(stream_light_uv, r1, r2);
     float z = 1 + r2*(sqrt(1-radius*radius/distance_squared) - 1);
     float phi = 2*M_PI*r1;
     float x = cos(phi)*sqrt(1-z*z);
@@ -46,6 +47,12 @@ vec3 random_in_unit_sphere() {
 
 
 
+/// Heurística de la potencia (beta = 2) de Veach para combinar dos estrategias de muestreo con MIS.
+inline float power_heuristic(float pdf_a, float pdf_b) {
+    float a = pdf_a*pdf_a, b = pdf_b*pdf_b;
+    return a / (a + b);
+}
+
 class pdf  {
     public:
         virtual float value(const vec3& direction) const = 0;
@@ -90,7 +97,7 @@ class mixture_pdf : public pdf {
             return 0.5 * p[0]->value(direction) + 0.5 *p[1]->value(direction);
         }
         virtual vec3 generate() const {
-            if (random_double() < 0.5)
+            if (sample_1d(stream_light_select) < 0.5)
                 return p[0]->generate();
             else
                 return p[1]->generate();
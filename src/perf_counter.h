@@ -0,0 +1,64 @@
+#ifndef PERFCOUNTERH
+#define PERFCOUNTERH
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/** Contador hardware del procesador (por defecto, fallos de caché del último nivel) para el hilo actual, leído con
+  * perf_event_open. Sólo cuenta entre start() y stop(), y acumula entre varias llamadas. Si el sistema no da acceso al
+  * contador (otro sistema operativo, máquina virtual, perf_event_paranoid...), available() es falso y value() vale 0.
+  */
+class hw_counter {
+    public:
+#ifdef __linux__
+        hw_counter(uint64_t config = PERF_COUNT_HW_CACHE_MISSES) : total(0) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        ~hw_counter() {
+            if (fd >= 0)
+                close(fd);
+        }
+        void start() {
+            if (fd < 0)
+                return;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        void stop() {
+            if (fd < 0)
+                return;
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            uint64_t count;
+            if (read(fd, &count, sizeof(count)) == sizeof(count))
+                total += count;
+        }
+#else
+        hw_counter() : fd(-1), total(0) {}
+        void start() {}
+        void stop() {}
+#endif
+        bool available() const { return fd >= 0; }
+        uint64_t value() const { return total; }
+
+    private:
+        hw_counter(const hw_counter&);
+        hw_counter& operator=(const hw_counter&);
+        int fd;
+        uint64_t total;
+};
+
+#endif
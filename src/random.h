@@ -2,10 +2,25 @@
 #define RANDOMH
 
 #include <cstdlib>
+#include <stdint.h>
 
 
+/** Estado del generador de números aleatorios de cada hilo (PCG32 de O'Neill). Se usa en lugar de rand() para que el
+  * estado se pueda guardar en un checkpoint y, al reanudar, la secuencia siga exactamente igual.
+  */
+inline uint64_t& random_state() {
+    static thread_local uint64_t state = 0x853c49e6748fea9bULL;
+    return state;
+}
+
+/// Número aleatorio en [0, 1). Se queda con 24 bits para que tampoco llegue a 1 al guardarlo en un float.
 double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+    uint64_t old = random_state();
+    random_state() = old * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    uint32_t rot = uint32_t(old >> 59);
+    uint32_t r = (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    return (r >> 8) / 16777216.0;
 }
 
 #endif
@@ -29,5 +29,22 @@ class ray
         float _time;
 };
 
+/// Máximo de rayos de un paquete: 16, un bloque de 4x4 píxeles.
+const int ray_packet_max = 16;
+
+/** Paquete de rayos coherentes (por ejemplo, los primarios de un bloque de píxeles) en estructura de vectores (SoA),
+  * para que las pruebas contra las cajas del BVH recorran cada componente de forma contigua.
+  */
+struct ray_packet {
+    int size;
+    float ox[ray_packet_max], oy[ray_packet_max], oz[ray_packet_max];
+    float dx[ray_packet_max], dy[ray_packet_max], dz[ray_packet_max];
+    float time[ray_packet_max];
+
+    ray get(int i) const {
+        return ray(vec3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]), time[i]);
+    }
+};
+
 #endif
 
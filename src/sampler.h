@@ -0,0 +1,268 @@
+#ifndef SAMPLERH
+#define SAMPLERH
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include "random.h"
+
+/** Generadores de muestras para el render. En lugar de pedir números aleatorios independientes, cada uso de
+  * aleatoriedad pide su valor a un flujo (la posición dentro del píxel, la lente, el tiempo, la elección de luz, el
+  * punto en la luz y la BSDF), y el sampler reparte los valores de cada flujo entre las muestras de un píxel de forma
+  * estratificada o de baja discrepancia, como en el experimento de pi.cc.
+  *
+  * La dimensión de un valor es el flujo más el número de valores que ese flujo lleva ya en el camino, así que un rebote
+  * más en un flujo no descoloca a los demás. Sin sampler activo (la opción por defecto) se usa random_double().
+  */
+
+/// Flujos de muestras de un camino.
+enum sample_stream { stream_pixel, stream_lens, stream_time, stream_light_select, stream_light_uv, stream_bsdf, stream_count };
+
+/// Muestra que se está tomando: su píxel, su número dentro del píxel y cuántos valores lleva pedidos cada flujo.
+struct sample_state {
+    uint32_t pixel, index;
+    uint16_t used[stream_count];
+};
+
+inline void start_sample(sample_state& s, uint32_t pixel, uint32_t index) {
+    s.pixel = pixel;
+    s.index = index;
+    for (int k = 0; k < stream_count; k++)
+        s.used[k] = 0;
+}
+
+/// Mezcla de enteros de 32 bits (lowbias32), para las semillas de cada píxel y dimensión.
+inline uint32_t hash_u32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return hash_u32(seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2)));
+}
+
+/// Pasa 32 bits a un float en [0, 1) con sus 24 bits altos, para que no redondee a 1.
+inline float bits_to_float(uint32_t x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+class sampler {
+    public:
+        sampler(uint32_t s = 0) : seed(s) {}
+        virtual ~sampler() {}
+        /// Valor en [0, 1) de la dimensión dim de la muestra index del píxel.
+        virtual float get_1d(uint32_t pixel, uint32_t index, uint32_t dim) = 0;
+        /// Par de valores en [0, 1)^2 de la dimensión dim, repartidos en las dos dimensiones a la vez.
+        virtual void get_2d(uint32_t pixel, uint32_t index, uint32_t dim, float& u, float& v) = 0;
+
+    protected:
+        /// Semilla de la dimensión dim del píxel: decorrela los píxeles y las dimensiones entre sí.
+        uint32_t dimension_seed(uint32_t pixel, uint32_t dim) const { return hash_combine(hash_combine(seed, pixel), dim); }
+        uint32_t seed;
+};
+
+/** Permutación pseudoaleatoria de [0, l) sin tablas (Kensler, Correlated Multi-Jittered Sampling): devuelve la
+  * posición de i en la permutación número p.
+  */
+inline uint32_t kensler_permute(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p; i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8; i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1; i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11; i *= 0x74dcb303;
+        i ^= (i & w) >> 2; i *= 0x9e501cc3;
+        i ^= (i & w) >> 2; i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+/** Muestreo estratificado: cada tanda de n muestras de un píxel cae en n estratos distintos. En 2D se usa el
+  * multi-jittered correlacionado de Kensler, estratificado a la vez en una rejilla de m x (n/m) celdas y en cada eje por
+  * separado. Si se piden más de n muestras (muestreo adaptativo), cada tanda de n se estratifica
+  * aparte con otra permutación.
+  */
+class stratified_sampler : public sampler {
+    public:
+        stratified_sampler(int samples, uint32_t s = 0) : sampler(s), n(samples > 0 ? samples : 1) {
+            m = int(sqrt(float(n)));
+            rows = (n + m - 1) / m;
+        }
+        virtual float get_1d(uint32_t pixel, uint32_t index, uint32_t dim) {
+            uint32_t p = hash_combine(dimension_seed(pixel, dim), index / n);
+            uint32_t s = index % n;
+            return (kensler_permute(s, n, p) + bits_to_float(hash_combine(p, s))) / n;
+        }
+        virtual void get_2d(uint32_t pixel, uint32_t index, uint32_t dim, float& u, float& v) {
+            uint32_t p = hash_combine(dimension_seed(pixel, dim), index / n);
+            // Con n que no es m*rows sobran celdas de la rejilla: se usa una selección aleatoria de n de ellas, no las n primeras,
+            // para que cada muestra siga siendo uniforme.
+            uint32_t s = kensler_permute(index % n, m*rows, p * 0x51633e2d);
+            uint32_t sx = kensler_permute(s % m, m, p * 0x68bc21eb);
+            uint32_t sy = kensler_permute(s / m, rows, p * 0x02e5be93);
+            float jx = bits_to_float(hash_combine(p * 0x967a889b, s));
+            float jy = bits_to_float(hash_combine(p * 0x368cc8b7, s));
+            u = fmin((s % m + (sy + jx) / rows) / m, 0.99999994f);
+            v = fmin((s / m + (sx + jy) / m) / rows, 0.99999994f);
+        }
+
+    private:
+        int n, m, rows;
+};
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+/** Permutación de Laine y Karras, con la mezcla mejorada de Vegdahl: con los bits invertidos, cada bit sólo depende
+  * de los de menor peso.
+  */
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+/// Scrambling de Owen de x: cada bit se invierte o no según los bits de mayor peso y la semilla.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/** Secuencia de Sobol con scrambling de Owen por hash (Burley, Practical Hash-based Owen Scrambling). Sólo se usan las
+  * dos primeras dimensiones de Sobol, que forman una red (0, 2) en cualquier potencia de dos de muestras; cada dimensión
+  * del camino es un par de ellas con su propio scrambling y su propio orden de las muestras, así que las dimensiones
+  * no se correlacionan entre sí y no hacen falta tablas de números de dirección.
+  */
+class sobol_sampler : public sampler {
+    public:
+        sobol_sampler(uint32_t s = 0) : sampler(s) {}
+        virtual float get_1d(uint32_t pixel, uint32_t index, uint32_t dim) {
+            uint32_t p = dimension_seed(pixel, dim);
+            uint32_t i = nested_uniform_scramble(index, p);
+            return bits_to_float(nested_uniform_scramble(reverse_bits(i), hash_combine(p, 0)));
+        }
+        virtual void get_2d(uint32_t pixel, uint32_t index, uint32_t dim, float& u, float& v) {
+            uint32_t p = dimension_seed(pixel, dim);
+            uint32_t i = nested_uniform_scramble(index, p);
+            // La primera dimensión de Sobol es la de van der Corput; la segunda tiene los números de dirección de x+1.
+            uint32_t x = reverse_bits(i), y = 0;
+            for (uint32_t d = 0x80000000; i; i >>= 1, d ^= d >> 1)
+                if (i & 1)
+                    y ^= d;
+            u = bits_to_float(nested_uniform_scramble(x, hash_combine(p, 0)));
+            v = bits_to_float(nested_uniform_scramble(y, hash_combine(p, 1)));
+        }
+};
+
+/// Número de bases primas de la secuencia de Halton. Las dimensiones que pasan de ahí usan valores aleatorios.
+const int halton_max_bases = 128;
+
+/** Secuencia de Halton: la dimensión k es la inversa radical en el k-ésimo primo, con scrambling de Owen en esa base
+  * distinto en cada píxel y dimensión. Sin él, en las bases grandes las pocas muestras de un píxel (i/b con i < b) caen
+  * todas casi en el mismo punto, y valen lo que una sola.
+  */
+class halton_sampler : public sampler {
+    public:
+        halton_sampler(uint32_t s = 0) : sampler(s) {
+            for (int c = 2; int(primes.size()) < halton_max_bases; c++) {
+                bool prime = true;
+                for (size_t k = 0; k < primes.size() && primes[k]*primes[k] <= c && prime; k++)
+                    prime = c % primes[k] != 0;
+                if (prime)
+                    primes.push_back(c);
+            }
+        }
+        virtual float get_1d(uint32_t pixel, uint32_t index, uint32_t dim) {
+            return component(pixel, index, dim, 0);
+        }
+        virtual void get_2d(uint32_t pixel, uint32_t index, uint32_t dim, float& u, float& v) {
+            u = component(pixel, index, dim, 0);
+            v = component(pixel, index, dim, 1);
+        }
+
+    private:
+        float component(uint32_t pixel, uint32_t index, uint32_t dim, uint32_t axis) {
+            uint32_t p = hash_combine(dimension_seed(pixel, dim), axis);
+            uint32_t base = 2*dim + axis;
+            if (base >= primes.size())
+                return bits_to_float(hash_combine(p, index));
+            return fmin(scrambled_radical_inverse(primes[base], index, p), 0.99999994f);
+        }
+        /** Inversa radical de i en la base dada, permutando cada dígito según la semilla y los dígitos anteriores. Los ceros
+          * a la izquierda de i, permutados así, suman un valor uniforme en el intervalo que queda, que se toma de una vez.
+          */
+        static float scrambled_radical_inverse(uint32_t base, uint32_t i, uint32_t seed) {
+            double inv = 1.0 / base, f = inv, r = 0;
+            uint32_t h = seed;
+            for (; i; f *= inv) {
+                uint32_t d = i % base;
+                i /= base;
+                r += kensler_permute(d, base, h) * f;
+                h = hash_combine(h, d);
+            }
+            return r + bits_to_float(h) * f * base;
+        }
+        std::vector<int> primes;
+};
+
+/// Sampler activo en este hilo y muestra que se está tomando.
+struct sampling_context {
+    sampler *s;
+    sample_state *state;
+};
+
+inline sampling_context& current_sampling() {
+    static thread_local sampling_context c = {0, 0};
+    return c;
+}
+
+/// Indica qué muestra consume los valores que se pidan a partir de ahora; 0 para volver a random_double().
+inline void use_sample_state(sample_state *state) {
+    current_sampling().state = state;
+}
+
+/// Siguiente valor del flujo en la muestra actual.
+inline float sample_1d(sample_stream stream) {
+    sampling_context& c = current_sampling();
+    if (!c.s || !c.state)
+        return random_double();
+    uint32_t dim = uint32_t(c.state->used[stream]++) * stream_count + stream;
+    return c.s->get_1d(c.state->pixel, c.state->index, dim);
+}
+
+/// Siguiente par de valores del flujo en la muestra actual.
+inline void sample_2d(sample_stream stream, float& u, float& v) {
+    sampling_context& c = current_sampling();
+    if (!c.s || !c.state) {
+        u = random_double();
+        v = random_double();
+        return;
+    }
+    uint32_t dim = uint32_t(c.state->used[stream]++) * stream_count + stream;
+    c.s->get_2d(c.state->pixel, c.state->index, dim, u, v);
+}
+
+#endif
@@ -0,0 +1,459 @@
+#ifndef SERVICEH
+#define SERVICEH
+
+#ifndef _MSC_VER
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "distributed.h"
+#include "film.h"
+#include "hittable.h"
+
+/** Modo servicio: un proceso que se queda escuchando en un socket Unix y renderiza los trabajos que le llegan. Las
+  * escenas se construyen (con su BVH) la primera vez que se piden y se guardan en memoria para los trabajos siguientes,
+  * y todos los trabajos comparten un mismo conjunto de hilos. Cada trabajo se parte en franjas de filas que van a una
+  * cola con prioridad: las franjas de un trabajo más prioritario pasan delante de las que quedan de los demás, y entre
+  * trabajos de la misma prioridad va primero el que llegó antes.
+  *
+  * El protocolo es de líneas de texto. Una línea "render clave=valor ..." encola un trabajo; el servicio contesta
+  * "queued id" en seguida y "done id segundos" (o "error id motivo") cuando la imagen está escrita. Cada conexión
+  * espera a su trabajo antes de leer la línea siguiente, así que los trabajos simultáneos van por conexiones distintas.
+  * "status" devuelve las escenas en caché y los trabajos pendientes, y "shutdown" acaba los trabajos encolados y sale.
+  */
+
+/// Escena lista para renderizar: el mundo con su BVH, los emisores y los objetos hacia los que muestrea color().
+struct render_scene {
+    hittable *world, *lights, *light_shape;
+};
+
+/// Trabajo de render tal como llega por el socket.
+struct render_request {
+    /// Escena: cornell o la ruta de una malla OBJ o PLY que se pone en lugar de la caja.
+    std::string scene;
+    int width, height, spp;
+    bool nee;
+    std::string filter;
+    vec3 lookfrom, lookat;
+    float vfov;
+    /// Los trabajos de más prioridad pasan delante.
+    int priority;
+    /// Fichero PPM donde se escribe la imagen.
+    std::string output;
+};
+
+/// Trabajo con los valores por defecto, los del render normal de la caja de Cornell.
+inline render_request default_request() {
+    render_request r;
+    r.scene = "cornell";
+    r.width = r.height = 500;
+    r.spp = 10;
+    r.nee = false;
+    r.filter = "box";
+    r.lookfrom = vec3(278, 278, -800);
+    r.lookat = vec3(278, 278, 0);
+    r.vfov = 40;
+    r.priority = 0;
+    return r;
+}
+
+/// Lee un vector x,y,z. @return Falso si no son tres números.
+inline bool parse_vec3(const std::string& s, vec3& v) {
+    float x, y, z;
+    char extra;
+    if (sscanf(s.c_str(), "%f,%f,%f%c", &x, &y, &z, &extra) != 3)
+        return false;
+    v = vec3(x, y, z);
+    return true;
+}
+
+/** Lee las claves de una línea "render clave=valor ...": scene, width, height, spp, nee (0 o 1), filter, lookfrom,
+  * lookat (x,y,z), vfov, priority y out, que es la única obligatoria.
+  * @param error Motivo si la línea no es válida.
+  */
+inline bool parse_request(const std::string& line, render_request& r, std::string& error) {
+    r = default_request();
+    std::istringstream in(line);
+    std::string word;
+    in >> word;
+    while (in >> word) {
+        size_t eq = word.find('=');
+        if (eq == std::string::npos) {
+            error = "expected key=value, got " + word;
+            return false;
+        }
+        std::string key = word.substr(0, eq), value = word.substr(eq + 1);
+        bool ok = true;
+        if (key == "scene")
+            r.scene = value;
+        else if (key == "width")
+            ok = (r.width = atoi(value.c_str())) > 0;
+        else if (key == "height")
+            ok = (r.height = atoi(value.c_str())) > 0;
+        else if (key == "spp")
+            ok = (r.spp = atoi(value.c_str())) > 0;
+        else if (key == "nee")
+            r.nee = value == "1";
+        else if (key == "filter") {
+            pixel_filter *f = make_filter(value);
+            ok = f != 0;
+            delete f;
+            r.filter = value;
+        }
+        else if (key == "lookfrom")
+            ok = parse_vec3(value, r.lookfrom);
+        else if (key == "lookat")
+            ok = parse_vec3(value, r.lookat);
+        else if (key == "vfov")
+            ok = (r.vfov = atof(value.c_str())) > 0 && r.vfov < 180;
+        else if (key == "priority")
+            r.priority = atoi(value.c_str());
+        else if (key == "out")
+            r.output = value;
+        else
+            ok = false;
+        if (!ok) {
+            error = "bad " + word;
+            return false;
+        }
+    }
+    if (r.output.empty()) {
+        error = "missing out=file";
+        return false;
+    }
+    return true;
+}
+
+/** Servicio de render. Lo que depende del integrador se le da al crearlo: cómo se construye una escena a partir de su
+  * nombre y cómo se renderiza una franja de filas de un trabajo.
+  */
+class render_service {
+    public:
+        typedef std::function<render_scene(const std::string&)> scene_builder;
+        /** Renderiza con spp muestras la franja band del trabajo en out, que cubre las filas de la franja y el margen del
+          * filtro. samples es el contador de muestras de cada píxel del trabajo; las franjas no comparten píxeles.
+          */
+        typedef std::function<void(const render_scene&, const render_request&, camera *, int band, int *samples,
+                                   film_buffer& out)> band_renderer;
+
+        /// @param band_height Filas de cada franja. @param threads Hilos de render que comparten todos los trabajos.
+        render_service(scene_builder b, band_renderer r, int band_height, int threads)
+            : build(b), render(r), band_rows(band_height), next_id(1), stopping(false), stopping_connections(false),
+              listen_fd(-1), active(0), connections(0) {
+            for (int t = 0; t < std::max(1, threads); t++)
+                pool.push_back(std::thread(&render_service::work, this));
+        }
+
+        ~render_service() {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                stopping = true;
+            }
+            queue_ready.notify_all();
+            for (size_t t = 0; t < pool.size(); t++)
+                pool[t].join();
+        }
+
+        /** Escucha en el socket Unix path hasta que llegue "shutdown" y se acaben los trabajos pendientes.
+          * @return Falso si no se ha podido crear el socket.
+          */
+        bool serve(const std::string& path) {
+            sockaddr_un addr;
+            if (path.size() >= sizeof(addr.sun_path))
+                return false;
+            listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listen_fd < 0)
+                return false;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strcpy(addr.sun_path, path.c_str());
+            unlink(path.c_str());
+            if (bind(listen_fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+                close(listen_fd);
+                return false;
+            }
+            fprintf(stderr, "listening on %s with %d threads\n", path.c_str(), int(pool.size()));
+            for (;;) {
+                int fd = accept(listen_fd, 0, 0);
+                if (fd < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                if (stopping_connections) {
+                    close(fd);
+                    break;
+                }
+                connections++;
+                std::thread(&render_service::talk, this, fd).detach();
+            }
+            close(listen_fd);
+            unlink(path.c_str());
+            // Las conexiones abiertas acaban de esperar a sus trabajos antes de salir.
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            connection_closed.wait(lock, [this] { return connections == 0; });
+            return true;
+        }
+
+    private:
+        /// Trabajo en curso: su película se reparte en un buffer por franja, que se suman en orden al acabar la última.
+        struct job {
+            int id;
+            render_request request;
+            render_scene scene;
+            camera *cam;
+            pixel_filter *filter;
+            film *image;
+            std::vector<int> samples;
+            std::vector<film_buffer *> bands;
+            std::atomic<int> remaining;
+            std::chrono::steady_clock::time_point start;
+            bool done;
+            std::string error;
+        };
+
+        /// Franja pendiente en la cola de los hilos.
+        struct task {
+            job *j;
+            int band;
+            /// Primero más prioridad, luego el trabajo más antiguo y luego la franja de más arriba.
+            bool operator<(const task& t) const {
+                if (j->request.priority != t.j->request.priority)
+                    return j->request.priority < t.j->request.priority;
+                if (j->id != t.j->id)
+                    return j->id > t.j->id;
+                return band > t.band;
+            }
+        };
+
+        /// Escena del nombre dado, de la caché o construida ahora; si otro trabajo la está construyendo, espera a ese.
+        render_scene scene(const std::string& name) {
+            std::shared_future<render_scene> f;
+            bool builder = false;
+            std::promise<render_scene> p;
+            {
+                std::lock_guard<std::mutex> lock(scene_mutex);
+                std::map<std::string, std::shared_future<render_scene> >::iterator it = scenes.find(name);
+                if (it == scenes.end()) {
+                    f = p.get_future().share();
+                    scenes[name] = f;
+                    builder = true;
+                }
+                else
+                    f = it->second;
+            }
+            if (builder) {
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                p.set_value(build(name));
+                fprintf(stderr, "scene %s built in %g s\n", name.c_str(),
+                        std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+            }
+            return f.get();
+        }
+
+        /// Crea el trabajo de la petición r y encola sus franjas.
+        job *submit(const render_request& r) {
+            job *j = new job;
+            j->request = r;
+            j->start = std::chrono::steady_clock::now();
+            j->scene = scene(r.scene);
+            // Misma relación de aspecto que el render normal, que la cámara interpreta como alto entre ancho.
+            j->cam = new camera(r.lookfrom, r.lookat, vec3(0, 1, 0), r.vfov, float(r.height) / float(r.width), 0, 10, 0, 1);
+            j->filter = make_filter(r.filter);
+            j->image = new film(j->filter, r.width, r.height);
+            j->samples.assign(r.width * r.height, 0);
+            int count = (r.height + band_rows - 1) / band_rows;
+            j->bands.assign(count, (film_buffer *) 0);
+            j->remaining = count;
+            j->done = false;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                j->id = next_id++;
+                for (int b = 0; b < count; b++) {
+                    task t = {j, b};
+                    tasks.push(t);
+                }
+            }
+            queue_ready.notify_all();
+            return j;
+        }
+
+        /// Bucle de cada hilo del conjunto: saca la franja más prioritaria y, si es la última de su trabajo, lo acaba.
+        void work() {
+            for (;;) {
+                task t;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                        return;
+                    t = tasks.top();
+                    tasks.pop();
+                    active++;
+                }
+                job *j = t.j;
+                const render_request& r = j->request;
+                int y0 = t.band * band_rows;
+                film_buffer *b = new film_buffer(j->image->tile(0, y0, r.width, std::min(r.height, y0 + band_rows)));
+                render(j->scene, r, j->cam, t.band, j->samples.data(), *b);
+                j->bands[t.band] = b;
+                if (--j->remaining == 0)
+                    finish(j);
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    active--;
+                }
+            }
+        }
+
+        /// Suma las franjas en orden, para que la imagen no dependa de qué hilo hizo cada una, y escribe el PPM.
+        void finish(job *j) {
+            for (size_t b = 0; b < j->bands.size(); b++) {
+                j->image->accumulate(*j->bands[b]);
+                delete j->bands[b];
+            }
+            std::vector<vec3> pixels = j->image->resolve();
+            // Se escribe aparte y se renombra, para que quien espere el fichero no lo lea a medias.
+            std::string tmp = j->request.output + ".tmp";
+            {
+                std::ofstream out(tmp.c_str());
+                write_ppm(out, pixels, j->request.width, j->request.height);
+                if (!out)
+                    j->error = "cannot write " + j->request.output;
+            }
+            if (j->error.empty() && rename(tmp.c_str(), j->request.output.c_str()) != 0)
+                j->error = "cannot write " + j->request.output;
+            if (!j->error.empty())
+                remove(tmp.c_str());
+            delete j->image;
+            delete j->filter;
+            delete j->cam;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                j->done = true;
+            }
+            job_done.notify_all();
+        }
+
+        /// Contesta una línea por el socket. @return Falso si el cliente se ha ido.
+        bool reply(int fd, const std::string& s) {
+            std::string line = s + "\n";
+            return send_all(fd, line.data(), line.size());
+        }
+
+        /// Atiende una conexión, línea a línea.
+        void talk(int fd) {
+            std::string buffer;
+            char chunk[512];
+            bool open = true;
+            while (open) {
+                size_t nl;
+                while ((nl = buffer.find('\n')) == std::string::npos) {
+                    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        break;
+                    buffer.append(chunk, n);
+                }
+                if (nl == std::string::npos)
+                    break;
+                std::string line = buffer.substr(0, nl);
+                buffer.erase(0, nl + 1);
+                open = command(fd, line);
+            }
+            close(fd);
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            connections--;
+            connection_closed.notify_all();
+        }
+
+        /// Ejecuta una orden. @return Falso si hay que cerrar la conexión.
+        bool command(int fd, const std::string& line) {
+            std::istringstream in(line);
+            std::string verb;
+            in >> verb;
+            if (verb == "render") {
+                render_request r;
+                std::string error;
+                if (!parse_request(line, r, error))
+                    return reply(fd, "error 0 " + error);
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    if (stopping_connections)
+                        return reply(fd, "error 0 shutting down");
+                }
+                job *j = submit(r);
+                bool open = reply(fd, "queued " + std::to_string(j->id));
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    job_done.wait(lock, [j] { return j->done; });
+                }
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - j->start).count();
+                std::string result = j->error.empty() ? "done " + std::to_string(j->id) + " " + std::to_string(seconds)
+                                                      : "error " + std::to_string(j->id) + " " + j->error;
+                fprintf(stderr, "%s\n", result.c_str());
+                delete j;
+                return open && reply(fd, result);
+            }
+            if (verb == "status") {
+                std::ostringstream s;
+                {
+                    std::lock_guard<std::mutex> lock(scene_mutex);
+                    s << "scenes " << scenes.size();
+                }
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                s << " queued " << tasks.size() << " running " << active << " threads " << pool.size();
+                return reply(fd, s.str());
+            }
+            if (verb == "shutdown") {
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    stopping_connections = true;
+                }
+                // Despierta al accept() de serve(), que deja de aceptar conexiones.
+                ::shutdown(listen_fd, SHUT_RDWR);
+                reply(fd, "bye");
+                return false;
+            }
+            return reply(fd, "error 0 unknown command " + verb);
+        }
+
+        scene_builder build;
+        band_renderer render;
+        int band_rows;
+        std::vector<std::thread> pool;
+
+        std::mutex scene_mutex;
+        std::map<std::string, std::shared_future<render_scene> > scenes;
+
+        /// Protege la cola, los contadores y el estado de los trabajos.
+        std::mutex queue_mutex;
+        std::condition_variable queue_ready, job_done, connection_closed;
+        std::priority_queue<task> tasks;
+        int next_id;
+        bool stopping, stopping_connections;
+        int listen_fd, active, connections;
+};
+#endif
+
+#endif
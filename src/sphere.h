@@ -14,6 +14,7 @@
 #include "hittable.h"
 #include "onb.h"
 #include "pdf.h"
+#include "stats.h"
 
 
 class sphere: public hittable  {
@@ -21,6 +22,8 @@ class sphere: public hittable  {
         sphere() {}
         sphere(vec3 cen, float r, material *m) : center(cen), radius(r), mat_ptr(m)  {};
         virtual bool hit(const ray& r, float tmin, float tmax, hit_record& rec) const;
+        virtual bool intersect(const ray& r, float tmin, float tmax, hit_query& q) const;
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
         virtual bool bounding_box(float t0, float t1, aabb& box) const;
         virtual float  pdf_value(const vec3& o, const vec3& v) const;
         virtual vec3 random(const vec3& o);
@@ -30,8 +33,7 @@ class sphere: public hittable  {
 };
 
 float sphere::pdf_value(const vec3& o, const vec3& v) const {
-    hit_record rec;
-    if (this->hit(ray(o, v), 0.001, FLT_MAX, rec)) {
+    if (this->occluded(ray(o, v), 0.001, FLT_MAX)) {
         float cos_theta_max = sqrt(1 - radius*radius/(center-o).squared_length());
         float solid_angle = 2*M_PI*(1-cos_theta_max);
         return  1 / solid_angle;
@@ -41,6 +43,7 @@ float sphere::pdf_value(const vec3& o, const vec3& v) const {
 }
 
 vec3 sphere::random(const vec3& o) {
+     STAT_INC(light_samples[stat_light_sphere]);
      vec3 direction = center - o;
      float distance_squared = direction.squared_length();
      onb uvw;
@@ -55,33 +58,38 @@ bool sphere::bounding_box(float t0, float t1, aabb& box) const {
 }
 
 bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+bool sphere::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
     vec3 oc = r.origin() - center;
     float a = dot(r.direction(), r.direction());
     float b = dot(oc, r.direction());
     float c = dot(oc, oc) - radius*radius;
     float discriminant = b*b - a*c;
     if (discriminant > 0) {
-        float temp = (-b - sqrt(b*b-a*c))/a;
+        float sq = sqrt(discriminant);
+        float temp = (-b - sq)/a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            set_query(q, temp, this);
             return true;
         }
-        temp = (-b + sqrt(b*b-a*c))/a;
+        temp = (-b + sq)/a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
-            rec.normal = (rec.p - center) / radius;
-            rec.mat_ptr = mat_ptr;
+            set_query(q, temp, this);
             return true;
         }
     }
     return false;
 }
 
+void sphere::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    rec.t = q.t;
+    rec.p = r.point_at_parameter(rec.t);
+    get_sphere_uv((rec.p-center)/radius, rec.u, rec.v);
+    rec.normal = (rec.p - center) / radius;
+    rec.mat_ptr = mat_ptr;
+}
+
 
 #endif
@@ -0,0 +1,141 @@
+#ifndef STATSH
+#define STATSH
+
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+/** Estadísticas de rendimiento del render: rayos por tipo, nodos del BVH visitados, pruebas de intersección por tipo de
+  * primitiva, longitud de los caminos y muestras de luz por clase de luz.
+  * Sólo existen si se compila con -DRENDER_STATS. Sin esa macro las macros STAT_* no generan código, así que el
+  * ejecutable normal no paga nada por ellas.
+  */
+
+/// Tipos de primitiva para las pruebas de intersección. Los que no tienen tipo propio en flat_scene cuentan como otros.
+enum stat_prim { stat_sphere, stat_rect, stat_ellipse, stat_triangle, stat_other, stat_prim_count };
+/// Clases de luz cuyo random() se cuenta.
+enum stat_light { stat_light_sphere, stat_light_xz_rect, stat_light_xz_rect_sa, stat_light_ellipse, stat_light_ellipse_sa,
+                  stat_light_count };
+/// Los caminos de más rebotes se cuentan en la última casilla del histograma.
+const int stat_max_depth = 64;
+
+#ifdef RENDER_STATS
+
+/// Contadores de un hilo. Cada hilo suma en los suyos sin sincronizarse con nadie.
+struct render_stats {
+    uint64_t primary_rays, secondary_rays, shadow_rays;
+    uint64_t node_visits;
+    uint64_t prim_tests[stat_prim_count];
+    uint64_t path_length[stat_max_depth + 1];
+    uint64_t light_samples[stat_light_count];
+
+    render_stats() { clear(); }
+    void clear() { memset(this, 0, sizeof(*this)); }
+    void add(const render_stats& s) {
+        const uint64_t *src = (const uint64_t *) &s;
+        uint64_t *dst = (uint64_t *) this;
+        for (size_t i = 0; i < sizeof(*this)/sizeof(uint64_t); i++)
+            dst[i] += src[i];
+    }
+};
+
+/** Registro de los contadores de todos los hilos. Al terminar un hilo sus contadores se suman a retired, así que
+  * total() no pierde nada aunque el hilo ya no exista.
+  */
+struct stats_registry {
+    std::mutex lock;
+    std::vector<render_stats *> live;
+    render_stats retired;
+
+    static stats_registry& get() {
+        static stats_registry r;
+        return r;
+    }
+    render_stats total() {
+        std::lock_guard<std::mutex> guard(lock);
+        render_stats t = retired;
+        for (size_t i = 0; i < live.size(); i++)
+            t.add(*live[i]);
+        return t;
+    }
+};
+
+/// Contadores del hilo actual, que se apuntan en el registro la primera vez que se usan.
+struct thread_stats_slot {
+    render_stats stats;
+    thread_stats_slot() {
+        stats_registry& r = stats_registry::get();
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.live.push_back(&stats);
+    }
+    ~thread_stats_slot() {
+        stats_registry& r = stats_registry::get();
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.retired.add(stats);
+        for (size_t i = 0; i < r.live.size(); i++)
+            if (r.live[i] == &stats) {
+                r.live.erase(r.live.begin() + i);
+                break;
+            }
+    }
+};
+
+inline render_stats& thread_stats() {
+    static thread_local thread_stats_slot slot;
+    return slot.stats;
+}
+
+#define STAT_ADD(field, n) (thread_stats().field += (n))
+#define STAT_PATH(depth) (thread_stats().path_length[(depth) < stat_max_depth ? (depth) : stat_max_depth]++)
+
+/** Escribe en JSON la suma de los contadores de todos los hilos.
+  * @param os Flujo de salida.
+  * @param seconds Tiempo del render, para los rayos por segundo.
+  */
+void write_stats_json(std::ostream& os, double seconds) {
+    static const char *prim_names[stat_prim_count] = {"sphere", "rect", "ellipse", "triangle", "other"};
+    static const char *light_names[stat_light_count] = {"sphere", "xz_rect", "xz_rect_sa", "ellipse", "ellipse_sa"};
+    render_stats s = stats_registry::get().total();
+    uint64_t rays = s.primary_rays + s.secondary_rays + s.shadow_rays;
+    uint64_t paths = 0, bounces = 0;
+    int last = 0;
+    for (int d = 0; d <= stat_max_depth; d++) {
+        paths += s.path_length[d];
+        bounces += uint64_t(d) * s.path_length[d];
+        if (s.path_length[d])
+            last = d;
+    }
+    os << "{\n";
+    os << "  \"seconds\": " << seconds << ",\n";
+    os << "  \"rays\": {\"primary\": " << s.primary_rays << ", \"secondary\": " << s.secondary_rays
+       << ", \"shadow\": " << s.shadow_rays << ", \"total\": " << rays << "},\n";
+    os << "  \"rays_per_second\": " << (seconds > 0 ? rays / seconds : 0) << ",\n";
+    os << "  \"node_visits\": " << s.node_visits << ",\n";
+    os << "  \"node_visits_per_ray\": " << (rays ? double(s.node_visits) / rays : 0) << ",\n";
+    os << "  \"primitive_tests\": {";
+    for (int p = 0; p < stat_prim_count; p++)
+        os << (p ? ", " : "") << "\"" << prim_names[p] << "\": " << s.prim_tests[p];
+    os << "},\n";
+    os << "  \"light_samples\": {";
+    for (int l = 0; l < stat_light_count; l++)
+        os << (l ? ", " : "") << "\"" << light_names[l] << "\": " << s.light_samples[l];
+    os << "},\n";
+    os << "  \"paths\": " << paths << ",\n";
+    os << "  \"mean_path_length\": " << (paths ? double(bounces) / paths : 0) << ",\n";
+    // Número de caminos que terminan tras d rebotes, hasta el último d con alguno; el último valor posible junta todos los demás.
+    os << "  \"path_length_histogram\": [";
+    for (int d = 0; d <= last; d++)
+        os << (d ? ", " : "") << s.path_length[d];
+    os << "]\n";
+    os << "}\n";
+}
+
+#else
+#define STAT_ADD(field, n) ((void) 0)
+#define STAT_PATH(depth) ((void) 0)
+#endif
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+#endif
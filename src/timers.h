@@ -0,0 +1,261 @@
+#ifndef TIMERSH
+#define TIMERSH
+
+/** Temporizadores por fases del render. Cada TIME_SCOPE mide el tiempo de su bloque y lo acumula en un árbol por hilo,
+  * colgado del temporizador que lo contiene, así que el informe sale jerárquico: por ejemplo render > intersect.
+  * TRACE_SCOPE además guarda cada ejecución como evento para el fichero de traza (formato de Chrome, chrome://tracing o
+  * Perfetto), así que sólo se usa en fases gruesas. TIMED(nombre, expresión) mide una sola expresión.
+  * Como las estadísticas, sólo existen si se compila con -DRENDER_TIMERS; si no, las macros no generan código.
+  */
+
+#ifdef RENDER_TIMERS
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/// Marca de tiempo barata: el contador de ciclos en x86 y steady_clock en nanosegundos en el resto.
+inline uint64_t timer_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/// Nodo del árbol de un hilo: un temporizador dentro de su padre, con el tiempo y el número de veces que se ha ejecutado.
+struct timer_node {
+    const char *name;
+    int parent;
+    uint64_t ticks, count;
+};
+
+/// Evento de la traza: un TRACE_SCOPE de principio a fin.
+struct trace_event {
+    const char *name;
+    uint64_t start, duration;
+};
+
+/// Árbol y eventos de un hilo. El nodo 0 es la raíz, sin nombre.
+struct thread_timers {
+    std::vector<timer_node> nodes;
+    std::vector<trace_event> events;
+    int current;
+    int thread_id;
+};
+
+/** Temporizadores de todos los hilos. También guarda el instante inicial con los dos relojes, para pasar de ticks a
+  * segundos al final sin suponer la frecuencia del contador.
+  */
+struct timers_registry {
+    std::mutex lock;
+    std::vector<thread_timers *> live;
+    std::vector<thread_timers> retired;
+    int next_thread_id;
+    bool tracing;
+    uint64_t start_ticks;
+    std::chrono::steady_clock::time_point start_time;
+
+    timers_registry() : next_thread_id(0), tracing(false), start_ticks(timer_ticks()), start_time(std::chrono::steady_clock::now()) {}
+    static timers_registry& get() {
+        static timers_registry r;
+        return r;
+    }
+    /// Segundos por tick, medidos desde que se creó el registro.
+    double seconds_per_tick() {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        uint64_t ticks = timer_ticks() - start_ticks;
+        return ticks > 0 ? seconds / ticks : 0;
+    }
+    /// Copia de los árboles de todos los hilos, vivos y terminados.
+    std::vector<thread_timers> snapshot() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<thread_timers> all = retired;
+        for (size_t i = 0; i < live.size(); i++)
+            all.push_back(*live[i]);
+        return all;
+    }
+};
+
+/// Árbol del hilo actual, que se apunta en el registro la primera vez que se usa y se copia en él al terminar el hilo.
+struct thread_timers_slot {
+    thread_timers timers;
+    thread_timers_slot() {
+        timer_node root = {"", -1, 0, 0};
+        timers.nodes.push_back(root);
+        timers.current = 0;
+        timers_registry& r = timers_registry::get();
+        std::lock_guard<std::mutex> guard(r.lock);
+        timers.thread_id = r.next_thread_id++;
+        r.live.push_back(&timers);
+    }
+    ~thread_timers_slot() {
+        timers_registry& r = timers_registry::get();
+        std::lock_guard<std::mutex> guard(r.lock);
+        r.retired.push_back(timers);
+        for (size_t i = 0; i < r.live.size(); i++)
+            if (r.live[i] == &timers) {
+                r.live.erase(r.live.begin() + i);
+                break;
+            }
+    }
+};
+
+inline thread_timers& current_timers() {
+    static thread_local thread_timers_slot slot;
+    return slot.timers;
+}
+
+/// Temporizador RAII: mide desde su construcción hasta que sale de su bloque.
+class scoped_timer {
+    public:
+        scoped_timer(const char *name, bool trace = false) : t(current_timers()), trace_event(trace && timers_registry::get().tracing) {
+            parent = t.current;
+            // Un nodo tiene pocos hijos, así que se buscan por nombre recorriendo el árbol desde el padre hacia delante.
+            node = -1;
+            for (size_t i = parent + 1; i < t.nodes.size(); i++)
+                if (t.nodes[i].parent == parent && (t.nodes[i].name == name || strcmp(t.nodes[i].name, name) == 0)) {
+                    node = i;
+                    break;
+                }
+            if (node < 0) {
+                timer_node n = {name, parent, 0, 0};
+                t.nodes.push_back(n);
+                node = t.nodes.size() - 1;
+            }
+            t.current = node;
+            start = timer_ticks();
+        }
+        ~scoped_timer() {
+            uint64_t elapsed = timer_ticks() - start;
+            t.nodes[node].ticks += elapsed;
+            t.nodes[node].count++;
+            t.current = parent;
+            if (trace_event) {
+                struct trace_event e = {t.nodes[node].name, start, elapsed};
+                t.events.push_back(e);
+            }
+        }
+
+    private:
+        thread_timers& t;
+        bool trace_event;
+        int parent, node;
+        uint64_t start;
+};
+
+#define TIMER_CONCAT2(a, b) a##b
+#define TIMER_CONCAT(a, b) TIMER_CONCAT2(a, b)
+#define TIME_SCOPE(name) scoped_timer TIMER_CONCAT(scoped_timer_, __LINE__)(name)
+#define TRACE_SCOPE(name) scoped_timer TIMER_CONCAT(scoped_timer_, __LINE__)(name, true)
+#define TIMED(name, expr) ([&]() { TIME_SCOPE(name); return (expr); }())
+
+/// Nodo del árbol que junta los de todos los hilos.
+struct timer_report_node {
+    const char *name;
+    double seconds;
+    uint64_t count;
+    std::vector<int> children;
+};
+
+/// Suma el subárbol del nodo n de t en el nodo m del árbol conjunto, emparejando los hijos por nombre.
+void merge_timer_tree(const thread_timers& t, int n, std::vector<timer_report_node>& merged, int m, double seconds_per_tick) {
+    for (size_t i = n + 1; i < t.nodes.size(); i++) {
+        if (t.nodes[i].parent != n)
+            continue;
+        int child = -1;
+        for (size_t k = 0; k < merged[m].children.size(); k++)
+            if (strcmp(merged[merged[m].children[k]].name, t.nodes[i].name) == 0)
+                child = merged[m].children[k];
+        if (child < 0) {
+            timer_report_node c = {t.nodes[i].name, 0, 0, std::vector<int>()};
+            merged.push_back(c);
+            child = merged.size() - 1;
+            merged[m].children.push_back(child);
+        }
+        merged[child].seconds += t.nodes[i].ticks * seconds_per_tick;
+        merged[child].count += t.nodes[i].count;
+        merge_timer_tree(t, i, merged, child, seconds_per_tick);
+    }
+}
+
+void print_timer_node(std::ostream& os, const std::vector<timer_report_node>& merged, int n, int depth, double parent_seconds) {
+    const timer_report_node& node = merged[n];
+    os << std::string(2*depth, ' ') << std::left << std::setw(std::max(1, 28 - 2*depth)) << node.name << std::right
+       << std::fixed << std::setprecision(4) << std::setw(12) << node.seconds
+       << std::setprecision(1) << std::setw(8) << (parent_seconds > 0 ? 100*node.seconds/parent_seconds : 0.0) << "%"
+       << std::setw(14) << node.count << "\n";
+    double children = 0;
+    for (size_t k = 0; k < node.children.size(); k++) {
+        print_timer_node(os, merged, node.children[k], depth + 1, node.seconds);
+        children += merged[node.children[k]].seconds;
+    }
+    // Lo que no cubre ningún hijo se muestra aparte, para que cada nivel sume el 100%.
+    if (!node.children.empty() && node.seconds > children)
+        os << std::string(2*depth + 2, ' ') << std::left << std::setw(std::max(1, 26 - 2*depth)) << "(resto)" << std::right
+           << std::fixed << std::setprecision(4) << std::setw(12) << node.seconds - children
+           << std::setprecision(1) << std::setw(8) << 100*(node.seconds - children)/node.seconds << "%\n";
+}
+
+/** Escribe el desglose jerárquico de tiempos, sumando todos los hilos: segundos, porcentaje sobre el padre y número de
+  * ejecuciones de cada temporizador.
+  */
+void write_timer_report(std::ostream& os) {
+    timers_registry& r = timers_registry::get();
+    double spt = r.seconds_per_tick();
+    std::vector<thread_timers> all = r.snapshot();
+    std::vector<timer_report_node> merged(1);
+    merged[0].name = "total";
+    merged[0].seconds = 0;
+    merged[0].count = 0;
+    for (size_t i = 0; i < all.size(); i++)
+        merge_timer_tree(all[i], 0, merged, 0, spt);
+    os << std::left << std::setw(28) << "fase" << std::right << std::setw(12) << "segundos" << std::setw(9) << "%"
+       << std::setw(14) << "veces" << "\n";
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    // Las fases de primer nivel no tienen padre: su porcentaje es sobre la suma de todas ellas.
+    for (size_t k = 0; k < merged[0].children.size(); k++)
+        merged[0].seconds += merged[merged[0].children[k]].seconds;
+    for (size_t k = 0; k < merged[0].children.size(); k++)
+        print_timer_node(os, merged, merged[0].children[k], 0, merged[0].seconds);
+    os.flags(flags);
+    os.precision(precision);
+}
+
+/// Escribe los eventos de TRACE_SCOPE en el formato JSON de eventos de traza de Chrome, con tiempos en microsegundos.
+void write_chrome_trace(std::ostream& os) {
+    timers_registry& r = timers_registry::get();
+    double us_per_tick = 1e6 * r.seconds_per_tick();
+    std::vector<thread_timers> all = r.snapshot();
+    os << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    std::ios::fmtflags flags = os.flags();
+    os << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < all.size(); i++)
+        for (size_t k = 0; k < all[i].events.size(); k++) {
+            const trace_event& e = all[i].events[k];
+            os << (first ? "" : ",\n") << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << all[i].thread_id
+               << ", \"ts\": " << (e.start - r.start_ticks) * us_per_tick << ", \"dur\": " << e.duration * us_per_tick << "}";
+            first = false;
+        }
+    os << "\n]}\n";
+    os.flags(flags);
+}
+
+#else
+#define TIME_SCOPE(name) ((void) 0)
+#define TRACE_SCOPE(name) ((void) 0)
+#define TIMED(name, expr) (expr)
+#endif
+
+#endif
@@ -0,0 +1,425 @@
+#ifndef TRIANGLEMESHH
+#define TRIANGLEMESHH
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include "hittable.h"
+#include "stats.h"
+
+/** Nodo del BVH plano de una malla. Ocupa 32 bytes, así que dos nodos caben en una línea de caché.
+  * Los nodos se guardan en profundidad: el hijo izquierdo de un nodo interior es el siguiente nodo del vector.
+  */
+struct mesh_bvh_node {
+    float bmin[3];
+    /// En nodos interiores, índice del hijo derecho. En hojas, primer triángulo de la hoja.
+    uint32_t offset;
+    float bmax[3];
+    /// Número de triángulos de la hoja, o 0 si el nodo es interior.
+    uint32_t count;
+};
+
+/** Buffers de una malla indexada: posiciones, normales y coordenadas uv en vectores planos, índices de 32 bits y el BVH.
+  * Normales y uv son opcionales (vectores vacíos).
+  */
+struct mesh_buffers {
+    std::vector<float> positions;
+    std::vector<float> normals;
+    std::vector<float> uvs;
+    std::vector<uint32_t> indices;
+    std::vector<mesh_bvh_node> nodes;
+    uint32_t vertex_count() const { return positions.size() / 3; }
+    uint32_t triangle_count() const { return indices.size() / 3; }
+};
+
+/// Número máximo de triángulos en una hoja del BVH de la malla.
+const int mesh_leaf_size = 4;
+/// Número de cubetas usadas para evaluar la heurística de área (SAH) en cada corte.
+const int mesh_sah_bins = 16;
+
+/// Datos temporales de la construcción del BVH: cajas y centroides de cada triángulo.
+struct mesh_build_data {
+    std::vector<aabb> boxes;
+    std::vector<vec3> centroids;
+    std::vector<uint32_t> order;
+};
+
+/** Construye recursivamente el subárbol de los elementos order[begin, end) y devuelve el índice de su nodo.
+  * No depende de que los elementos sean triángulos: sólo usa sus cajas y centroides.
+  */
+uint32_t build_mesh_bvh_node(mesh_build_data& d, std::vector<mesh_bvh_node>& nodes, uint32_t begin, uint32_t end, int depth,
+                             int leaf_size = mesh_leaf_size) {
+    uint32_t index = nodes.size();
+    nodes.push_back(mesh_bvh_node());
+    aabb box = d.boxes[d.order[begin]];
+    vec3 cmin = d.centroids[d.order[begin]], cmax = cmin;
+    for (uint32_t i = begin + 1; i < end; i++) {
+        box = surrounding_box(box, d.boxes[d.order[i]]);
+        const vec3& c = d.centroids[d.order[i]];
+        for (int a = 0; a < 3; a++) {
+            cmin[a] = ffmin(cmin[a], c[a]);
+            cmax[a] = ffmax(cmax[a], c[a]);
+        }
+    }
+    for (int a = 0; a < 3; a++) {
+        nodes[index].bmin[a] = box.min()[a];
+        nodes[index].bmax[a] = box.max()[a];
+    }
+    uint32_t n = end - begin;
+    int axis = aabb(cmin, cmax).longest_axis();
+    float extent = cmax[axis] - cmin[axis];
+    if (n <= uint32_t(leaf_size) || extent <= 0) {
+        nodes[index].offset = begin;
+        nodes[index].count = n;
+        return index;
+    }
+
+    uint32_t mid = begin + n/2;
+    if (depth < 48) {
+        // SAH con cubetas a lo largo del eje más largo de los centroides.
+        int bin_count[mesh_sah_bins] = {0};
+        aabb bin_box[mesh_sah_bins];
+        float scale = mesh_sah_bins / extent;
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t t = d.order[i];
+            int b = std::min(mesh_sah_bins - 1, int((d.centroids[t][axis] - cmin[axis]) * scale));
+            bin_box[b] = bin_count[b]++ ? surrounding_box(bin_box[b], d.boxes[t]) : d.boxes[t];
+        }
+        float right_area[mesh_sah_bins];
+        int right_count[mesh_sah_bins];
+        aabb acc;
+        int count = 0;
+        for (int b = mesh_sah_bins - 1; b > 0; b--) {
+            if (bin_count[b])
+                acc = count ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            count += bin_count[b];
+            right_count[b] = count;
+            right_area[b] = count ? acc.area() : 0;
+        }
+        float best_cost = FLT_MAX;
+        int best_split = -1;
+        count = 0;
+        for (int b = 0; b < mesh_sah_bins - 1; b++) {
+            if (bin_count[b])
+                acc = count ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+            count += bin_count[b];
+            if (count == 0 || right_count[b+1] == 0)
+                continue;
+            float cost = count*acc.area() + right_count[b+1]*right_area[b+1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+        if (best_split >= 0 && best_cost < n*box.area()) {
+            uint32_t *first = &d.order[begin], *last = &d.order[0] + end;
+            uint32_t *m = std::partition(first, last, [&](uint32_t t) {
+                return std::min(mesh_sah_bins - 1, int((d.centroids[t][axis] - cmin[axis]) * scale)) <= best_split;
+            });
+            mid = m - &d.order[0];
+        }
+        else if (n <= 4*uint32_t(leaf_size)) {
+            nodes[index].offset = begin;
+            nodes[index].count = n;
+            return index;
+        }
+    }
+    if (mid == begin || mid == end) {
+        // Corte por la mediana, que siempre produce un árbol equilibrado.
+        mid = begin + n/2;
+        std::nth_element(&d.order[begin], &d.order[mid], &d.order[0] + end, [&](uint32_t a, uint32_t b) {
+            return d.centroids[a][axis] < d.centroids[b][axis];
+        });
+    }
+    build_mesh_bvh_node(d, nodes, begin, mid, depth + 1, leaf_size);
+    uint32_t right = build_mesh_bvh_node(d, nodes, mid, end, depth + 1, leaf_size);
+    nodes[index].offset = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+/** Construye el BVH de la malla sobre índices de triángulos. Los triángulos se reordenan en el buffer de índices
+  * para que cada hoja apunte a un rango contiguo.
+  * @param m Buffers de la malla. Se rellena m.nodes y se permuta m.indices.
+  */
+void build_mesh_bvh(mesh_buffers& m) {
+    uint32_t n = m.triangle_count();
+    m.nodes.clear();
+    if (n == 0)
+        return;
+    mesh_build_data d;
+    d.boxes.resize(n);
+    d.centroids.resize(n);
+    d.order.resize(n);
+    const float *p = &m.positions[0];
+    for (uint32_t t = 0; t < n; t++) {
+        const float *a = p + 3*m.indices[3*t], *b = p + 3*m.indices[3*t+1], *c = p + 3*m.indices[3*t+2];
+        vec3 lo(ffmin(a[0], ffmin(b[0], c[0])), ffmin(a[1], ffmin(b[1], c[1])), ffmin(a[2], ffmin(b[2], c[2])));
+        vec3 hi(ffmax(a[0], ffmax(b[0], c[0])), ffmax(a[1], ffmax(b[1], c[1])), ffmax(a[2], ffmax(b[2], c[2])));
+        d.boxes[t] = aabb(lo, hi);
+        d.centroids[t] = 0.5*(lo + hi);
+        d.order[t] = t;
+    }
+    m.nodes.reserve(2*(n/mesh_leaf_size) + 1);
+    build_mesh_bvh_node(d, m.nodes, 0, n, 0);
+    std::vector<uint32_t> sorted(3*n);
+    for (uint32_t i = 0; i < n; i++)
+        for (int k = 0; k < 3; k++)
+            sorted[3*i+k] = m.indices[3*d.order[i]+k];
+    m.indices.swap(sorted);
+}
+
+/** Datos del rayo precalculados para el test de intersección estanco de Woop, Benthin y Wald (2013).
+  * Se permutan los ejes para que kz sea la dimensión dominante de la dirección y se cizalla el espacio para que el rayo sea el eje Z.
+  */
+struct watertight_ray {
+    watertight_ray() {}
+    watertight_ray(const ray& r) {
+        vec3 d = r.direction();
+        kz = 0;
+        if (fabs(d[1]) > fabs(d[kz])) kz = 1;
+        if (fabs(d[2]) > fabs(d[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+        Sx = d[kx] / d[kz];
+        Sy = d[ky] / d[kz];
+        Sz = 1.0f / d[kz];
+        o = r.origin();
+        for (int a = 0; a < 3; a++)
+            inv_dir[a] = 1.0f / d[a];
+    }
+    int kx, ky, kz;
+    float Sx, Sy, Sz;
+    vec3 o;
+    float inv_dir[3];
+};
+
+/** Intersección estanca rayo-triángulo: no hay huecos entre triángulos que comparten arista, ni dobles impactos.
+   * @return Verdadero si hay intersección en (t_min, t_max). En t, b1 y b2 se devuelven el parámetro y las coordenadas baricéntricas de v1 y v2.
+   */
+inline bool intersect_triangle(const watertight_ray& wr, const float *v0, const float *v1, const float *v2,
+                               float t_min, float t_max, float& t, float& b1, float& b2) {
+    const vec3& o = wr.o;
+    float A[3] = {v0[0] - o[0], v0[1] - o[1], v0[2] - o[2]};
+    float B[3] = {v1[0] - o[0], v1[1] - o[1], v1[2] - o[2]};
+    float C[3] = {v2[0] - o[0], v2[1] - o[1], v2[2] - o[2]};
+    float Ax = A[wr.kx] - wr.Sx*A[wr.kz], Ay = A[wr.ky] - wr.Sy*A[wr.kz];
+    float Bx = B[wr.kx] - wr.Sx*B[wr.kz], By = B[wr.ky] - wr.Sy*B[wr.kz];
+    float Cx = C[wr.kx] - wr.Sx*C[wr.kz], Cy = C[wr.ky] - wr.Sy*C[wr.kz];
+    float U = Cx*By - Cy*Bx;
+    float V = Ax*Cy - Ay*Cx;
+    float W = Bx*Ay - By*Ax;
+    if (U == 0 || V == 0 || W == 0) {
+        // Caso límite sobre una arista: se repite en doble precisión para que la decisión sea consistente.
+        U = float(double(Cx)*double(By) - double(Cy)*double(Bx));
+        V = float(double(Ax)*double(Cy) - double(Ay)*double(Cx));
+        W = float(double(Bx)*double(Ay) - double(By)*double(Ax));
+    }
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+        return false;
+    float det = U + V + W;
+    if (det == 0)
+        return false;
+    float Az = wr.Sz*A[wr.kz], Bz = wr.Sz*B[wr.kz], Cz = wr.Sz*C[wr.kz];
+    float T = U*Az + V*Bz + W*Cz;
+    float inv_det = 1.0f / det;
+    t = T*inv_det;
+    if (t <= t_min || t >= t_max)
+        return false;
+    b1 = V*inv_det;
+    b2 = W*inv_det;
+    return true;
+}
+
+/// Test rayo-caja con la inversa de la dirección precalculada. Devuelve la distancia de entrada en t_enter.
+inline bool hit_node_box(const watertight_ray& wr, const mesh_bvh_node& n, float t_min, float t_max, float& t_enter) {
+    for (int a = 0; a < 3; a++) {
+        float t0 = (n.bmin[a] - wr.o[a]) * wr.inv_dir[a];
+        float t1 = (n.bmax[a] - wr.o[a]) * wr.inv_dir[a];
+        if (wr.inv_dir[a] < 0)
+            std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min)
+            return false;
+    }
+    t_enter = t_min;
+    return true;
+}
+
+/** Malla de triángulos indexada. Es un único hittable: los triángulos no son objetos, sino índices dentro de buffers planos,
+  * y el BVH se construye sobre esos índices. Los buffers pueden ser propios (storage) o externos, por ejemplo proyectados en memoria.
+  */
+class triangle_mesh: public hittable  {
+    public:
+        triangle_mesh() {}
+        /// Constructor que toma posesión de los buffers y construye el BVH si no lo traen ya.
+        triangle_mesh(mesh_buffers& data, material *m) : mat_ptr(m) {
+            storage.positions.swap(data.positions);
+            storage.normals.swap(data.normals);
+            storage.uvs.swap(data.uvs);
+            storage.indices.swap(data.indices);
+            storage.nodes.swap(data.nodes);
+            if (storage.nodes.empty())
+                build_mesh_bvh(storage);
+            set_views(storage.positions.empty() ? 0 : &storage.positions[0],
+                      storage.normals.empty() ? 0 : &storage.normals[0],
+                      storage.uvs.empty() ? 0 : &storage.uvs[0],
+                      storage.vertex_count(),
+                      storage.indices.empty() ? 0 : &storage.indices[0],
+                      storage.triangle_count(),
+                      storage.nodes.empty() ? 0 : &storage.nodes[0],
+                      storage.nodes.size());
+        }
+        /// Constructor sobre buffers externos ya preparados, con el BVH construido. No copia nada.
+        triangle_mesh(const float *p, const float *n, const float *uv, uint32_t nv,
+                      const uint32_t *idx, uint32_t nt, const mesh_bvh_node *nd, uint32_t nn, material *m) : mat_ptr(m) {
+            set_views(p, n, uv, nv, idx, nt, nd, nn);
+        }
+        /// Recorre el BVH de la malla y se queda con el triángulo más cercano.
+        virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+        /// Igual que hit, pero sólo apunta el triángulo y las coordenadas baricéntricas.
+        virtual bool intersect(const ray& r, float t_min, float t_max, hit_query& q) const;
+        /// Interpola normal y uv del triángulo apuntado por intersect.
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
+        virtual bool bounding_box(float t0, float t1, aabb& box) const {
+            if (node_count == 0)
+                return false;
+            box = aabb(vec3(nodes[0].bmin[0], nodes[0].bmin[1], nodes[0].bmin[2]),
+                       vec3(nodes[0].bmax[0], nodes[0].bmax[1], nodes[0].bmax[2]));
+            return true;
+        }
+        /** Busca el triángulo más cercano sin rellenar el hit_record. Devuelve su índice, o -1 si no hay impacto.
+           * Con any_hit devuelve el primer triángulo que encuentra, aunque no sea el más cercano.
+           */
+        int closest_triangle(const ray& r, float t_min, float& t_max, float& b1, float& b2, bool any_hit = false) const;
+        virtual bool occluded(const ray& r, float t_min, float t_max) const {
+            float b1, b2;
+            return closest_triangle(r, t_min, t_max, b1, b2, true) >= 0;
+        }
+        /// Rellena el hit_record del triángulo tri a partir del parámetro y las coordenadas baricéntricas.
+        void fill_record(const ray& r, int tri, float t, float b1, float b2, hit_record& rec) const;
+
+        void set_views(const float *p, const float *n, const float *uv, uint32_t nv,
+                       const uint32_t *idx, uint32_t nt, const mesh_bvh_node *nd, uint32_t nn) {
+            positions = p; normals = n; uvs = uv; vertex_count = nv;
+            indices = idx; triangle_count = nt; nodes = nd; node_count = nn;
+        }
+
+        /// Vistas sobre los buffers de la malla.
+        const float *positions, *normals, *uvs;
+        const uint32_t *indices;
+        const mesh_bvh_node *nodes;
+        uint32_t vertex_count, triangle_count, node_count;
+        /// Buffers propios, vacíos si los datos son externos.
+        mesh_buffers storage;
+        material *mat_ptr;
+};
+
+int triangle_mesh::closest_triangle(const ray& r, float t_min, float& t_max, float& b1, float& b2, bool any_hit) const {
+    if (node_count == 0)
+        return -1;
+    watertight_ray wr(r);
+    int best = -1;
+    uint32_t stack[128];
+    int top = 0;
+    float t_enter;
+    if (!hit_node_box(wr, nodes[0], t_min, t_max, t_enter))
+        return -1;
+    stack[top++] = 0;
+    while (top > 0) {
+        const mesh_bvh_node& n = nodes[stack[--top]];
+        STAT_INC(node_visits);
+        if (n.count > 0) {
+            STAT_ADD(prim_tests[stat_triangle], n.count);
+            for (uint32_t i = n.offset; i < n.offset + n.count; i++) {
+                const uint32_t *tri = indices + 3*i;
+                float t, u, v;
+                if (intersect_triangle(wr, positions + 3*tri[0], positions + 3*tri[1], positions + 3*tri[2], t_min, t_max, t, u, v)) {
+                    t_max = t;
+                    b1 = u;
+                    b2 = v;
+                    best = i;
+                    if (any_hit)
+                        return best;
+                }
+            }
+        }
+        else {
+            uint32_t left = &n - nodes + 1, right = n.offset;
+            float t_left, t_right;
+            bool hit_left = hit_node_box(wr, nodes[left], t_min, t_max, t_left);
+            bool hit_right = hit_node_box(wr, nodes[right], t_min, t_max, t_right);
+            // Se apila primero el hijo más lejano para visitar antes el más cercano.
+            if (hit_left && hit_right) {
+                if (t_left < t_right) {
+                    stack[top++] = right;
+                    stack[top++] = left;
+                }
+                else {
+                    stack[top++] = left;
+                    stack[top++] = right;
+                }
+            }
+            else if (hit_left)
+                stack[top++] = left;
+            else if (hit_right)
+                stack[top++] = right;
+        }
+    }
+    return best;
+}
+
+void triangle_mesh::fill_record(const ray& r, int tri, float t, float b1, float b2, hit_record& rec) const {
+    const uint32_t *idx = indices + 3*tri;
+    float b0 = 1 - b1 - b2;
+    rec.t = t;
+    rec.p = r.point_at_parameter(t);
+    rec.mat_ptr = mat_ptr;
+    if (normals) {
+        const float *n0 = normals + 3*idx[0], *n1 = normals + 3*idx[1], *n2 = normals + 3*idx[2];
+        rec.normal = unit_vector(vec3(b0*n0[0] + b1*n1[0] + b2*n2[0],
+                                      b0*n0[1] + b1*n1[1] + b2*n2[1],
+                                      b0*n0[2] + b1*n1[2] + b2*n2[2]));
+    }
+    else {
+        const float *p0 = positions + 3*idx[0], *p1 = positions + 3*idx[1], *p2 = positions + 3*idx[2];
+        vec3 e1(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+        vec3 e2(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+        rec.normal = unit_vector(cross(e1, e2));
+    }
+    if (uvs) {
+        const float *t0 = uvs + 2*idx[0], *t1 = uvs + 2*idx[1], *t2 = uvs + 2*idx[2];
+        rec.u = b0*t0[0] + b1*t1[0] + b2*t2[0];
+        rec.v = b0*t0[1] + b1*t1[1] + b2*t2[1];
+    }
+    else {
+        rec.u = b1;
+        rec.v = b2;
+    }
+}
+
+bool triangle_mesh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+    return hit_deferred(this, r, t_min, t_max, rec);
+}
+
+bool triangle_mesh::intersect(const ray& r, float t_min, float t_max, hit_query& q) const {
+    float b1, b2;
+    int tri = closest_triangle(r, t_min, t_max, b1, b2);
+    if (tri < 0)
+        return false;
+    set_query(q, t_max, this);
+    q.prim = tri;
+    q.b1 = b1;
+    q.b2 = b2;
+    return true;
+}
+
+void triangle_mesh::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    fill_record(r, q.prim, q.t, q.b1, q.b2, rec);
+}
+
+#endif
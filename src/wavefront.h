@@ -0,0 +1,402 @@
+#ifndef WAVEFRONTH
+#define WAVEFRONTH
+
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <vector>
+#include "adaptive.h"
+#include "camera.h"
+#include "denoise.h"
+#include "film.h"
+#include "direct_light.h"
+#include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+#include "perf_counter.h"
+#include "sampler.h"
+#include "stats.h"
+#include "timers.h"
+
+/// Número de caminos que se lanzan a la vez en el modo wavefront.
+const size_t wavefront_batch = 1 << 16;
+/// Número máximo de rebotes, el mismo que en color().
+const int wavefront_max_depth = 50;
+/// Bits por eje de la rejilla sobre la caja de la escena con la que se agrupan los orígenes de los rayos. Con el octante, la clave ocupa 30 bits.
+const int wavefront_bin_bits = 9;
+/// Bits de la clave que se ordenan en cada pasada de la ordenación por dígitos de bin_stage().
+const int wavefront_radix_bits = 10;
+
+/// Intercala los 10 bits bajos de x con dos ceros entre cada uno, para el código de Morton.
+inline uint32_t spread_bits(uint32_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+/** Caminos de un lote, en estructura de vectores (SoA): cada componente en su propio vector contiguo.
+  * Los datos de un camino no se mueven mientras vive; las etapas recorren la cola de índices de caminos activos.
+  * Todos los caminos de una ola llevan el mismo número de rebotes, así que la profundidad no se guarda por camino.
+  */
+struct path_soa {
+    /// Rayo actual.
+    std::vector<float> ox, oy, oz, dx, dy, dz, time;
+    /// Producto de atenuación*bsdf/pdf de los rebotes anteriores.
+    std::vector<float> beta_r, beta_g, beta_b;
+    /// Radiancia recogida hasta ahora.
+    std::vector<float> l_r, l_g, l_b;
+    /// Vértice anterior y densidad con la que su BSDF generó el rayo actual, para el peso MIS de la emisión (0 si no hay peso).
+    std::vector<float> px, py, pz, prev_pdf;
+    /// Píxel al que contribuye el camino, y posición de su muestra dentro del píxel, de izquierda a derecha y de arriba abajo.
+    std::vector<uint32_t> pixel;
+    std::vector<float> film_x, film_y;
+
+    size_t size() const { return pixel.size(); }
+    void resize(size_t n) {
+        std::vector<float> *f[] = {&ox, &oy, &oz, &dx, &dy, &dz, &time, &beta_r, &beta_g, &beta_b,
+                                   &l_r, &l_g, &l_b, &px, &py, &pz, &prev_pdf, &film_x, &film_y};
+        for (size_t k = 0; k < sizeof(f)/sizeof(f[0]); k++)
+            f[k]->resize(n);
+        pixel.resize(n);
+    }
+    ray get_ray(size_t i) const {
+        return ray(vec3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]), time[i]);
+    }
+    void set_ray(size_t i, const ray& r) {
+        ox[i] = r.origin().x(); oy[i] = r.origin().y(); oz[i] = r.origin().z();
+        dx[i] = r.direction().x(); dy[i] = r.direction().y(); dz[i] = r.direction().z();
+        time[i] = r.time();
+    }
+    vec3 beta(size_t i) const { return vec3(beta_r[i], beta_g[i], beta_b[i]); }
+    void set_beta(size_t i, const vec3& b) { beta_r[i] = b[0]; beta_g[i] = b[1]; beta_b[i] = b[2]; }
+    void add_radiance(size_t i, const vec3& c) { l_r[i] += c[0]; l_g[i] += c[1]; l_b[i] += c[2]; }
+};
+
+/// Rayos de sombra pendientes, en SoA, con el camino al que suman si no están bloqueados.
+struct shadow_soa {
+    std::vector<float> ox, oy, oz, dx, dy, dz, time, t_max;
+    std::vector<float> c_r, c_g, c_b;
+    std::vector<uint32_t> path;
+
+    size_t size() const { return path.size(); }
+    void clear() {
+        std::vector<float> *f[] = {&ox, &oy, &oz, &dx, &dy, &dz, &time, &t_max, &c_r, &c_g, &c_b};
+        for (size_t k = 0; k < sizeof(f)/sizeof(f[0]); k++)
+            f[k]->clear();
+        path.clear();
+    }
+    void push(uint32_t p, const light_sample& ls, const vec3& c) {
+        const ray& r = ls.shadow;
+        ox.push_back(r.origin().x()); oy.push_back(r.origin().y()); oz.push_back(r.origin().z());
+        dx.push_back(r.direction().x()); dy.push_back(r.direction().y()); dz.push_back(r.direction().z());
+        time.push_back(r.time());
+        t_max.push_back(ls.t_max);
+        c_r.push_back(c[0]); c_g.push_back(c[1]); c_b.push_back(c[2]);
+        path.push_back(p);
+    }
+};
+
+/** Integrador en modo wavefront (stream): en lugar de seguir cada camino hasta el final con recursión, se lanza un lote
+  * grande de caminos y cada etapa (intersección, ordenación por material, sombreado, rayos de sombra y compactación)
+  * se aplica a todo el lote antes de pasar a la siguiente. Cada etapa recorre vectores contiguos y hace siempre el
+  * mismo trabajo, lo que favorece la caché y deja el camino abierto a vectorizar el sombreado.
+  * Calcula el mismo estimador que color() o, con nee, que color_nee(), aunque consume los números aleatorios en otro orden.
+  */
+class wavefront_integrator {
+    public:
+        /** El constructor.
+           * @param w Escena.
+           * @param l Lista de emisores con sus materiales, para el modo nee.
+           * @param shape Objetos hacia los que muestrea la mezcla de densidades de color(), para el modo por defecto.
+           * @param use_nee Verdadero para el estimador de color_nee().
+           * @param use_bins Verdadero para agrupar los rayos secundarios con bin_stage() antes de intersecarlos.
+           */
+        wavefront_integrator(hittable *w, hittable *l, hittable *shape, bool use_nee, bool use_bins = false)
+            : world(w), lights(l), light_shape(shape), nee(use_nee), bins(use_bins), intersect_seconds(0), features(0), variance(0) {}
+        /** Renderiza la imagen completa.
+           * @param image Película de nx*ny píxeles en la que se acumulan las muestras.
+           */
+        void render(camera *cam, int nx, int ny, int ns, film& image);
+
+        /// Etapa 0: genera los rayos de cámara de las muestras [first, first+count).
+        void generate(camera *cam, int nx, int ny, int ns, size_t first, size_t count);
+        /** Etapa opcional antes de intersecar los rayos secundarios: ordena la cola por octante de la dirección y, dentro
+           * de cada octante, por el código de Morton del origen en una rejilla sobre la escena. Los rayos de cada grupo
+           * recorren las mismas ramas del BVH seguidos, y los nodos siguen en caché de un rayo al siguiente.
+           */
+        void bin_stage();
+        /// Etapa 1: intersección más cercana de los caminos activos. Los que no cortan nada terminan.
+        void intersect_stage();
+        /// Etapa 2: ordena por material los caminos que han cortado algo (ordenación por cuentas, estable), para sombrear seguidos los del mismo material.
+        void sort_stage();
+        /// Etapa 3: emisión, scatter y nuevo rayo de cada camino. En modo nee también deja los rayos de sombra en shadows.
+        void shade_stage(int depth);
+        /// Etapa 4: traza los rayos de sombra con occluded() y suma los que no están bloqueados.
+        void shadow_stage();
+        /// Etapa 5: vuelca en la película los caminos terminados tras depth rebotes y deja en active sólo los vivos.
+        void compact_stage(film& image, int depth);
+
+        hittable *world, *lights, *light_shape;
+        bool nee, bins;
+        /// Caja de la escena, para la rejilla de bin_stage().
+        aabb scene_box;
+        /// Tiempo total en intersect_stage() y fallos de caché contados en ella, si el sistema deja leer el contador.
+        double intersect_seconds;
+        hw_counter intersect_misses;
+        /// Si no son nulos, se guardan en ellos el primer impacto y la varianza de cada píxel para el filtro de ruido.
+        feature_buffers *features;
+        pixel_variance *variance;
+        path_soa paths;
+        /// Cola de caminos activos.
+        std::vector<uint32_t> active;
+        /// Resultado de la intersección de cada camino, y si sigue vivo.
+        std::vector<hit_record> records;
+        std::vector<char> alive;
+        /// Caminos que han cortado algo, ordenados por material.
+        std::vector<uint32_t> order;
+        /// Clave de bin_stage() de cada camino de la cola, y cola auxiliar para la ordenación.
+        std::vector<uint32_t> bin_keys, bin_tmp;
+        /// Materiales vistos hasta ahora y, por camino, el índice de su material en esa lista.
+        std::vector<material *> materials;
+        std::vector<uint32_t> material_slot;
+        /// Muestra de cada camino, con lo que lleva consumido de cada flujo del sampler.
+        std::vector<sample_state> sample_states;
+        shadow_soa shadows;
+};
+
+void wavefront_integrator::generate(camera *cam, int nx, int ny, int ns, size_t first, size_t count) {
+    TRACE_SCOPE("generate");
+    paths.resize(count);
+    records.resize(count);
+    alive.resize(count);
+    material_slot.resize(count);
+    sample_states.resize(count);
+    active.resize(count);
+    for (size_t k = 0; k < count; k++) {
+        active[k] = k;
+        size_t s = first + k;
+        uint32_t pixel = s / ns;
+        int i = pixel % nx;
+        int j = ny - 1 - pixel / nx;
+        start_sample(sample_states[k], pixel, s % ns);
+        use_sample_state(&sample_states[k]);
+        float du, dv;
+        sample_2d(stream_pixel, du, dv);
+        float u = float(i+du)/ float(nx);
+        float v = float(j+dv)/ float(ny);
+        paths.set_ray(k, cam->get_ray(u, v));
+        paths.set_beta(k, vec3(1, 1, 1));
+        paths.l_r[k] = paths.l_g[k] = paths.l_b[k] = 0;
+        paths.prev_pdf[k] = 0;
+        paths.pixel[k] = pixel;
+        paths.film_x[k] = du;
+        paths.film_y[k] = 1 - dv;
+    }
+    use_sample_state(0);
+}
+
+void wavefront_integrator::bin_stage() {
+    TRACE_SCOPE("bin");
+    vec3 lo = scene_box.min(), extent = scene_box.max() - scene_box.min();
+    float cells = float(1 << wavefront_bin_bits);
+    bin_keys.resize(paths.size());
+    for (size_t k = 0; k < active.size(); k++) {
+        uint32_t i = active[k];
+        uint32_t octant = (paths.dx[i] < 0) | ((paths.dy[i] < 0) << 1) | ((paths.dz[i] < 0) << 2);
+        float o[3] = {paths.ox[i], paths.oy[i], paths.oz[i]};
+        uint32_t cell[3];
+        for (int a = 0; a < 3; a++) {
+            float x = extent[a] > 0 ? (o[a] - lo[a]) / extent[a] * cells : 0;
+            cell[a] = x <= 0 ? 0 : (x >= cells - 1 ? (1 << wavefront_bin_bits) - 1 : uint32_t(x));
+        }
+        bin_keys[i] = (octant << 3*wavefront_bin_bits) | spread_bits(cell[0]) | (spread_bits(cell[1]) << 1) | (spread_bits(cell[2]) << 2);
+    }
+    // Ordenación por dígitos de menos a más significativo, estable en cada pasada.
+    bin_tmp.resize(active.size());
+    const uint32_t buckets = 1 << wavefront_radix_bits;
+    std::vector<uint32_t> count(buckets);
+    for (int shift = 0; shift < 3*wavefront_bin_bits + 3; shift += wavefront_radix_bits) {
+        std::fill(count.begin(), count.end(), 0);
+        for (size_t k = 0; k < active.size(); k++)
+            count[(bin_keys[active[k]] >> shift) & (buckets - 1)]++;
+        uint32_t sum = 0;
+        for (uint32_t b = 0; b < buckets; b++) {
+            uint32_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (size_t k = 0; k < active.size(); k++)
+            bin_tmp[count[(bin_keys[active[k]] >> shift) & (buckets - 1)]++] = active[k];
+        active.swap(bin_tmp);
+    }
+}
+
+void wavefront_integrator::intersect_stage() {
+    TRACE_SCOPE("intersect");
+    std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+    intersect_misses.start();
+    for (size_t k = 0; k < active.size(); k++) {
+        uint32_t i = active[k];
+        ray r = paths.get_ray(i);
+        hit_query q;
+        alive[i] = world->intersect(r, 0.001, FLT_MAX, q);
+        if (alive[i])
+            resolve_hit(r, q, records[i]);
+    }
+    intersect_misses.stop();
+    intersect_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+}
+
+void wavefront_integrator::sort_stage() {
+    TRACE_SCOPE("sort");
+    // Hay pocos materiales distintos, así que basta una búsqueda lineal empezando por el último encontrado.
+    std::vector<uint32_t> count(materials.size(), 0);
+    uint32_t last = 0;
+    for (size_t k = 0; k < active.size(); k++) {
+        uint32_t i = active[k];
+        if (!alive[i])
+            continue;
+        material *m = records[i].mat_ptr;
+        if (last >= materials.size() || materials[last] != m) {
+            last = std::find(materials.begin(), materials.end(), m) - materials.begin();
+            if (last == materials.size()) {
+                materials.push_back(m);
+                count.push_back(0);
+            }
+        }
+        material_slot[i] = last;
+        count[last]++;
+    }
+    uint32_t sum = 0;
+    for (size_t m = 0; m < count.size(); m++) {
+        uint32_t c = count[m];
+        count[m] = sum;
+        sum += c;
+    }
+    order.resize(sum);
+    for (size_t k = 0; k < active.size(); k++) {
+        uint32_t i = active[k];
+        if (alive[i])
+            order[count[material_slot[i]]++] = i;
+    }
+}
+
+void wavefront_integrator::shade_stage(int depth) {
+    TRACE_SCOPE("shade");
+    shadows.clear();
+    for (size_t k = 0; k < order.size(); k++) {
+        uint32_t i = order[k];
+        use_sample_state(&sample_states[i]);
+        const hit_record& hrec = records[i];
+        ray r = paths.get_ray(i);
+        if (features && depth == 0)
+            features->add(paths.pixel[i], r, hrec);
+        vec3 beta = paths.beta(i);
+        vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.p);
+        if (nee && paths.prev_pdf[i] > 0 && emitted.squared_length() > 0)
+            emitted *= power_heuristic(paths.prev_pdf[i], lights->pdf_value(vec3(paths.px[i], paths.py[i], paths.pz[i]), r.direction()));
+        paths.add_radiance(i, beta * emitted);
+        scatter_record srec;
+        if (depth >= wavefront_max_depth || !hrec.mat_ptr->scatter(r, hrec, srec)) {
+            alive[i] = false;
+            continue;
+        }
+        if (srec.is_specular) {
+            paths.set_ray(i, srec.specular_ray);
+            paths.set_beta(i, beta * srec.attenuation);
+            paths.prev_pdf[i] = 0;
+            continue;
+        }
+        ray scattered;
+        float pdf_val;
+        if (nee) {
+            light_sample ls;
+            if (sample_direct_light(r, hrec, srec, lights, ls))
+                shadows.push(i, ls, beta * ls.contribution);
+            scattered = ray(hrec.p, srec.pdf_ptr->generate(), r.time());
+            pdf_val = srec.pdf_ptr->value(scattered.direction());
+        }
+        else {
+            hittable_pdf plight(light_shape, hrec.p);
+            mixture_pdf p(&plight, srec.pdf_ptr);
+            scattered = ray(hrec.p, p.generate(), r.time());
+            pdf_val = p.value(scattered.direction());
+        }
+        delete srec.pdf_ptr;
+        // color_nee corta el camino si la BSDF no puede generar la dirección; color() divide igualmente.
+        if (nee && pdf_val <= 0) {
+            alive[i] = false;
+            continue;
+        }
+        paths.set_ray(i, scattered);
+        paths.set_beta(i, beta * srec.attenuation * hrec.mat_ptr->scattering_pdf(r, hrec, scattered) / pdf_val);
+        paths.px[i] = hrec.p.x(); paths.py[i] = hrec.p.y(); paths.pz[i] = hrec.p.z();
+        paths.prev_pdf[i] = pdf_val;
+    }
+    use_sample_state(0);
+}
+
+void wavefront_integrator::shadow_stage() {
+    TRACE_SCOPE("shadow");
+    STAT_ADD(shadow_rays, shadows.size());
+    for (size_t k = 0; k < shadows.size(); k++) {
+        ray r(vec3(shadows.ox[k], shadows.oy[k], shadows.oz[k]), vec3(shadows.dx[k], shadows.dy[k], shadows.dz[k]), shadows.time[k]);
+        if (!world->occluded(r, 0.001, shadows.t_max[k]))
+            paths.add_radiance(shadows.path[k], vec3(shadows.c_r[k], shadows.c_g[k], shadows.c_b[k]));
+    }
+}
+
+void wavefront_integrator::compact_stage(film& image, int depth) {
+    TRACE_SCOPE("compact");
+    for (size_t k = 0; k < active.size(); k++) {
+        uint32_t i = active[k];
+        if (alive[i])
+            continue;
+        STAT_PATH(depth);
+        vec3 c(paths.l_r[i], paths.l_g[i], paths.l_b[i]);
+        // Igual que en el bucle de main: una muestra con NaN no estropea el píxel.
+        for (int a = 0; a < 3; a++)
+            if (!(c[a] == c[a]))
+                c[a] = 0;
+        uint32_t pixel = paths.pixel[i];
+        image.add_sample(pixel % image.x1, pixel / image.x1, paths.film_x[i], paths.film_y[i], c);
+        if (variance)
+            variance->add(paths.pixel[i], c);
+    }
+    // Los vivos conservan el orden de la cola, que para los rayos de cámara es el de los píxeles: el orden por material
+    // sólo se usa para sombrear, porque desordenaría el recorrido del BVH.
+    size_t live = 0;
+    for (size_t k = 0; k < active.size(); k++)
+        if (alive[active[k]])
+            active[live++] = active[k];
+    active.resize(live);
+}
+
+void wavefront_integrator::render(camera *cam, int nx, int ny, int ns, film& image) {
+    size_t total = size_t(nx)*ny*ns;
+    if (bins && !world->bounding_box(0, 1, scene_box))
+        bins = false;
+    for (size_t first = 0; first < total; first += wavefront_batch) {
+        TRACE_SCOPE("batch");
+        generate(cam, nx, ny, ns, first, std::min(wavefront_batch, total - first));
+        for (int depth = 0; active.size() > 0; depth++) {
+            // Los rayos de cámara ya salen en orden de píxeles, que es coherente: sólo se agrupan los secundarios.
+            if (bins && depth > 0)
+                bin_stage();
+            if (depth == 0)
+                STAT_ADD(primary_rays, active.size());
+            else
+                STAT_ADD(secondary_rays, active.size());
+            intersect_stage();
+            sort_stage();
+            shade_stage(depth);
+            shadow_stage();
+            compact_stage(image, depth);
+        }
+    }
+}
+
+#endif
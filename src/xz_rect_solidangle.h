@@ -4,13 +4,14 @@
 
 #include "hittable.h"
 #include "random.h"
+#include "sampler.h"
 #include "rectangleMap.h"
+#include "stats.h"
 
 /** Clase rectángulo, subclase de hittable, que representa el modelo de un rectángulo paralelo al plano XZ con capacidad de generar puntos aleatorios uniformemente en función del ángulo sólido.
   */
 class xz_rect_sa: public hittable  {
     public:
-        SphQuad squad;
         material  *mp;
         float x0, x1, z0, z1, k;
         xz_rect_sa() {}
@@ -18,15 +19,20 @@ class xz_rect_sa: public hittable  {
         xz_rect_sa(float _x0, float _x1, float _z0, float _z1, float _k, material *mat) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
         /// Función que calcula si un rayo r interseca con el rectángulo en [t0, t1], y guarda los datos de intersección en el hit_record rec.
         virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const;
+        /// Sólo busca t, sin rellenar el hit_record.
+        virtual bool intersect(const ray& r, float t0, float t1, hit_query& q) const;
+        /// Rellena el hit_record de una intersección encontrada por intersect.
+        virtual void surface(const ray& r, const hit_query& q, hit_record& rec) const;
         /// Calcula la caja que engloba al rectángulo. Como es dos dimensional, la caja añade "altura" en el eje en el que el rectángulo es plano.
         virtual bool bounding_box(float t0, float t1, aabb& box) const {
             box =  aabb(vec3(x0,k-0.0001,z0), vec3(x1, k+0.0001, z1));
             return true;
         }
-        /// Genera la función de densidad del punto elegido con random. Es en función del ángulo sólido, así que es constante.
+        /// Genera la función de densidad del punto elegido con random. Es en función del ángulo sólido, así que es constante para cada o.
         virtual float  pdf_value(const vec3& o, const vec3& v) const {
-            hit_record rec;
-            if (this->hit(ray(o, v), 0.001, FLT_MAX, rec)) {
+            if (this->occluded(ray(o, v), 0.001, FLT_MAX)) {
+                SphQuad squad;
+                SphQuadInit(squad, vec3(x0,k,z0), vec3(x1-x0,0,0), vec3(0,0,z1-z0), o);
                 return (1.0/squad.S);
             }
             else
@@ -34,8 +40,11 @@ class xz_rect_sa: public hittable  {
         }
         /// Genera un vector desde el punto o hacia un punto escogido de forma uniforme en el rectángulo en función del ángulo sólido.
         virtual vec3 random(const vec3& o) {
+          STAT_INC(light_samples[stat_light_xz_rect_sa]);
+          SphQuad squad;
           SphQuadInit(squad, vec3(x0,k,z0), vec3(x1-x0,0,0), vec3(0,0,z1-z0), o);
-          float u = random_double(), v = random_double();
+          float u, v;
+          sample_2d(stream_light_uv, u, v);
           squad.p = vec3(x0 + (x1-x0)*u, k, z0+(z1-z0)*v);
           vec3 random_v = SphQuadSample(squad, u, v);
           return random_v-o;
@@ -49,6 +58,17 @@ class xz_rect_sa: public hittable  {
    * @return Booleano, es verdadero si interseca y false si no.
    */
 bool xz_rect_sa::hit(const ray& r, float t0, float t1, hit_record& rec) const {
+    return hit_deferred(this, r, t0, t1, rec);
+}
+
+/** Primera fase de la intersección: sólo calcula t y comprueba que el punto cae dentro del rectángulo.
+   * @param r Rayo que podría intersecar al rectángulo.
+   * @param t0 valor inicial del intervalo.
+   * @param t1 valor final del intervalo.
+   * @param q Donde se apunta la intersección si la hay.
+   * @return Booleano, es verdadero si interseca y false si no.
+   */
+bool xz_rect_sa::intersect(const ray& r, float t0, float t1, hit_query& q) const {
     float t = (k-r.origin().y()) / r.direction().y();
     if (t < t0 || t > t1)
         return false;
@@ -56,13 +76,22 @@ bool xz_rect_sa::hit(const ray& r, float t0, float t1, hit_record& rec) const {
     float z = r.origin().z() + t*r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x-x0)/(x1-x0);
-    rec.v = (z-z0)/(z1-z0);
-    rec.t = t;
+    set_query(q, t, this);
+    return true;
+}
+
+/** Segunda fase: rellena el hit_record (punto, normal, uv y material) de la intersección q.
+   * @param r Rayo que ha intersecado al rectángulo.
+   * @param q Intersección encontrada por intersect.
+   * @param rec hit_record donde se devuelve el resultado.
+   */
+void xz_rect_sa::surface(const ray& r, const hit_query& q, hit_record& rec) const {
+    rec.t = q.t;
+    rec.p = r.point_at_parameter(q.t);
+    rec.u = (rec.p.x()-x0)/(x1-x0);
+    rec.v = (rec.p.z()-z0)/(z1-z0);
     rec.mat_ptr = mp;
-    rec.p = r.point_at_parameter(t);
     rec.normal = vec3(0, 1, 0);
-    return true;
 }
 
 #endif